@@ -11,22 +11,164 @@ typedef uintptr_t uint;
 
 #define ERR_VAL -1
 
+#define EVAL_STEPS_UNLIMITED SIZE_MAX
+
+// NOTE: options for `eval_set_option`
+#define EVAL_OPTION_INTERN   1 // hash-cons rule results, value is 0 or 1
+#define EVAL_OPTION_MEMO     2 // memoize applications, value is the cache size, 0 disables
+#define EVAL_OPTION_PARALLEL 3 // workers for unbounded `eval_run`, 0 or 1 disables
+#define EVAL_OPTION_LAZY     4 // call-by-need with shared thunks, value is 0 or 1
+#define EVAL_OPTION_ENGINE   5 // one of EVAL_ENGINE_*
+#define EVAL_OPTION_FUSE     6 // one of EVAL_FUSE_*, the cells engine only
+
+#define EVAL_ENGINE_CELLS   0 // rules read the cells directly
+#define EVAL_ENGINE_DECODED 1 // the heap is translated into a node array first
+
+#define EVAL_FUSE_OFF   0 // plain rules only
+#define EVAL_FUSE_ON    1 // idioms recognized at load time are reduced in one step
+#define EVAL_FUSE_CHECK 2 // as on, but plain rules run too and must agree with the fused result
+
+// NOTE: rules counted by `eval_get_stats`
+#define EVAL_RULE_0A     0
+#define EVAL_RULE_0B     1
+#define EVAL_RULE_1      2
+#define EVAL_RULE_2      3
+#define EVAL_RULE_3A     4
+#define EVAL_RULE_3B     5
+#define EVAL_RULE_3C     6
+#define EVAL_RULE_NATIVE 7
+#define EVAL_RULE_FUSED  8 // an idiom reduced in one step, see EVAL_FUSE_ON
+#define EVAL_RULES       9
+
+// NOTE: rule of a traced fused step, and the result of a traced step that pushed no node
+#define EVAL_TRACE_FUSED EVAL_RULE_FUSED
+#define EVAL_TRACE_NONE  UINT64_MAX
+
+// NOTE: error codes, see `eval_get_error`
+#define ERROR_PARSE           1
+#define ERROR_STACK_UNDERFLOW 2
+#define ERROR_APPLY_TO_VALUE  3
+#define ERROR_INVALID_TREE    4
+#define ERROR_INVALID_CAST    5
+#define ERROR_FUSE_MISMATCH   6
+#define ERROR_DIVIDE_BY_ZERO  7
+#define ERROR_GENERIC         127
+
 _Static_assert(sizeof(void (*)()) <= 8, "Function pointer too large");
 
 typedef struct eval_state_t eval_state_t;
 typedef struct allocator_t allocator_t;
 typedef size_t (*native_function_t)(eval_state_t*, size_t);
 typedef struct string_buffer_t string_buffer_t;
+// NOTE: receives output in chunks, non zero stops the writer
+typedef sint (*eval_writer_t)(void* ctx, const char* data, size_t len);
+
+typedef struct {
+  size_t capacity;      // cells covered by the free bitmap
+  size_t top;           // everything above is untouched
+  size_t used;          // allocated cells
+  size_t free_listed;   // free cells below top kept in exact size lists
+  size_t free_runs;     // free cells below top kept in carvable runs
+  size_t largest_run;   // biggest contiguous free block below top
+  size_t collections;   // garbage collections so far
+  size_t allocated;     // cells allocated so far
+  double fragmentation; // 1 - largest_run / free cells below top
+} eval_heap_stats_t;
+
+typedef struct {
+  size_t lookups;  // rule results looked up in the intern table
+  size_t hits;     // of them resolved to an existing node
+  size_t entries;  // canonical nodes known
+  double hit_rate; // hits / lookups
+} eval_intern_stats_t;
+
+typedef struct {
+  size_t capacity;  // entries the cache can hold
+  size_t lookups;   // applications looked up
+  size_t hits;      // of them answered from the cache
+  size_t evictions; // entries replaced to make room
+  double hit_rate;  // hits / lookups
+} eval_memo_stats_t;
+
+// NOTE: counted only in builds with EVAL_STATS defined, zero otherwise. Counts are kept
+// since `eval_init` or the last `eval_reset`, tasks of a parallel run aren't included
+typedef struct {
+  sint enabled;             // built with EVAL_STATS
+  size_t rules[EVAL_RULES]; // steps per EVAL_RULE_*
+  size_t cells_allocated;   //
+  size_t cells_freed;       // by collections
+  size_t run_probes;        // free runs looked at by the allocator
+  size_t payload_lookups;   // payload words located through the rank of their cell
+  size_t apply_stack_peak;  //
+  size_t result_stack_peak; //
+  size_t heap_growths;      // times the heap capacity was doubled
+  double wall_time;         // seconds spent in `eval_step` and `eval_run`
+} eval_stats_t;
+
+// NOTE: one traced step, see `eval_trace_start`. Saved to trace files as is
+typedef struct {
+  uint64_t step;   // reduce calls since the trace started
+  uint64_t f;      // applied node
+  uint64_t z;      // its argument
+  uint64_t result; // node pushed by rules 0.a, 0.b, 1, 3a, natives and fused steps
+  uint32_t cells;  // cells allocated by the step
+  uint32_t rule;   // one of EVAL_RULE_* or EVAL_TRACE_FUSED
+} eval_trace_record_t;
+
+typedef struct {
+  u8 code;              // one of ERROR_*, 0 when there is no error
+  const char* file;     // where the error was raised
+  const char* function; //
+  size_t line;          //
+  const char* message;  // messages written since the error was cleared
+} eval_error_t;
+
+// NOTE: one program of `eval_batch`, the state is loaded by the caller and run in place
+typedef struct {
+  eval_state_t* state;
+  size_t max_steps; // EVAL_STEPS_UNLIMITED to run to completion
+  sint done;        // result of `eval_run`
+  size_t steps;     // steps taken
+  u8 error_code;    // of the state once it stopped, see `eval_get_error`
+} eval_batch_item_t;
 
 sint eval_init(eval_state_t** state);
 sint eval_free(eval_state_t** state);
 sint eval_step(eval_state_t* state);
+sint eval_run(eval_state_t* state, size_t max_steps, size_t* steps_done);
 u8 eval_get_error(eval_state_t* state, const char** message);
+sint eval_get_error_info(eval_state_t* state, eval_error_t* error);
 sint eval_dump_json(struct string_buffer_t* json_out, eval_state_t* state);
+sint eval_dump_json_fd(int fd, eval_state_t* state);
+sint eval_dump_json_stream(eval_writer_t write, void* ctx, eval_state_t* state);
 sint eval_load_json(const char* json, eval_state_t* state);
+sint eval_load_json_fd(int fd, eval_state_t* state);
+sint eval_snapshot_save(eval_state_t* state, const char* path);
+sint eval_snapshot_load(eval_state_t* state, const char* path);
 sint eval_reset(eval_state_t* state);
 sint eval_add_native(eval_state_t* state, const char* name, uint symbol);
 sint eval_get_native(eval_state_t* state, const char* name, uint* symbol);
+sint eval_gc(eval_state_t* state);
+sint eval_heap_stats(eval_state_t* state, eval_heap_stats_t* stats);
+sint eval_set_option(eval_state_t* state, sint option, sint value);
+sint eval_intern_stats(eval_state_t* state, eval_intern_stats_t* stats);
+sint eval_memo_stats(eval_state_t* state, eval_memo_stats_t* stats);
+sint eval_get_stats(eval_state_t* state, eval_stats_t* stats);
+sint eval_dump_stats_json(struct string_buffer_t* json_out, eval_state_t* state);
+// NOTE: step tracing into a ring of the last capacity records, the cells engine only.
+// A snapshot saved at the start is where `trace_eval` replays the trace from
+sint eval_trace_start(eval_state_t* state, size_t capacity, const char* snapshot_path);
+sint eval_trace_stop(eval_state_t* state);
+sint eval_trace_read(
+    eval_state_t* state, eval_trace_record_t* records, size_t capacity, size_t* count);
+sint eval_trace_save(eval_state_t* state, const char* path);
+sint eval_batch(eval_batch_item_t* items, size_t items_count, size_t workers_count);
+size_t eval_batch_default_workers(void);
+// NOTE: where `io.print` writes, stdout by default. Output is batched, see output.h
+sint eval_set_output(eval_state_t* state, eval_writer_t write, void* ctx);
+sint eval_set_output_fd(eval_state_t* state, int fd);
+sint eval_set_output_buffer(eval_state_t* state, struct string_buffer_t* buffer);
+sint eval_flush_output(eval_state_t* state);
 
 sint eval_cells_init(allocator_t** cells, size_t words_count);
 sint eval_cells_free(allocator_t** cells);
@@ -34,7 +176,10 @@ sint eval_cells_get(allocator_t* cells, size_t index);
 sint eval_cells_get_word(allocator_t* cells, size_t index, sint* word);
 sint eval_cells_set(allocator_t* cells, size_t index, uint8_t value);
 sint eval_cells_set_word(allocator_t* cells, size_t index, sint value);
+sint eval_cells_drop_word(allocator_t* cells, size_t index);
 sint eval_cells_is_set(allocator_t* cells, size_t index);
+sint eval_cells_subtree_end(allocator_t* cells, size_t index, size_t* end);
+sint eval_cells_subtree_end_scalar(allocator_t* cells, size_t index, size_t* end);
 sint eval_cells_reset(allocator_t* cells);
 
 sint native_load_standard(eval_state_t* state);
@@ -0,0 +1,148 @@
+#define _POSIX_C_SOURCE 200809L
+#include "api.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "eval.h"
+
+// NOTE: items are dealt round-robin onto per-worker deques. A worker takes its own items
+// from the front and, once it runs out, steals from the back of the others. Items never
+// spawn work, so a worker that finds every deque empty is done
+
+typedef struct {
+  pthread_mutex_t lock;
+  size_t* items;
+  size_t head;
+  size_t tail;
+} batch_deque_t;
+
+typedef struct {
+  eval_batch_item_t* items;
+  batch_deque_t* deques;
+  size_t workers_count;
+} batch_t;
+
+typedef struct {
+  batch_t* batch;
+  size_t id;
+} batch_worker_t;
+
+static bool deque_pop_front(batch_deque_t* deque, size_t* item) {
+  pthread_mutex_lock(&deque->lock);
+  bool found = deque->head < deque->tail;
+  if (found) {
+    *item = deque->items[deque->head++];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+static bool deque_steal_back(batch_deque_t* deque, size_t* item) {
+  pthread_mutex_lock(&deque->lock);
+  bool found = deque->head < deque->tail;
+  if (found) {
+    *item = deque->items[--deque->tail];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+static bool next_item(batch_t* batch, size_t id, size_t* item) {
+  if (deque_pop_front(&batch->deques[id], item)) {
+    return true;
+  }
+  for (size_t i = 1; i < batch->workers_count; ++i) {
+    if (deque_steal_back(&batch->deques[(id + i) % batch->workers_count], item)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void run_item(eval_batch_item_t* item) {
+  item->steps = 0;
+  item->done = eval_run(item->state, item->max_steps, &item->steps);
+  item->error_code = eval_get_error(item->state, NULL);
+}
+
+static void* batch_worker(void* arg) {
+  batch_worker_t* worker = arg;
+  size_t item = 0;
+  while (next_item(worker->batch, worker->id, &item)) {
+    run_item(&worker->batch->items[item]);
+  }
+  return NULL;
+}
+
+size_t eval_batch_default_workers(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 0 ? (size_t)cpus : 1;
+}
+
+sint eval_batch(eval_batch_item_t* items, size_t items_count, size_t workers_count) {
+  if (!items && items_count) {
+    return ERR_VAL;
+  }
+  if (workers_count == 0) {
+    workers_count = eval_batch_default_workers();
+  }
+  if (workers_count > items_count) {
+    workers_count = items_count;
+  }
+  if (workers_count <= 1) {
+    for (size_t i = 0; i < items_count; ++i) {
+      run_item(&items[i]);
+    }
+    return 0;
+  }
+
+  sint err = 0;
+  batch_t batch = {.items = items, .workers_count = workers_count};
+  batch.deques = calloc(workers_count, sizeof(*batch.deques));
+  size_t* slots = malloc(items_count * sizeof(*slots));
+  pthread_t* threads = malloc(workers_count * sizeof(*threads));
+  batch_worker_t* workers = malloc(workers_count * sizeof(*workers));
+  if (!batch.deques || !slots || !threads || !workers) {
+    err = ERR_VAL;
+    goto error;
+  }
+
+  // NOTE: worker w owns items w, w + workers_count, ... laid out contiguously in slots
+  size_t offset = 0;
+  for (size_t w = 0; w < workers_count; ++w) {
+    batch_deque_t* deque = &batch.deques[w];
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->items = slots + offset;
+    for (size_t i = w; i < items_count; i += workers_count) {
+      deque->items[deque->tail++] = i;
+    }
+    offset += deque->tail;
+  }
+
+  size_t started = 0;
+  for (; started < workers_count; ++started) {
+    workers[started] = (batch_worker_t){.batch = &batch, .id = started};
+    if (pthread_create(&threads[started], NULL, batch_worker, &workers[started]) != 0) {
+      break;
+    }
+  }
+  if (started == 0) {
+    // NOTE: no threads to be had, stealing lets one worker run every item
+    batch_worker(&(batch_worker_t){.batch = &batch, .id = 0});
+  }
+  for (size_t w = 0; w < started; ++w) {
+    pthread_join(threads[w], NULL);
+  }
+  for (size_t w = 0; w < workers_count; ++w) {
+    pthread_mutex_destroy(&batch.deques[w].lock);
+  }
+
+error:
+  free(batch.deques);
+  free(slots);
+  free(threads);
+  free(workers);
+  return err;
+}
@@ -0,0 +1,511 @@
+#define _POSIX_C_SOURCE 199309L
+#include "api.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vendor/stb_ds.h"
+
+#include "config.h"
+#include "util.h"
+
+// NOTE: evaluation benchmarks, one JSON object per line
+
+static const char* MM_IMAGE = "{\"cells\": {\"state\": \"^^^^^^****^^****^^^^****^^***"
+                              "^^^^^^****^^****^^^^****^^***\", \"words\": []},"
+                              " \"apply_stack\": [-1, 0, 29], \"result_stack\": []}";
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// NOTE: many small independent programs, scaling from one worker to every core
+static void bench_batch(size_t items_count, size_t steps) {
+  eval_batch_item_t* items = calloc(items_count, sizeof(*items));
+  for (size_t i = 0; i < items_count; ++i) {
+    eval_init(&items[i].state);
+  }
+
+  size_t max_workers = eval_batch_default_workers();
+  double single = 0;
+  size_t workers = 1;
+  while (true) {
+    for (size_t i = 0; i < items_count; ++i) {
+      eval_load_json(MM_IMAGE, items[i].state);
+      items[i].max_steps = steps;
+    }
+    double start = now_ns();
+    eval_batch(items, items_count, workers);
+    double elapsed = now_ns() - start;
+    if (workers == 1) {
+      single = elapsed;
+    }
+    size_t total_steps = 0;
+    for (size_t i = 0; i < items_count; ++i) {
+      total_steps += items[i].steps;
+    }
+    printf(
+        "{\"bench\": \"batch\", \"workers\": %zu, \"items\": %zu, \"steps\": %zu, "
+        "\"ms\": %.2f, \"steps_per_us\": %.2f, \"speedup\": %.2f}\n",
+        workers,
+        items_count,
+        total_steps,
+        elapsed / 1e6,
+        (double)total_steps / (elapsed / 1e3),
+        single / elapsed);
+    if (workers == max_workers) {
+      break;
+    }
+    workers = workers * 2 < max_workers ? workers * 2 : max_workers;
+  }
+
+  for (size_t i = 0; i < items_count; ++i) {
+    eval_free(&items[i].state);
+  }
+  free(items);
+}
+
+// NOTE: one program under both strategies, loading included since most run to their
+// normal form in a few steps
+static void bench_strategies(const char* program, const char* json, size_t steps, size_t runs) {
+  static const char* modes[] = {"strict", "lazy", "decoded", "fused"};
+  for (sint mode = 0; mode < 4; ++mode) {
+    eval_state_t* state = NULL;
+    eval_init(&state);
+    eval_set_option(state, EVAL_OPTION_LAZY, mode == 1);
+    eval_set_option(state, EVAL_OPTION_ENGINE, mode == 2 ? EVAL_ENGINE_DECODED : EVAL_ENGINE_CELLS);
+    eval_set_option(state, EVAL_OPTION_FUSE, mode == 3 ? EVAL_FUSE_ON : EVAL_FUSE_OFF);
+    size_t total_steps = 0;
+    bool done = true;
+    double start = now_ns();
+    for (size_t i = 0; i < runs; ++i) {
+      eval_load_json(json, state);
+      size_t run_steps = 0;
+      done &= eval_run(state, steps, &run_steps) == 1;
+      total_steps += run_steps;
+    }
+    double elapsed = now_ns() - start;
+    printf(
+        "{\"bench\": \"strategy\", \"program\": \"%s\", \"mode\": \"%s\", \"runs\": %zu, "
+        "\"steps\": %zu, \"done\": %s, \"ns_per_run\": %.1f, \"steps_per_us\": %.2f}\n",
+        program,
+        modes[mode],
+        runs,
+        total_steps / runs,
+        done ? "true" : "false",
+        elapsed / runs,
+        (double)total_steps / (elapsed / 1e3));
+    eval_free(&state);
+  }
+}
+
+// NOTE: the inputs of the eval-smoke suite, cut out of the file by matching braces
+static void bench_smoke(size_t runs) {
+  const char* path = PROJECT_ROOT PATH_SEP "tests" PATH_SEP "eval-smoke.json";
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    perror(path);
+    return;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char* text = calloc(size + 1, 1);
+  size_t read = fread(text, 1, size, file);
+  fclose(file);
+
+  char* cursor = text;
+  while (read > 0 && (cursor = strstr(cursor, "\"name\": \"")) != NULL) {
+    char* name = cursor + strlen("\"name\": \"");
+    char* input = strstr(name, "\"input\": ");
+    if (!input) {
+      break;
+    }
+    *strchr(name, '"') = '\0';
+    input = strchr(input, '{');
+    char* end = input;
+    for (size_t depth = 0; *end; ++end) {
+      depth += *end == '{';
+      depth -= *end == '}';
+      if (depth == 0) {
+        break;
+      }
+    }
+    char saved = *++end;
+    *end = '\0';
+    bench_strategies(name, input, EVAL_STEPS_UNLIMITED, runs);
+    *end = saved;
+    cursor = end;
+  }
+  free(text);
+}
+
+// NOTE: the corpus programs are lambda terms over the leaf, compiled to trees by bracket
+// abstraction with K = ^^, S p q = ^(^p)q and I = ^(^K)K. Reduction is strict, so recursion
+// goes through wait x y = S (S (K x) (K y)) I, which waits for a third argument before
+// reducing x y. A compiled term is loaded with its values in the cells and its
+// applications on the apply stack
+
+#define TERM_LEAF 0
+#define TERM_APP  1
+#define TERM_VAR  2
+#define TERM_LAM  3
+#define TERM_WORD 4
+
+typedef struct term_t {
+  u8 kind;
+  bool value;         // a leaf, a word or the leaf applied to at most two values
+  bool lambdas;       // a lambda is inside
+  uint64_t free_vars; // bit per variable
+  int var;
+  const char* name; // of the native a word holds, NULL for a number
+  sint number;
+  struct term_t* lhs;
+  struct term_t* rhs;
+} term_t;
+
+static term_t** terms = NULL;
+
+static term_t* new_term(u8 kind) {
+  term_t* t = calloc(1, sizeof(*t));
+  t->kind = kind;
+  stbds_arrput(terms, t);
+  return t;
+}
+
+static void free_terms(void) {
+  for (size_t i = 0; i < stbds_arrlenu(terms); ++i) {
+    free(terms[i]);
+  }
+  stbds_arrfree(terms);
+}
+
+static term_t* L(void) {
+  static term_t* leaf = NULL;
+  if (!leaf) {
+    leaf = new_term(TERM_LEAF);
+    leaf->value = true;
+    stbds_arrpop(terms);
+  }
+  return leaf;
+}
+
+static term_t* ap(term_t* lhs, term_t* rhs) {
+  term_t* t = new_term(TERM_APP);
+  t->lhs = lhs;
+  t->rhs = rhs;
+  t->value = rhs->value
+             && (lhs->kind == TERM_LEAF || (lhs->value && lhs->lhs && lhs->lhs->kind == TERM_LEAF));
+  t->lambdas = lhs->lambdas || rhs->lambdas;
+  t->free_vars = lhs->free_vars | rhs->free_vars;
+  return t;
+}
+
+static term_t* ap2(term_t* f, term_t* a, term_t* b) {
+  return ap(ap(f, a), b);
+}
+
+static term_t* v(int var) {
+  term_t* t = new_term(TERM_VAR);
+  t->var = var;
+  t->free_vars = 1ull << var;
+  return t;
+}
+
+static term_t* lam(int var, term_t* body) {
+  term_t* t = new_term(TERM_LAM);
+  t->var = var;
+  t->lhs = body;
+  t->lambdas = true;
+  t->free_vars = body->free_vars & ~(1ull << var);
+  return t;
+}
+
+static term_t* word(const char* name, sint number) {
+  term_t* t = new_term(TERM_WORD);
+  t->name = name;
+  t->number = number;
+  t->value = true;
+  return t;
+}
+
+static term_t* stem(term_t* a) {
+  return ap(L(), a);
+}
+
+static term_t* fork(term_t* a, term_t* b) {
+  return ap2(L(), a, b);
+}
+
+static term_t* K(void) {
+  return stem(L());
+}
+
+static term_t* I(void) {
+  return fork(stem(K()), K());
+}
+
+static term_t* S(term_t* p, term_t* q) {
+  return fork(stem(p), q);
+}
+
+static term_t* triage(term_t* leaf, term_t* stem, term_t* fork_) {
+  return fork(fork(leaf, stem), fork_);
+}
+
+static term_t* wait(term_t* x, term_t* y) {
+  return S(S(ap(K(), x), ap(K(), y)), I());
+}
+
+// NOTE: eta reduction keeps the code small, terms are written so it never drops a wait
+static term_t* abstract(int var, term_t* t) {
+  if (!(t->free_vars & (1ull << var))) {
+    return ap(K(), t);
+  }
+  if (t->kind == TERM_VAR) {
+    return I();
+  }
+  if (t->rhs->kind == TERM_VAR && t->rhs->var == var && !(t->lhs->free_vars & (1ull << var))) {
+    return t->lhs;
+  }
+  return S(abstract(var, t->lhs), abstract(var, t->rhs));
+}
+
+static term_t* compile(term_t* t) {
+  if (!t->lambdas) {
+    return t;
+  }
+  if (t->kind == TERM_LAM) {
+    return abstract(t->var, compile(t->lhs));
+  }
+  return ap(compile(t->lhs), compile(t->rhs));
+}
+
+static term_t* fix(term_t* f) {
+  // NOTE: variables of the combinators are above the ones of the programs
+  term_t* omega = lam(60, ap(v(61), wait(v(60), v(60))));
+  return ap(lam(61, ap(omega, omega)), f);
+}
+
+static term_t* numeral(size_t n) {
+  term_t* t = L();
+  for (size_t i = 0; i < n; ++i) {
+    t = stem(t);
+  }
+  return t;
+}
+
+static term_t* complete_tree(size_t depth) {
+  return depth ? fork(complete_tree(depth - 1), complete_tree(depth - 1)) : L();
+}
+
+static term_t* integer(sint n) {
+  return fork(word("type.integer", 0), word(NULL, n));
+}
+
+typedef struct {
+  string_buffer_t* cells;
+  string_buffer_t* words;
+  string_buffer_t* stack;
+} image_t;
+
+static void put_word(image_t* image, term_t* t) {
+  size_t index = image->cells->len;
+  _sb_append_str(image->cells, "##*");
+  const char* separator = image->words->len ? ", " : "";
+  _sb_printf(image->words, "%s{\"index\": %zu, \"payload\": ", separator, index);
+  if (t->name) {
+    _sb_printf(image->words, "\"%s\"}", t->name);
+  } else {
+    _sb_printf(image->words, "%lld}", (long long)t->number);
+  }
+}
+
+// NOTE: values are written in preorder with an explicit stack, numerals get deep
+static size_t put_value(image_t* image, term_t* t) {
+  size_t index = image->cells->len;
+  term_t** pending = NULL;
+  stbds_arrput(pending, t);
+  while (stbds_arrlenu(pending) > 0) {
+    term_t* n = stbds_arrpop(pending);
+    if (!n) {
+      _sb_append_char(image->cells, '*');
+    } else if (n->kind == TERM_LEAF) {
+      _sb_append_str(image->cells, "^**");
+    } else if (n->kind == TERM_WORD) {
+      put_word(image, n);
+    } else if (n->lhs->kind == TERM_LEAF) {
+      _sb_append_char(image->cells, '^');
+      stbds_arrput(pending, NULL);
+      stbds_arrput(pending, n->rhs);
+    } else {
+      _sb_append_char(image->cells, '^');
+      stbds_arrput(pending, n->rhs);
+      stbds_arrput(pending, n->lhs->rhs);
+    }
+  }
+  stbds_arrfree(pending);
+  return index;
+}
+
+static void put_term(image_t* image, term_t* t) {
+  const char* separator = image->stack->len ? ", " : "";
+  if (t->value) {
+    _sb_printf(image->stack, "%s%zu", separator, put_value(image, t));
+    return;
+  }
+  _sb_printf(image->stack, "%s-1", separator);
+  put_term(image, t->lhs);
+  put_term(image, t->rhs);
+}
+
+static char* load_image(term_t* program) {
+  string_buffer_t cells, words, stack, json;
+  _sb_init(&cells);
+  _sb_init(&words);
+  _sb_init(&stack);
+  _sb_init(&json);
+  image_t image = {.cells = &cells, .words = &words, .stack = &stack};
+  put_term(&image, compile(program));
+  _sb_printf(
+      &json,
+      "{\"cells\": {\"state\": \"%s\", \"words\": [%s]}, \"apply_stack\": [%s], "
+      "\"result_stack\": []}",
+      _sb_str_view(&cells),
+      _sb_str_view(&words),
+      _sb_str_view(&stack));
+  _sb_free(&cells);
+  _sb_free(&words);
+  _sb_free(&stack);
+  return _sb_detach(&json);
+}
+
+static sint count_output(void* ctx, const char* data, size_t len) {
+  (void)data;
+  *(size_t*)ctx += len;
+  return 0;
+}
+
+static void bench_program(const char* name, term_t* program) {
+  char* json = load_image(program);
+  free_terms();
+  eval_state_t* state = NULL;
+  eval_init(&state);
+  native_load_standard(state);
+  size_t output = 0;
+  eval_set_output(state, count_output, &output);
+  eval_load_json(json, state);
+  free(json);
+
+  eval_heap_stats_t before = {}, after = {};
+  eval_heap_stats(state, &before);
+  size_t steps = 0;
+  double start = now_ns();
+  bool done = eval_run(state, EVAL_STEPS_UNLIMITED, &steps) == 1;
+  double elapsed = now_ns() - start;
+  eval_heap_stats(state, &after);
+  printf(
+      "{\"bench\": \"corpus\", \"program\": \"%s\", \"done\": %s, \"steps\": %zu, "
+      "\"ms\": %.2f, \"steps_per_s\": %.0f, \"ns_per_step\": %.2f, \"heap_peak\": %zu, "
+      "\"allocated\": %zu, \"collections\": %zu, \"output_bytes\": %zu}\n",
+      name,
+      done ? "true" : "false",
+      steps,
+      elapsed / 1e6,
+      steps / (elapsed / 1e9),
+      elapsed / (steps ? steps : 1),
+      after.top,
+      after.allocated - before.allocated,
+      after.collections - before.collections,
+      output);
+  eval_free(&state);
+}
+
+enum { F, M, N, U, W, H, T, A, B, X, Y, P, Q, R };
+
+// NOTE: unary numerals, ^ is 0 and ^n is n + 1
+static term_t* add(void) {
+  term_t* step = lam(U, stem(ap2(v(R), v(U), v(N))));
+  return fix(lam(R, lam(M, lam(N, ap(triage(v(N), step, lam(U, lam(W, v(N)))), v(M))))));
+}
+
+static term_t* mul(void) {
+  term_t* step = lam(U, ap2(add(), v(N), ap2(v(R), v(U), v(N))));
+  return fix(lam(R, lam(M, lam(N, ap(triage(L(), step, lam(U, lam(W, L()))), v(M))))));
+}
+
+// NOTE: lists are ^ head tail ending in a leaf
+static term_t* map(term_t* f) {
+  term_t* step = lam(H, lam(T, fork(ap(f, v(H)), ap(v(R), v(T)))));
+  return fix(lam(R, lam(X, ap(triage(L(), lam(U, L()), step), v(X)))));
+}
+
+static term_t* reverse(void) {
+  term_t* step = lam(H, lam(T, ap2(v(R), fork(v(H), v(A)), v(T))));
+  return ap(fix(lam(R, lam(A, lam(X, ap(triage(v(A), lam(U, v(A)), step), v(X)))))), L());
+}
+
+static term_t* list(size_t n, term_t* (*element)(size_t)) {
+  term_t* t = L();
+  for (size_t i = n; i > 0; --i) {
+    t = fork(element(i - 1), t);
+  }
+  return t;
+}
+
+static term_t* small_numeral(size_t i) {
+  return numeral(i % 8);
+}
+
+static term_t* letter(size_t i) {
+  return integer('a' + (sint)(i % 26));
+}
+
+// NOTE: true is ^ and false is ^^, both sides are reduced before comparing
+static term_t* equal(void) {
+  term_t* no = stem(L());
+  term_t* both = ap2(
+      lam(P, lam(Q, ap(triage(v(Q), lam(U, no), lam(U, lam(W, no))), v(P)))),
+      ap2(v(R), v(H), v(U)),
+      ap2(v(R), v(T), v(W)));
+  term_t* leaf = ap(triage(L(), lam(U, no), lam(U, lam(W, no))), v(B));
+  term_t* stem_ = lam(H, ap(triage(no, lam(U, ap2(v(R), v(H), v(U))), lam(U, lam(W, no))), v(B)));
+  term_t* fork_ = lam(H, lam(T, ap(triage(no, lam(U, no), lam(U, lam(W, both))), v(B))));
+  return fix(lam(R, lam(A, lam(B, ap(triage(leaf, stem_, fork_), v(A))))));
+}
+
+// NOTE: not tail recursive, the stacks grow with the numeral
+static term_t* twice(void) {
+  term_t* step = lam(U, stem(stem(ap(v(R), v(U)))));
+  return fix(lam(R, lam(N, ap(triage(L(), step, lam(U, lam(W, L()))), v(N)))));
+}
+
+static void bench_corpus(void) {
+  bench_program("numeral_mul", ap2(mul(), numeral(100), numeral(100)));
+  bench_program("list_map", ap(map(lam(X, stem(v(X)))), list(20000, small_numeral)));
+  bench_program("list_reverse", ap(reverse(), list(20000, small_numeral)));
+  bench_program("tree_equal", ap2(equal(), complete_tree(12), complete_tree(12)));
+  bench_program("deep_recursion", ap(twice(), numeral(50000)));
+  bench_program("io_print", ap(map(word("io.print", 0)), list(20000, letter)));
+}
+
+int main(int argc, char** argv) {
+  const char* only = argc > 1 ? argv[1] : NULL;
+  if (!only || strcmp(only, "batch") == 0) {
+    bench_batch(512, 10000);
+  }
+  if (!only || strcmp(only, "smoke") == 0) {
+    bench_smoke(10000);
+  }
+  if (!only || strcmp(only, "mm") == 0) {
+    bench_strategies("mm", MM_IMAGE, 100000, 10);
+  }
+  if (!only || strcmp(only, "corpus") == 0) {
+    bench_corpus();
+  }
+  return 0;
+}
@@ -0,0 +1,495 @@
+#define _POSIX_C_SOURCE 199309L
+#include "api.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "vendor/stb_ds.h"
+
+#include "eval.h"
+#include "fixtures.h"
+#include "heap.h"
+#include "memory.h"
+#include "util.h"
+
+// NOTE: micro-benchmarks for the hot internals, one JSON object per line
+
+typedef sint (*subtree_end_t)(allocator_t*, size_t, size_t*);
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// NOTE: a left spine of n forks over leaves, the right child of the root is at the very end
+static size_t write_spine(allocator_t* cells, size_t n) {
+  size_t index = 0;
+  for (size_t i = 0; i < n; ++i) {
+    eval_cells_set(cells, index++, SIGIL_TREE);
+  }
+  for (size_t i = 0; i < n + 1; ++i) {
+    eval_cells_set(cells, index++, SIGIL_NIL);
+  }
+  return index;
+}
+
+static void bench_subtree_end(
+    const char* name, const char* shape, allocator_t* cells, size_t cells_count, subtree_end_t f) {
+  size_t repeats = 1;
+  double elapsed = 0;
+  size_t end = 0;
+  while (true) {
+    double start = now_ns();
+    for (size_t r = 0; r < repeats; ++r) {
+      f(cells, 0, &end);
+    }
+    elapsed = now_ns() - start;
+    if (elapsed > 2e8 || repeats >= (1ULL << 24)) {
+      break;
+    }
+    repeats *= 2;
+  }
+  if (end != cells_count) {
+    fprintf(stderr, "%s: wrong subtree end %zu, expected %zu\n", name, end, cells_count);
+  }
+  double ns = elapsed / (double)repeats;
+  printf(
+      "{\"bench\": \"%s\", \"shape\": \"%s\", \"cells\": %zu, \"ns_per_op\": %.1f, "
+      "\"cells_per_ns\": %.3f}\n",
+      name,
+      shape,
+      cells_count,
+      ns,
+      (double)cells_count / ns);
+}
+
+// NOTE: random trees glued together by forks, so the whole image is a single subtree
+static size_t write_random_image(allocator_t* cells, size_t size) {
+  allocator_t* forest = NULL;
+  eval_cells_init(&forest, 4);
+  uint seed = 42;
+  size_t trees = 0;
+  size_t forest_size = 0;
+  while (forest_size < size) {
+    forest_size = _fixture_random_tree(forest, forest_size, &seed, 16, false);
+    trees++;
+  }
+
+  size_t index = 0;
+  for (size_t i = 0; i + 1 < trees; ++i) {
+    eval_cells_set(cells, index++, SIGIL_TREE);
+  }
+  for (size_t i = 0; i < forest_size; ++i) {
+    eval_cells_set(cells, index++, eval_cells_get(forest, i));
+  }
+  eval_cells_free(&forest);
+  return index;
+}
+
+// NOTE: the payload index used to be an stb_ds hashmap from cell to word,
+// kept here as the baseline for the rank directory
+typedef struct {
+  size_t key;
+  sint value;
+} cell_word_t;
+
+#define PAYLOAD_CELLS   (1 << 20)
+#define PAYLOAD_LOOKUPS (1 << 22)
+
+static uint next_random(uint* seed) {
+  *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return *seed >> 33;
+}
+
+static void report(const char* name, size_t cells_count, size_t ops, double elapsed) {
+  printf(
+      "{\"bench\": \"%s\", \"cells\": %zu, \"ns_per_op\": %.2f}\n",
+      name,
+      cells_count,
+      elapsed / (double)ops);
+}
+
+static void bench_payload_index(void) {
+  allocator_t* cells = NULL;
+  eval_cells_init(&cells, 1);
+  cell_word_t* map = NULL;
+  size_t* probes = NULL;
+  uint seed = 7;
+
+  for (size_t i = 0; i < PAYLOAD_CELLS; ++i) {
+    eval_cells_set(cells, i, SIGIL_REF);
+    if (next_random(&seed) % 4 == 0) {
+      stbds_arrput(probes, i);
+    }
+  }
+  size_t* order = NULL;
+  for (size_t i = 0; i < PAYLOAD_LOOKUPS; ++i) {
+    stbds_arrput(order, probes[next_random(&seed) % stbds_arrlenu(probes)]);
+  }
+
+  double start = now_ns();
+  for (size_t i = 0; i < stbds_arrlenu(probes); ++i) {
+    eval_cells_set_word(cells, probes[i], (sint)probes[i]);
+  }
+  report("payload_set/rank", PAYLOAD_CELLS, stbds_arrlenu(probes), now_ns() - start);
+
+  start = now_ns();
+  for (size_t i = 0; i < stbds_arrlenu(probes); ++i) {
+    stbds_hmput(map, probes[i], (sint)probes[i]);
+  }
+  report("payload_set/hashmap", PAYLOAD_CELLS, stbds_arrlenu(probes), now_ns() - start);
+
+  sint sum = 0;
+  start = now_ns();
+  for (size_t i = 0; i < PAYLOAD_LOOKUPS; ++i) {
+    sint word = 0;
+    eval_cells_get_word(cells, order[i], &word);
+    sum += word;
+  }
+  report("payload_get_random/rank", PAYLOAD_CELLS, PAYLOAD_LOOKUPS, now_ns() - start);
+
+  start = now_ns();
+  for (size_t i = 0; i < PAYLOAD_LOOKUPS; ++i) {
+    sum -= stbds_hmget(map, order[i]);
+  }
+  report("payload_get_random/hashmap", PAYLOAD_CELLS, PAYLOAD_LOOKUPS, now_ns() - start);
+
+  start = now_ns();
+  for (size_t i = 0; i < stbds_arrlenu(probes); ++i) {
+    sint word = 0;
+    eval_cells_get_word(cells, probes[i], &word);
+    sum += word;
+  }
+  report("payload_get_sequential/rank", PAYLOAD_CELLS, stbds_arrlenu(probes), now_ns() - start);
+
+  start = now_ns();
+  for (size_t i = 0; i < stbds_arrlenu(probes); ++i) {
+    sum -= stbds_hmget(map, probes[i]);
+  }
+  report("payload_get_sequential/hashmap", PAYLOAD_CELLS, stbds_arrlenu(probes), now_ns() - start);
+
+  if (sum != 0) {
+    fprintf(stderr, "payload index and hashmap disagree\n");
+  }
+  stbds_hmfree(map);
+  stbds_arrfree(probes);
+  stbds_arrfree(order);
+  eval_cells_free(&cells);
+}
+
+// NOTE: small sizes are repeated so every measurement covers about this many operations
+#define SWEEP_OPS (1 << 22)
+
+static volatile sint sink;
+
+static size_t sweep_repeats(size_t size) {
+  return size < SWEEP_OPS ? SWEEP_OPS / size : 1;
+}
+
+static void bench_cells_access(size_t size) {
+  allocator_t* cells = NULL;
+  eval_cells_init(&cells, 4);
+  size_t* order = NULL;
+  uint seed = 11;
+  for (size_t i = 0; i < size; ++i) {
+    stbds_arrput(order, next_random(&seed) % size);
+  }
+  size_t repeats = sweep_repeats(size);
+  sint sum = 0;
+
+  double start = now_ns();
+  for (size_t r = 0; r < repeats; ++r) {
+    for (size_t i = 0; i < size; ++i) {
+      eval_cells_set(cells, i, i % 4 == 0 ? SIGIL_REF : SIGIL_TREE);
+    }
+  }
+  report("cells_set_sequential", size, size * repeats, now_ns() - start);
+
+  start = now_ns();
+  for (size_t r = 0; r < repeats; ++r) {
+    for (size_t i = 0; i < size; ++i) {
+      sum += eval_cells_get(cells, i);
+    }
+  }
+  report("cells_get_sequential", size, size * repeats, now_ns() - start);
+
+  start = now_ns();
+  for (size_t r = 0; r < repeats; ++r) {
+    for (size_t i = 0; i < size; ++i) {
+      eval_cells_set(cells, order[i], order[i] % 4 == 0 ? SIGIL_REF : SIGIL_TREE);
+    }
+  }
+  report("cells_set_random", size, size * repeats, now_ns() - start);
+
+  start = now_ns();
+  for (size_t r = 0; r < repeats; ++r) {
+    for (size_t i = 0; i < size; ++i) {
+      sum += eval_cells_get(cells, order[i]);
+    }
+  }
+  report("cells_get_random", size, size * repeats, now_ns() - start);
+
+  // NOTE: every fourth cell is a REF carrying a word
+  start = now_ns();
+  for (size_t r = 0; r < repeats; ++r) {
+    for (size_t i = 0; i < size; i += 4) {
+      eval_cells_set_word(cells, i, (sint)i);
+    }
+  }
+  report("word_set_sequential", size, size / 4 * repeats, now_ns() - start);
+
+  start = now_ns();
+  for (size_t r = 0; r < repeats; ++r) {
+    for (size_t i = 0; i < size; i += 4) {
+      sint word = 0;
+      eval_cells_get_word(cells, i, &word);
+      sum += word;
+    }
+  }
+  report("word_get_sequential", size, size / 4 * repeats, now_ns() - start);
+
+  start = now_ns();
+  for (size_t r = 0; r < repeats; ++r) {
+    for (size_t i = 0; i < size; ++i) {
+      size_t index = order[i] - order[i] % 4;
+      eval_cells_set_word(cells, index, (sint)index);
+    }
+  }
+  report("word_set_random", size, size * repeats, now_ns() - start);
+
+  start = now_ns();
+  for (size_t r = 0; r < repeats; ++r) {
+    for (size_t i = 0; i < size; ++i) {
+      sint word = 0;
+      eval_cells_get_word(cells, order[i] - order[i] % 4, &word);
+      sum += word;
+    }
+  }
+  report("word_get_random", size, size * repeats, now_ns() - start);
+
+  sink = sum;
+  stbds_arrfree(order);
+  eval_cells_free(&cells);
+}
+
+// NOTE: reset clears the whole capacity, the fill level only decides how many words are dropped
+static void bench_cells_reset(size_t size) {
+  static const double FILLS[] = {0.0, 0.1, 0.5, 1.0};
+  for (size_t f = 0; f < sizeof(FILLS) / sizeof(*FILLS); ++f) {
+    allocator_t* cells = NULL;
+    eval_cells_init(&cells, size / CELLS_PER_WORD);
+    size_t filled = (size_t)((double)size * FILLS[f]);
+    size_t repeats = sweep_repeats(size) / 64 + 1;
+    double elapsed = 0;
+    for (size_t r = 0; r < repeats; ++r) {
+      for (size_t i = 0; i < filled; ++i) {
+        eval_cells_set(cells, i, i % 4 == 0 ? SIGIL_REF : SIGIL_TREE);
+        if (i % 4 == 0) {
+          eval_cells_set_word(cells, i, (sint)i);
+        }
+      }
+      double start = now_ns();
+      eval_cells_reset(cells);
+      elapsed += now_ns() - start;
+    }
+    printf(
+        "{\"bench\": \"cells_reset\", \"cells\": %zu, \"fill\": %.2f, \"ns_per_op\": %.1f}\n",
+        size,
+        FILLS[f],
+        elapsed / (double)repeats);
+    eval_cells_free(&cells);
+  }
+}
+
+// NOTE: blocks of 5 and 7 cells where a random half keeps a leaf at its start, so the
+// collection leaves holes of every length below and above HEAP_RUN_MIN. The timed
+// allocations alternate 5, 7 and 12 cells, the last ones can only come from runs
+static void bench_heap_alloc(size_t size) {
+  eval_state_t* state = NULL;
+  eval_init(&state);
+  uint seed = 5;
+  size_t blocks = 0;
+  while (state->heap_top < size) {
+    size_t start = _heap_alloc(state, next_random(&seed) % 2 ? 5 : 7);
+    if (next_random(&seed) % 2) {
+      eval_cells_set(state->cells, start, SIGIL_TREE);
+      eval_cells_set(state->cells, start + 1, SIGIL_NIL);
+      eval_cells_set(state->cells, start + 2, SIGIL_NIL);
+      stbds_arrput(state->result_stack, start);
+    }
+    blocks++;
+  }
+  eval_gc(state);
+  stbds_arrsetlen(state->result_stack, 0);
+  eval_heap_stats_t stats = {};
+  eval_heap_stats(state, &stats);
+
+  static const size_t SIZES[] = {5, 7, 12};
+  size_t top = state->heap_top;
+  size_t ops = 0;
+  double start = now_ns();
+  while (state->heap_top == top && ops < blocks) {
+    _heap_alloc(state, SIZES[ops % 3]);
+    ops++;
+  }
+  double elapsed = now_ns() - start;
+  printf(
+      "{\"bench\": \"heap_alloc_fragmented\", \"cells\": %zu, \"free_listed\": %zu, "
+      "\"allocs\": %zu, \"ns_per_op\": %.1f}\n",
+      top,
+      stats.free_listed,
+      ops,
+      elapsed / (double)ops);
+  eval_free(&state);
+}
+
+static void append_random_tree(string_buffer_t* s, uint* seed, size_t depth) {
+  if (depth == 0 || next_random(seed) % 8 == 0) {
+    _sb_append_char(s, '*');
+    return;
+  }
+  _sb_append_char(s, '^');
+  append_random_tree(s, seed, depth - 1);
+  append_random_tree(s, seed, depth - 1);
+}
+
+// NOTE: random trees glued by forks, or a left spine whose root's right child is the last cell
+static void build_image_json(string_buffer_t* json, size_t size, bool spine) {
+  string_buffer_t forest = {0};
+  _sb_init(&forest);
+  size_t trees = 0;
+  uint seed = 42;
+  if (spine) {
+    for (size_t i = 0; i < size / 2; ++i) {
+      _sb_append_char(&forest, '^');
+    }
+    for (size_t i = 0; i < size / 2 + 1; ++i) {
+      _sb_append_char(&forest, '*');
+    }
+    trees = 1;
+  }
+  while (forest.len < size) {
+    append_random_tree(&forest, &seed, 16);
+    trees++;
+  }
+  _sb_clear(json);
+  _sb_append_str(json, "{\"cells\": {\"state\": \"");
+  for (size_t i = 0; i + 1 < trees; ++i) {
+    _sb_append_char(json, '^');
+  }
+  _sb_append_data(json, forest.buf, forest.len);
+  _sb_append_str(json, "\", \"words\": []}, \"apply_stack\": [0], \"result_stack\": []}");
+  _sb_free(&forest);
+}
+
+static void bench_right_node(eval_state_t* state, const char* shape, size_t cells_count) {
+  bool indexed = state->node_index_valid;
+  for (size_t pass = 0; pass < 2; ++pass) {
+    state->node_index_valid = indexed && pass == 0;
+    size_t repeats = 1;
+    double elapsed = 0;
+    size_t right = 0;
+    while (true) {
+      double start = now_ns();
+      for (size_t r = 0; r < repeats; ++r) {
+        right += _eval_get_right_node(state, 0);
+      }
+      elapsed = now_ns() - start;
+      if (elapsed > 1e8 || repeats >= (1ULL << 24)) {
+        break;
+      }
+      repeats *= 2;
+    }
+    sink = (sint)right;
+    printf(
+        "{\"bench\": \"right_node\", \"shape\": \"%s\", \"path\": \"%s\", \"cells\": %zu, "
+        "\"ns_per_op\": %.1f}\n",
+        shape,
+        state->node_index_valid ? "index" : "scan",
+        cells_count,
+        elapsed / (double)repeats);
+  }
+  state->node_index_valid = indexed;
+}
+
+static void report_throughput(const char* name, size_t cells_count, size_t bytes, double ns) {
+  printf(
+      "{\"bench\": \"%s\", \"cells\": %zu, \"bytes\": %zu, \"ms\": %.3f, \"mb_per_s\": %.1f}\n",
+      name,
+      cells_count,
+      bytes,
+      ns / 1e6,
+      (double)bytes / 1e6 / (ns / 1e9));
+}
+
+static void bench_json(size_t size) {
+  string_buffer_t json = {0};
+  string_buffer_t dumped = {0};
+  _sb_init(&json);
+  _sb_init(&dumped);
+  eval_state_t* state = NULL;
+  eval_init(&state);
+
+  for (size_t shape = 0; shape < 2; ++shape) {
+    build_image_json(&json, size, shape == 1);
+    size_t repeats = sweep_repeats(json.len) / 16 + 1;
+
+    double start = now_ns();
+    for (size_t r = 0; r < repeats; ++r) {
+      if (eval_load_json(_sb_str_view(&json), state) == ERR_VAL) {
+        fprintf(stderr, "json_load: can't load the %zu cell image\n", size);
+        goto error;
+      }
+    }
+    double elapsed = (now_ns() - start) / (double)repeats;
+    size_t cells_count = state->heap_top;
+    if (shape == 0) {
+      report_throughput("json_load", cells_count, json.len, elapsed);
+    }
+    bench_right_node(state, shape ? "spine" : "random", cells_count);
+    if (shape == 1) {
+      continue;
+    }
+
+    start = now_ns();
+    for (size_t r = 0; r < repeats; ++r) {
+      _sb_clear(&dumped);
+      eval_dump_json(&dumped, state);
+    }
+    elapsed = (now_ns() - start) / (double)repeats;
+    report_throughput("json_dump", cells_count, dumped.len, elapsed);
+  }
+
+error:
+  eval_free(&state);
+  _sb_free(&dumped);
+  _sb_free(&json);
+}
+
+int main() {
+  for (size_t size = 1 << 10; size <= 1 << 22; size <<= 4) {
+    allocator_t* cells = NULL;
+    eval_cells_init(&cells, 4);
+
+    size_t count = write_random_image(cells, size);
+    bench_subtree_end("subtree_end", "random", cells, count, eval_cells_subtree_end);
+    bench_subtree_end("subtree_end_scalar", "random", cells, count, eval_cells_subtree_end_scalar);
+
+    eval_cells_reset(cells);
+    count = write_spine(cells, size / 2);
+    bench_subtree_end("subtree_end", "spine", cells, count, eval_cells_subtree_end);
+    bench_subtree_end("subtree_end_scalar", "spine", cells, count, eval_cells_subtree_end_scalar);
+
+    eval_cells_free(&cells);
+  }
+
+  bench_payload_index();
+  for (size_t size = 1 << 10; size <= 1 << 22; size <<= 4) {
+    bench_cells_access(size);
+    bench_cells_reset(size);
+    bench_heap_alloc(size);
+    bench_json(size);
+  }
+  return 0;
+}
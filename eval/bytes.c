@@ -0,0 +1,79 @@
+#include "api.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "vendor/stb_ds.h"
+
+#include "bytes.h"
+#include "eval.h"
+#include "memory.h"
+#include "native.h"
+#include "util.h"
+
+// NOTE: takes ownership of data, it is freed if the value can't be allocated
+size_t _bytes_new(eval_state_t* state, char* data, size_t len) {
+  size_t id = stbds_arrlenu(state->bytes);
+  bool reused = stbds_arrlenu(state->bytes_free) > 0;
+  if (reused) {
+    id = stbds_arrpop(state->bytes_free);
+  }
+  size_t value = _native_new_value(state, NATIVE_TYPE_BYTES, (sint)id);
+  if (value == SIZE_MAX) {
+    if (reused) {
+      stbds_arrput(state->bytes_free, id);
+    }
+    free(data);
+    return SIZE_MAX;
+  }
+  if (!reused) {
+    stbds_arrput(state->bytes, ((bytes_entry_t){.cell = SIZE_MAX}));
+  }
+  state->bytes[id] = (bytes_entry_t){.data = data, .len = len, .cell = value + 4};
+  return value;
+}
+
+bool _bytes_get(eval_state_t* state, size_t value, const char** data, size_t* len) {
+  size_t tag = _eval_get_left_node(state, value);
+  size_t cell = _eval_get_right_node(state, value);
+  sint word = 0;
+  if (tag == value || eval_cells_get_word(state->cells, tag, &word) == ERR_VAL
+      || word != NATIVE_TYPE_BYTES || eval_cells_get_word(state->cells, cell, &word) == ERR_VAL) {
+    return false;
+  }
+  size_t id = (size_t)word;
+  if (id >= stbds_arrlenu(state->bytes) || state->bytes[id].cell != cell) {
+    return false;
+  }
+  *data = state->bytes[id].data;
+  *len = state->bytes[id].len;
+  return true;
+}
+
+size_t _bytes_sweep(eval_state_t* state, const uint* live, size_t live_bits) {
+  size_t dropped = 0;
+  for (size_t id = 0; id < stbds_arrlenu(state->bytes); ++id) {
+    bytes_entry_t* e = &state->bytes[id];
+    if (e->cell == SIZE_MAX || e->cell >= live_bits || _bitmap_get_bit(live, e->cell)) {
+      continue;
+    }
+    free(e->data);
+    *e = (bytes_entry_t){.cell = SIZE_MAX};
+    stbds_arrput(state->bytes_free, id);
+    dropped++;
+  }
+  return dropped;
+}
+
+void _bytes_clear(eval_state_t* state) {
+  for (size_t id = 0; id < stbds_arrlenu(state->bytes); ++id) {
+    free(state->bytes[id].data);
+  }
+  stbds_arrsetlen(state->bytes, 0);
+  stbds_arrsetlen(state->bytes_free, 0);
+}
+
+void _bytes_free(eval_state_t* state) {
+  _bytes_clear(state);
+  stbds_arrfree(state->bytes);
+  stbds_arrfree(state->bytes_free);
+}
@@ -0,0 +1,24 @@
+#ifndef __EVAL_BYTES__
+#define __EVAL_BYTES__
+
+#include "api.h"
+#include <stdbool.h>
+
+// NOTE: byte strings are ^ type.bytes [id], the bytes themselves are kept by the state in
+// one buffer per string. An entry lives as long as the cell of its id is reachable, dumps
+// and snapshots keep the id only, so a loaded one no longer resolves and natives given one
+// raise ERROR_INVALID_CAST
+
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cell; // of the id terminal, SIZE_MAX for a free entry
+} bytes_entry_t;
+
+size_t _bytes_new(eval_state_t* state, char* data, size_t len);
+bool _bytes_get(eval_state_t* state, size_t value, const char** data, size_t* len);
+size_t _bytes_sweep(eval_state_t* state, const uint* live, size_t live_bits);
+void _bytes_clear(eval_state_t* state);
+void _bytes_free(eval_state_t* state);
+
+#endif
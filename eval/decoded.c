@@ -0,0 +1,412 @@
+#include "api.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "vendor/stb_ds.h"
+
+#include "decoded.h"
+#include "eval.h"
+#include "heap.h"
+#include "memory.h"
+
+#define RULE_0A      EVAL_RULE_0A
+#define RULE_0B      EVAL_RULE_0B
+#define RULE_1       EVAL_RULE_1
+#define RULE_2       EVAL_RULE_2
+#define RULE_3A      EVAL_RULE_3A
+#define RULE_3B      EVAL_RULE_3B
+#define RULE_3C      EVAL_RULE_3C
+#define RULE_NATIVE  EVAL_RULE_NATIVE
+#define RULE_INVALID EVAL_RULES
+
+#define DISPATCH_INDEX(f, a, z) (((f) << 4) | ((a) << 2) | (z))
+
+// clang-format off
+// NOTE: rule by the kinds of F, of its left child A (a leaf unless F is a fork) and of z,
+// kinds are leaf, stem, fork, native in that order
+static const u8 DISPATCH[64] = {
+  // F leaf
+  RULE_0A, RULE_0A, RULE_0A, RULE_0A,
+  RULE_0A, RULE_0A, RULE_0A, RULE_0A,
+  RULE_0A, RULE_0A, RULE_0A, RULE_0A,
+  RULE_0A, RULE_0A, RULE_0A, RULE_0A,
+  // F stem
+  RULE_0B, RULE_0B, RULE_0B, RULE_0B,
+  RULE_0B, RULE_0B, RULE_0B, RULE_0B,
+  RULE_0B, RULE_0B, RULE_0B, RULE_0B,
+  RULE_0B, RULE_0B, RULE_0B, RULE_0B,
+  // F fork, a row per kind of A
+  RULE_1, RULE_1, RULE_1, RULE_1,
+  RULE_2, RULE_2, RULE_2, RULE_2,
+  RULE_3A, RULE_3B, RULE_3C, RULE_INVALID,
+  RULE_INVALID, RULE_INVALID, RULE_INVALID, RULE_INVALID,
+  // F native
+  RULE_NATIVE, RULE_NATIVE, RULE_NATIVE, RULE_NATIVE,
+  RULE_NATIVE, RULE_NATIVE, RULE_NATIVE, RULE_NATIVE,
+  RULE_NATIVE, RULE_NATIVE, RULE_NATIVE, RULE_NATIVE,
+  RULE_NATIVE, RULE_NATIVE, RULE_NATIVE, RULE_NATIVE,
+};
+// clang-format on
+
+// NOTE: cells a node takes when written back: ^**, ^#*** and ^#**#**
+static const size_t NODE_CELLS[] = {3, 5, 7};
+
+static uint32_t add_node(decoded_t* d, u8 kind, uint32_t left, uint32_t right, size_t cell) {
+  decoded_node_t node = {.left = left, .right = right, .cell = cell, .kind = kind};
+  stbds_arrput(d->nodes, node);
+  return (uint32_t)(stbds_arrlenu(d->nodes) - 1);
+}
+
+// NOTE: id of the tree at cell, translating whatever part of it isn't known yet.
+// Returns DECODED_NIL for nil and for anything that isn't a tree or a native
+static uint32_t decode(eval_state_t* state, size_t cell) {
+  decoded_t* d = state->decoded;
+  size_t root = _eval_dereference(state, cell);
+  stbds_arrsetlen(d->pending, 0);
+  stbds_arrput(d->pending, root);
+  while (stbds_arrlenu(d->pending) > 0) {
+    size_t at = stbds_arrlast(d->pending);
+    if (stbds_hmgeti(d->by_cell, at) >= 0) {
+      stbds_arrpop(d->pending);
+      continue;
+    }
+    u8 kind = _eval_node_kind(state, at);
+    if (kind == NODE_NATIVE) {
+      stbds_hmput(d->by_cell, at, add_node(d, DECODED_NATIVE, DECODED_NIL, DECODED_NIL, at));
+      stbds_arrpop(d->pending);
+      continue;
+    }
+    if (!_eval_kind_is_tree(kind)) {
+      return DECODED_NIL;
+    }
+
+    size_t children[2] = {_eval_get_left_node(state, at), _eval_get_right_node(state, at)};
+    uint32_t ids[2] = {DECODED_NIL, DECODED_NIL};
+    bool ready = true;
+    for (size_t i = 0; i < 2; ++i) {
+      if (_eval_node_kind(state, children[i]) == NODE_NIL) {
+        continue;
+      }
+      ptrdiff_t found = stbds_hmgeti(d->by_cell, children[i]);
+      if (found < 0) {
+        stbds_arrput(d->pending, children[i]);
+        ready = false;
+      } else {
+        ids[i] = d->by_cell[found].value;
+      }
+    }
+    if (!ready) {
+      continue;
+    }
+    stbds_arrpop(d->pending);
+    // NOTE: ^*Y has no reading in tree-calculus
+    if (kind == NODE_FORK && ids[0] == DECODED_NIL) {
+      return DECODED_NIL;
+    }
+    u8 decoded_kind = kind == NODE_LEAF   ? DECODED_LEAF
+                      : kind == NODE_STEM ? DECODED_STEM
+                                          : DECODED_FORK;
+    stbds_hmput(d->by_cell, at, add_node(d, decoded_kind, ids[0], ids[1], at));
+  }
+  ptrdiff_t found = stbds_hmgeti(d->by_cell, root);
+  return found < 0 ? DECODED_NIL : d->by_cell[found].value;
+}
+
+// NOTE: cell index of the node, writing it and its children back where needed
+// the same way rules 0.a and 0.b do
+static size_t materialize(eval_state_t* state, uint32_t id) {
+  decoded_t* d = state->decoded;
+  allocator_t* cells = state->cells;
+  stbds_arrsetlen(d->pending, 0);
+  stbds_arrput(d->pending, id);
+  while (stbds_arrlenu(d->pending) > 0) {
+    uint32_t current = (uint32_t)stbds_arrlast(d->pending);
+    decoded_node_t* node = &d->nodes[current];
+    if (node->cell != SIZE_MAX) {
+      stbds_arrpop(d->pending);
+      continue;
+    }
+    uint32_t children[2] = {node->left, node->right};
+    bool ready = true;
+    for (size_t i = 0; i < 2; ++i) {
+      if (children[i] != DECODED_NIL && d->nodes[children[i]].cell == SIZE_MAX) {
+        stbds_arrput(d->pending, children[i]);
+        ready = false;
+      }
+    }
+    if (!ready) {
+      continue;
+    }
+    stbds_arrpop(d->pending);
+
+    size_t n = NODE_CELLS[node->kind];
+    size_t new = _heap_alloc(state, n);
+    if (new == SIZE_MAX) {
+      return SIZE_MAX;
+    }
+    eval_cells_set(cells, new, SIGIL_TREE);
+    size_t at = new + 1;
+    for (size_t i = 0; i < 2; ++i) {
+      if (children[i] == DECODED_NIL) {
+        eval_cells_set(cells, at++, SIGIL_NIL);
+        continue;
+      }
+      eval_cells_set(cells, at, SIGIL_REF);
+      eval_cells_set(cells, at + 1, SIGIL_NIL);
+      eval_cells_set(cells, at + 2, SIGIL_NIL);
+      eval_cells_set_word(cells, at, d->nodes[children[i]].cell - at);
+      at += 3;
+    }
+    _heap_index_range(state, new, new + n);
+    node->cell = new;
+    stbds_hmput(d->by_cell, new, current);
+  }
+  return d->nodes[id].cell;
+}
+
+static bool load(eval_state_t* state) {
+  decoded_t* d = calloc(1, sizeof(*d));
+  EVAL_ASSERT(d, ERROR_GENERIC, "");
+  d->gc_threshold = DECODED_GC_MIN;
+  state->decoded = d;
+  for (size_t i = 0; i < stbds_arrlenu(state->apply_stack); ++i) {
+    size_t e = state->apply_stack[i];
+    EVAL_ASSERT(e == TOKEN_APPLY || !_eval_is_token(e), ERROR_GENERIC, "");
+    uint32_t id = e == TOKEN_APPLY ? DECODED_NIL : decode(state, e);
+    EVAL_ASSERT(e == TOKEN_APPLY || id != DECODED_NIL, ERROR_INVALID_TREE, "");
+    stbds_arrput(d->apply_stack, e == TOKEN_APPLY ? TOKEN_APPLY : id);
+  }
+  for (size_t i = 0; i < stbds_arrlenu(state->result_stack); ++i) {
+    uint32_t id = decode(state, state->result_stack[i]);
+    EVAL_ASSERT(id != DECODED_NIL, ERROR_INVALID_TREE, "");
+    stbds_arrput(d->result_stack, id);
+  }
+  return true;
+
+error:
+  _decoded_drop(state);
+  return false;
+}
+
+// NOTE: children have smaller ids than their parents, so one pass down from the top marks
+// everything reachable and one pass up slides the live nodes together
+static void collect(decoded_t* d) {
+  size_t count = stbds_arrlenu(d->nodes);
+  uint32_t* forward = malloc(count * sizeof(*forward));
+  if (!forward) {
+    return;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    forward[i] = DECODED_NIL;
+  }
+  for (size_t i = 0; i < stbds_arrlenu(d->apply_stack); ++i) {
+    if (d->apply_stack[i] != TOKEN_APPLY) {
+      forward[d->apply_stack[i]] = 0;
+    }
+  }
+  for (size_t i = 0; i < stbds_arrlenu(d->result_stack); ++i) {
+    forward[d->result_stack[i]] = 0;
+  }
+  for (size_t i = count; i-- > 0;) {
+    if (forward[i] == DECODED_NIL) {
+      continue;
+    }
+    if (d->nodes[i].left != DECODED_NIL) {
+      forward[d->nodes[i].left] = 0;
+    }
+    if (d->nodes[i].right != DECODED_NIL) {
+      forward[d->nodes[i].right] = 0;
+    }
+  }
+
+  uint32_t live = 0;
+  stbds_hmfree(d->by_cell);
+  for (size_t i = 0; i < count; ++i) {
+    if (forward[i] == DECODED_NIL) {
+      continue;
+    }
+    decoded_node_t node = d->nodes[i];
+    if (node.left != DECODED_NIL) {
+      node.left = forward[node.left];
+    }
+    if (node.right != DECODED_NIL) {
+      node.right = forward[node.right];
+    }
+    if (node.cell != SIZE_MAX) {
+      stbds_hmput(d->by_cell, node.cell, live);
+    }
+    d->nodes[live] = node;
+    forward[i] = live++;
+  }
+  stbds_arrsetlen(d->nodes, live);
+  for (size_t i = 0; i < stbds_arrlenu(d->apply_stack); ++i) {
+    if (d->apply_stack[i] != TOKEN_APPLY) {
+      d->apply_stack[i] = forward[d->apply_stack[i]];
+    }
+  }
+  for (size_t i = 0; i < stbds_arrlenu(d->result_stack); ++i) {
+    d->result_stack[i] = forward[d->result_stack[i]];
+  }
+  free(forward);
+  d->gc_threshold = live + (live > DECODED_GC_MIN ? live : DECODED_GC_MIN);
+}
+
+// NOTE: single reduction, takes the same steps as `reduce` in eval.c
+static inline sint step(eval_state_t* state, decoded_t* d) {
+  STATS_PEAK(state->stats.apply_stack_peak, stbds_arrlenu(d->apply_stack));
+  bool was_apply = false;
+  while (stbds_arrlenu(d->apply_stack) > 0) {
+    size_t e = stbds_arrpop(d->apply_stack);
+    if (e == TOKEN_APPLY) {
+      was_apply = true;
+      break;
+    }
+    stbds_arrput(d->result_stack, (uint32_t)e);
+  }
+  STATS_PEAK(state->stats.result_stack_peak, stbds_arrlenu(d->result_stack));
+  if (!was_apply) {
+    return true;
+  }
+
+  EVAL_ASSERT(stbds_arrlenu(d->result_stack) >= 2, ERROR_STACK_UNDERFLOW, "");
+  uint32_t F = stbds_arrpop(d->result_stack);
+  uint32_t z = stbds_arrpop(d->result_stack);
+  decoded_node_t f = d->nodes[F];
+  decoded_node_t Z = d->nodes[z];
+  decoded_node_t A = f.kind == DECODED_FORK ? d->nodes[f.left] : (decoded_node_t){0};
+
+  switch (DISPATCH[DISPATCH_INDEX(f.kind, A.kind, Z.kind)]) {
+  case RULE_0A:
+    STATS_ADD(state->stats.rules[RULE_0A], 1);
+    stbds_arrput(d->apply_stack, add_node(d, DECODED_STEM, z, DECODED_NIL, SIZE_MAX));
+    return false;
+  case RULE_0B:
+    STATS_ADD(state->stats.rules[RULE_0B], 1);
+    stbds_arrput(d->apply_stack, add_node(d, DECODED_FORK, f.left, z, SIZE_MAX));
+    return false;
+  case RULE_1:
+    STATS_ADD(state->stats.rules[RULE_1], 1);
+    stbds_arrput(d->apply_stack, f.right);
+    return false;
+  case RULE_2:
+    STATS_ADD(state->stats.rules[RULE_2], 1);
+    stbds_arrput(d->apply_stack, TOKEN_APPLY);
+    stbds_arrput(d->apply_stack, TOKEN_APPLY);
+    stbds_arrput(d->apply_stack, A.left);
+    stbds_arrput(d->apply_stack, z);
+    stbds_arrput(d->apply_stack, TOKEN_APPLY);
+    stbds_arrput(d->apply_stack, f.right);
+    stbds_arrput(d->apply_stack, z);
+    return false;
+  case RULE_3A:
+    STATS_ADD(state->stats.rules[RULE_3A], 1);
+    stbds_arrput(d->apply_stack, A.left);
+    return false;
+  case RULE_3B:
+    STATS_ADD(state->stats.rules[RULE_3B], 1);
+    stbds_arrput(d->apply_stack, TOKEN_APPLY);
+    stbds_arrput(d->apply_stack, A.right);
+    stbds_arrput(d->apply_stack, Z.left);
+    return false;
+  case RULE_3C:
+    STATS_ADD(state->stats.rules[RULE_3C], 1);
+    stbds_arrput(d->apply_stack, TOKEN_APPLY);
+    stbds_arrput(d->apply_stack, TOKEN_APPLY);
+    stbds_arrput(d->apply_stack, f.right);
+    stbds_arrput(d->apply_stack, Z.left);
+    stbds_arrput(d->apply_stack, Z.right);
+    return false;
+  case RULE_NATIVE: {
+    // NOTE: natives work on cells, the argument is written back and the result translated
+    sint word = 0;
+    EVAL_ASSERT(eval_cells_get_word(state->cells, f.cell, &word) != ERR_VAL, ERROR_GENERIC, "");
+    EVAL_ASSERT(_eval_native_callable(state, word), ERROR_INVALID_TREE, "not a native");
+    native_function_t func = (native_function_t)word;
+    state->native_calls++;
+    STATS_ADD(state->stats.rules[RULE_NATIVE], 1);
+    size_t arg = materialize(state, z);
+    EVAL_CHECK_STATE(state)
+    size_t res = func(state, arg);
+    EVAL_CHECK_STATE(state)
+    uint32_t id = decode(state, res);
+    EVAL_ASSERT(id != DECODED_NIL, ERROR_INVALID_TREE, "");
+    stbds_arrput(d->apply_stack, id);
+    return false;
+  }
+  default:
+    EVAL_ASSERT(false, ERROR_INVALID_TREE, "");
+  }
+
+error:
+  return false;
+}
+
+sint _decoded_run(eval_state_t* state, size_t max_steps, size_t* steps_done) {
+  size_t steps = 0;
+  sint done = false;
+  if (!state->decoded && !load(state)) {
+    goto error;
+  }
+  decoded_t* d = state->decoded;
+  while (steps < max_steps) {
+    if (stbds_arrlenu(d->nodes) >= d->gc_threshold) {
+      collect(d);
+    }
+    done = step(state, d);
+    if (done || state->error_code) {
+      break;
+    }
+    steps++;
+  }
+  // NOTE: a finished run is written back, an interrupted one keeps its translation
+  if (done || state->error_code) {
+    _decoded_store(state);
+  }
+
+error:
+  if (steps_done) {
+    *steps_done = steps;
+  }
+  return done && !state->error_code;
+}
+
+sint _decoded_store(eval_state_t* state) {
+  decoded_t* d = state->decoded;
+  if (!d) {
+    return 0;
+  }
+  stbds_arrsetlen(state->apply_stack, 0);
+  for (size_t i = 0; i < stbds_arrlenu(d->apply_stack); ++i) {
+    size_t e = d->apply_stack[i];
+    size_t cell = e == TOKEN_APPLY ? e : materialize(state, (uint32_t)e);
+    if (e != TOKEN_APPLY && cell == SIZE_MAX) {
+      return ERR_VAL;
+    }
+    stbds_arrput(state->apply_stack, cell);
+  }
+  stbds_arrsetlen(state->result_stack, 0);
+  for (size_t i = 0; i < stbds_arrlenu(d->result_stack); ++i) {
+    size_t cell = materialize(state, d->result_stack[i]);
+    if (cell == SIZE_MAX) {
+      return ERR_VAL;
+    }
+    stbds_arrput(state->result_stack, cell);
+  }
+  _decoded_drop(state);
+  return 0;
+}
+
+void _decoded_drop(eval_state_t* state) {
+  decoded_t* d = state->decoded;
+  if (!d) {
+    return;
+  }
+  stbds_arrfree(d->nodes);
+  stbds_arrfree(d->apply_stack);
+  stbds_arrfree(d->result_stack);
+  stbds_hmfree(d->by_cell);
+  stbds_arrfree(d->pending);
+  free(d);
+  state->decoded = NULL;
+}
@@ -0,0 +1,51 @@
+#ifndef __EVAL_DECODED__
+#define __EVAL_DECODED__
+
+#include "api.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// NOTE: opt-in second engine, see decoded.c. The trees reachable from the stacks are
+// translated once into an array of nodes with their kind and child ids, rules are picked
+// from a table by the kinds of F, its left child and z. Cells and stacks of the state are
+// stale while a translation is alive, `_decoded_store` writes it back. Results are not
+// interned, memoized or forked
+
+#define DECODED_LEAF   0
+#define DECODED_STEM   1
+#define DECODED_FORK   2
+#define DECODED_NATIVE 3
+
+#define DECODED_NIL UINT32_MAX
+
+// NOTE: nodes are collected once this many were added, or as many as survived the last
+// collection, whichever is bigger
+#define DECODED_GC_MIN (1 << 16)
+
+// NOTE: children are always added before their parents, so their ids are smaller
+typedef struct {
+  uint32_t left;
+  uint32_t right;
+  size_t cell; // where the node is in the cells, SIZE_MAX until it is written back
+  u8 kind;
+} decoded_node_t;
+
+typedef struct {
+  size_t key;
+  uint32_t value;
+} decoded_cell_entry_t;
+
+typedef struct decoded_t {
+  decoded_node_t* nodes;
+  size_t* apply_stack;
+  uint32_t* result_stack;
+  decoded_cell_entry_t* by_cell;
+  size_t* pending;
+  size_t gc_threshold;
+} decoded_t;
+
+sint _decoded_run(eval_state_t* state, size_t max_steps, size_t* steps_done);
+sint _decoded_store(eval_state_t* state);
+void _decoded_drop(eval_state_t* state);
+
+#endif
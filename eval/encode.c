@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200809L
 #include "api.h"
 #include <assert.h>
 #include <ctype.h>
@@ -5,16 +6,18 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "vendor/stb_ds.h"
-#define JSMN_HEADER
-#include "vendor/jsmn.h"
 
 #include "encode.h"
 #include "eval.h"
+#include "heap.h"
+#include "memory.h"
+#include "output.h"
 #include "util.h"
 
-static char CELL_TO_CHAR[] = {'*', '^', '#'};
+static const char CELL_TO_CHAR[] = {'*', '^', '#'};
 
 void _eval_debug_dump(eval_state_t* state, string_buffer_t* buffer) {
   const size_t WINDOW_SIZE = 4;
@@ -100,127 +103,250 @@ void _eval_debug_dump(eval_state_t* state, string_buffer_t* buffer) {
 
 // NOTE: doesn't take ownership of json
 sint _json_parser_init(const char* json, json_parser_t* parser) {
+  return _json_parser_init_buffer(json, strlen(json), parser);
+}
+
+sint _json_parser_init_buffer(const char* data, size_t len, json_parser_t* parser) {
   *parser = (json_parser_t){};
-  parser->json = json;
+  parser->chunk = data;
+  parser->chunk_len = len;
+  parser->fd = -1;
+  _sb_init(&parser->digested_string);
+  return 0;
+}
 
-  jsmn_parser p = {};
-  jsmn_init(&p);
-  size_t tokens_len = 32;
-  jsmntok_t* tokens = malloc(tokens_len * sizeof(jsmntok_t));
-  while (true) {
-    assert(tokens_len <= 2 << 20); // NOTE: pretty random
-    int res = jsmn_parse(&p, json, strlen(json), tokens, tokens_len);
-    if (res == JSMN_ERROR_NOMEM) {
-      tokens_len *= 2;
-      tokens = realloc(tokens, tokens_len * sizeof(jsmntok_t));
-      continue;
-    }
-    if (res < 0) {
-      return res;
-    }
-    tokens_len = res;
-    break;
+sint _json_parser_init_fd(int fd, json_parser_t* parser) {
+  *parser = (json_parser_t){};
+  parser->fd = fd;
+  parser->read_buffer = malloc(JSON_CHUNK_SIZE);
+  if (!parser->read_buffer) {
+    return ERR_VAL;
   }
-  parser->tokens = tokens;
-  parser->tokens_len = tokens_len;
+  parser->chunk = parser->read_buffer;
   _sb_init(&parser->digested_string);
   return 0;
 }
 
 void _json_parser_free(json_parser_t* parser) {
   _sb_free(&parser->digested_string);
-  free(parser->tokens);
+  free(parser->read_buffer);
+  parser->read_buffer = NULL;
+  stbds_arrfree(parser->levels);
+}
+
+static bool json_refill(json_parser_t* parser) {
+  if (parser->pos < parser->chunk_len) {
+    return true;
+  }
+  if (parser->fd < 0) {
+    return false;
+  }
+  while (true) {
+    ssize_t n = read(parser->fd, parser->read_buffer, JSON_CHUNK_SIZE);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      parser->was_err = true;
+    }
+    parser->chunk_len = n > 0 ? n : 0;
+    parser->pos = 0;
+    return n > 0;
+  }
+}
+
+// NOTE: separators are skipped with whitespace and kept, the next digest checks them
+static int json_peek(json_parser_t* parser) {
+  while (json_refill(parser)) {
+    char c = parser->chunk[parser->pos];
+    if (c == ',' || c == ':') {
+      if (parser->separator) {
+        parser->was_err = true;
+        return -1;
+      }
+      parser->separator = c;
+      parser->pos++;
+      continue;
+    }
+    if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+      parser->pos++;
+      continue;
+    }
+    return (unsigned char)c;
+  }
+  parser->at_eof = true;
+  return -1;
+}
+
+static bool is_delimiter(int c) {
+  return c == -1 || c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == ',' || c == ':'
+         || c == ']' || c == '}';
 }
 
 bool _json_parser_match(json_parser_t* parser, enum json_token_t token) {
   if (parser->was_err || parser->at_eof) {
     return false;
   }
-  jsmntok_t t = parser->tokens[parser->cur_token];
+  int c = json_peek(parser);
   switch (token) {
     case JSON_TOKEN_NULL: {
-      return t.type == JSMN_PRIMITIVE && parser->json[t.start] == 'n';
+      return c == 'n';
     }
     case JSON_TOKEN_BOOL: {
-      return t.type == JSMN_PRIMITIVE
-             && (parser->json[t.start] == 'f' || parser->json[t.start] == 't');
+      return c == 'f' || c == 't';
     }
     case JSON_TOKEN_INTEGER: {
-      return t.type == JSMN_PRIMITIVE
-             && (isdigit(parser->json[t.start]) || parser->json[t.start] == '-');
+      return c != -1 && (isdigit(c) || c == '-');
     }
     case JSON_TOKEN_STRING: {
-      return t.type == JSMN_STRING;
+      return c == '"';
     }
     case JSON_TOKEN_ARRAY: {
-      return t.type == JSMN_ARRAY;
+      return c == '[';
     }
     case JSON_TOKEN_OBJECT: {
-      return t.type == JSMN_OBJECT;
+      return c == '{';
+    }
+    case JSON_TOKEN_END: {
+      return c == ']' || c == '}';
     }
     default: parser->was_err = true; return false;
   }
 }
 
-static void json_digest(json_parser_t* parser) {
+// NOTE: passes the contents of the string at the cursor to sink a chunk span at a time,
+// escapes are passed through as they are
+static void json_read_string(json_parser_t* parser, json_string_sink_t sink, void* ctx) {
+  parser->pos++;
+  bool escaped = false;
+  while (json_refill(parser)) {
+    const char* data = parser->chunk + parser->pos;
+    size_t len = parser->chunk_len - parser->pos;
+    size_t i = 0;
+    for (; i < len; ++i) {
+      if (escaped) {
+        escaped = false;
+      } else if (data[i] == '\\') {
+        escaped = true;
+      } else if (data[i] == '"') {
+        break;
+      }
+    }
+    if (i > 0 && sink(ctx, data, i) != 0) {
+      parser->was_err = true;
+      return;
+    }
+    parser->pos += i;
+    if (i < len) {
+      parser->pos++;
+      return;
+    }
+  }
+  parser->was_err = true;
+}
+
+static sint append_digested(void* ctx, const char* data, size_t len) {
+  _sb_append_data(ctx, data, len);
+  return 0;
+}
+
+static void json_read_primitive(json_parser_t* parser) {
+  while (json_refill(parser)) {
+    int c = (unsigned char)parser->chunk[parser->pos];
+    if (is_delimiter(c)) {
+      return;
+    }
+    _sb_append_char(&parser->digested_string, c);
+    parser->pos++;
+  }
+}
+
+// NOTE: keys and values in an object alternate, a key comes after a comma and a value
+// after a colon. Closing brackets have to match the innermost open one
+static bool json_separated(json_parser_t* parser, int c) {
+  size_t depth = stbds_arrlenu(parser->levels);
+  if (depth == 0) {
+    return parser->separator == 0;
+  }
+  json_level_t level = parser->levels[depth - 1];
+  bool object = level.closer == '}';
+  if (c == ']' || c == '}') {
+    return parser->separator == 0 && c == level.closer && !(object && level.count % 2);
+  }
+  if (object && level.count % 2 == 0 && c != '"') {
+    return false;
+  }
+  char expected = level.count == 0 ? 0 : object && level.count % 2 ? ':' : ',';
+  return parser->separator == expected;
+}
+
+static void json_digest(json_parser_t* parser, json_string_sink_t sink, void* ctx) {
   parser->digested = JSON_DIGESTED_INVALID;
   _sb_clear(&parser->digested_string);
   parser->digested_integer = 0;
-  parser->entries_count = 0;
 
-  jsmntok_t t = parser->tokens[parser->cur_token];
+  int c = json_peek(parser);
+  if (parser->was_err || !json_separated(parser, c)) {
+    parser->was_err = true;
+    return;
+  }
+  parser->separator = 0;
+  if (c == ']' || c == '}') {
+    stbds_arrpop(parser->levels);
+  } else if (stbds_arrlenu(parser->levels) > 0) {
+    stbds_arrlast(parser->levels).count++;
+  }
+  if (c == '[' || c == '{') {
+    json_level_t level = {.closer = c == '[' ? ']' : '}'};
+    stbds_arrput(parser->levels, level);
+  }
 
-  switch (t.type) {
-    case JSMN_UNDEFINED: {
-      parser->was_err = true;
-      goto error;
-    }
-    case JSMN_OBJECT: {
+  switch (c) {
+    case '{': {
       parser->digested = JSON_DIGESTED_OBJECT;
-      parser->entries_count = t.size;
-      goto error;
+      parser->pos++;
+      return;
     }
-    case JSMN_ARRAY: {
+    case '[': {
       parser->digested = JSON_DIGESTED_ARRAY;
-      parser->entries_count = t.size;
-      goto error;
+      parser->pos++;
+      return;
     }
-    case JSMN_STRING: {
-      parser->digested = JSON_DIGESTED_STRING;
-      _sb_append_data(&parser->digested_string, &parser->json[t.start], t.end - t.start);
-      goto error;
+    case '}':
+    case ']': {
+      parser->digested = JSON_DIGESTED_END;
+      parser->pos++;
+      return;
     }
-    case JSMN_PRIMITIVE: {
-      if (_json_parser_match(parser, JSON_TOKEN_NULL)) {
-        parser->digested = JSON_DIGESTED_NULL;
-        goto error;
-      }
-      if (_json_parser_match(parser, JSON_TOKEN_BOOL)) {
-        parser->digested = JSON_TOKEN_BOOL;
-        parser->digested_bool = parser->json[t.start] == 't';
-        goto error;
-      }
-      if (_json_parser_match(parser, JSON_TOKEN_INTEGER)) {
-        parser->digested = JSON_TOKEN_INTEGER;
-        _sb_append_data(&parser->digested_string, &parser->json[t.start], t.end - t.start);
-        const char* tok_str = _sb_str_view(&parser->digested_string);
-        char* endptr;
-        errno = 0;
-        parser->digested_integer = strtod(tok_str, &endptr);
-        _sb_clear(&parser->digested_string);
-        if (errno == ERANGE || endptr == tok_str || *endptr != '\0') {
-          parser->was_err = true;
-          goto error;
-        }
+    case '"': {
+      parser->digested = JSON_DIGESTED_STRING;
+      if (sink) {
+        json_read_string(parser, sink, ctx);
+      } else {
+        json_read_string(parser, append_digested, &parser->digested_string);
       }
+      return;
     }
+    default: break;
   }
 
-error:
-  parser->cur_token++;
-  if (parser->cur_token >= parser->tokens_len) {
-    parser->at_eof = true;
+  json_read_primitive(parser);
+  const char* tok_str = _sb_str_view(&parser->digested_string);
+  if (strcmp(tok_str, "null") == 0) {
+    parser->digested = JSON_DIGESTED_NULL;
+  } else if (strcmp(tok_str, "true") == 0 || strcmp(tok_str, "false") == 0) {
+    parser->digested = JSON_DIGESTED_BOOL;
+    parser->digested_bool = tok_str[0] == 't';
+  } else {
+    parser->digested = JSON_DIGESTED_INTEGER;
+    char* endptr;
+    errno = 0;
+    parser->digested_integer = strtoll(tok_str, &endptr, 10);
+    if (errno == ERANGE || endptr == tok_str || *endptr != '\0') {
+      parser->was_err = true;
+    }
   }
+  _sb_clear(&parser->digested_string);
 }
 
 bool _json_parser_eat(json_parser_t* parser, enum json_token_t token) {
@@ -231,12 +357,35 @@ bool _json_parser_eat(json_parser_t* parser, enum json_token_t token) {
   if (res == false || parser->was_err || parser->at_eof) {
     return false;
   }
-  json_digest(parser);
+  json_digest(parser, NULL, NULL);
+  return !parser->was_err;
+}
+
+bool _json_parser_eat_string_chunks(json_parser_t* parser, json_string_sink_t sink, void* ctx) {
+  if (!_json_parser_match(parser, JSON_TOKEN_STRING)) {
+    return false;
+  }
+  json_digest(parser, sink, ctx);
+  return !parser->was_err;
+}
+
+bool _json_parser_next_entry(json_parser_t* parser) {
+  if (parser->was_err) {
+    return false;
+  }
+  if (_json_parser_match(parser, JSON_TOKEN_END)) {
+    json_digest(parser, NULL, NULL);
+    return false;
+  }
+  if (parser->at_eof) {
+    parser->was_err = true;
+    return false;
+  }
   return true;
 }
 
 const char* _json_parser_get_string(json_parser_t* parser) {
-  if (parser->was_err || parser->at_eof || parser->digested != JSON_DIGESTED_STRING) {
+  if (parser->was_err || parser->digested != JSON_DIGESTED_STRING) {
     return NULL;
   }
   return _sb_str_view(&parser->digested_string);
@@ -254,13 +403,30 @@ sint eval_load_json(const char* json, eval_state_t* state) {
   CHECK_ERROR({ logg_s("failed to parse json"); })
 
 error:
-  return 0;
+  _json_parser_free(&parser);
+  return err;
+}
+
+sint eval_load_json_fd(int fd, eval_state_t* state) {
+  sint err = 0;
+
+  json_parser_t parser = {};
+  err = _json_parser_init_fd(fd, &parser);
+  CHECK_ERROR({ logg_s("failed to parse json"); })
+  err = _eval_load_json(&parser, state);
+  CHECK_ERROR({ logg_s("failed to parse json"); })
+
+error:
+  _json_parser_free(&parser);
+  return err;
 }
 
 sint _eval_load_json(json_parser_t* parser, eval_state_t* state) {
   sint err = 0;
 
-  state->error_code = 0;
+  _errbuf_clear(state);
+  // NOTE: cells or stacks that aren't replaced have to be current
+  _decoded_store(state);
 
   _JSON_PARSER_EAT(OBJECT, 1);
   _JSON_PARSER_EAT_KEY("cells", 1)
@@ -269,14 +435,11 @@ sint _eval_load_json(json_parser_t* parser, eval_state_t* state) {
   } else {
     err = _eval_reset_cells(state);
     CHECK_ERROR({})
-    err = _eval_cells_load_json(parser, state);
+    size_t cells_count = 0;
+    err = _eval_cells_load_json(parser, state, &cells_count);
+    CHECK_ERROR({})
+    err = _heap_mark_loaded(state, cells_count);
     CHECK_ERROR({})
-
-    size_t i = 0;
-    while (eval_cells_is_set(state->cells, i)) {
-      _bitmap_set_bit(state->free_bitmap, i, 1);
-      i++;
-    }
   }
 
   _JSON_PARSER_EAT_KEY("apply_stack", 1)
@@ -284,12 +447,17 @@ sint _eval_load_json(json_parser_t* parser, eval_state_t* state) {
     _JSON_PARSER_EAT(NULL, 1);
   } else {
     stbds_arrsetlen(state->apply_stack, 0);
+    stbds_arrsetlen(state->memo_frames, 0);
+    _lazy_clear(state);
     _JSON_PARSER_EAT(ARRAY, 1);
-    size_t apply_count = parser->entries_count;
-    for (size_t i = 0; i < apply_count; ++i) {
+    while (_json_parser_next_entry(parser)) {
       _JSON_PARSER_EAT(INTEGER, 1);
       if (parser->digested_integer == -1) {
         stbds_arrpush(state->apply_stack, TOKEN_APPLY);
+      } else if (parser->digested_integer < 0) {
+        err = 1;
+        logg_s("negative apply stack entry");
+        goto error;
       } else {
         stbds_arrpush(state->apply_stack, parser->digested_integer);
       }
@@ -302,43 +470,85 @@ sint _eval_load_json(json_parser_t* parser, eval_state_t* state) {
   } else {
     stbds_arrsetlen(state->result_stack, 0);
     _JSON_PARSER_EAT(ARRAY, 1);
-    size_t apply_count = parser->entries_count;
-    for (size_t i = 0; i < apply_count; ++i) {
+    while (_json_parser_next_entry(parser)) {
       _JSON_PARSER_EAT(INTEGER, 1);
+      if (parser->digested_integer < 0) {
+        err = 1;
+        logg_s("negative result stack entry");
+        goto error;
+      }
       stbds_arrpush(state->result_stack, parser->digested_integer);
     }
   }
+  _JSON_PARSER_EAT(END, 1);
+
+  _eval_verify(state);
+  _fuse_loaded(state);
 
 error:
+  if (parser->was_err && !err) {
+    err = 1;
+  }
   return err;
 }
 
-static u8 get_cell(char symbol) {
-  if (symbol == '*') {
-    return SIGIL_NIL;
-  }
-  if (symbol == '^') {
-    return SIGIL_TREE;
-  }
-  if (symbol == '#') {
-    return SIGIL_REF;
+// NOTE: sigil + 1, zero for characters that are not cells
+static const u8 CHAR_TO_CELL[256] = {
+    ['*'] = SIGIL_NIL + 1,
+    ['^'] = SIGIL_TREE + 1,
+    ['#'] = SIGIL_REF + 1,
+};
+
+typedef struct {
+  allocator_t* cells;
+  size_t count;
+  uint word;
+} cells_packer_t;
+
+// NOTE: cells are packed into a word, stored once it is full. Cells not written yet stay unset
+static sint pack_cells(void* ctx, const char* data, size_t len) {
+  cells_packer_t* packer = ctx;
+  for (size_t i = 0; i < len; ++i) {
+    u8 cell = CHAR_TO_CELL[(unsigned char)data[i]];
+    if (!cell) {
+      return ERR_VAL;
+    }
+    size_t shift = packer->count % CELLS_PER_WORD * BITS_PER_CELL;
+    packer->word &= ~((uint)CELL_UNSET << shift);
+    packer->word |= (uint)(cell - 1) << shift;
+    packer->count++;
+    if (packer->count % CELLS_PER_WORD == 0) {
+      size_t word_index = packer->count / CELLS_PER_WORD - 1;
+      if (_cells_set_packed(packer->cells, word_index, packer->word) == ERR_VAL) {
+        return ERR_VAL;
+      }
+      packer->word = ~(uint)0;
+    }
   }
-  assert(false && "unreachable");
+  return 0;
 }
 
-sint _eval_cells_load_json(struct json_parser_t* parser, eval_state_t* state) {
+sint _eval_cells_load_json(
+    struct json_parser_t* parser, eval_state_t* state, size_t* cells_count) {
   sint err = 0;
   allocator_t* cells = state->cells;
+  *cells_count = 0;
   _JSON_PARSER_EAT(OBJECT, 1);
   _JSON_PARSER_EAT_KEY("state", 1)
   if (_json_parser_match(parser, JSON_TOKEN_NULL)) {
     _JSON_PARSER_EAT(NULL, 1);
   } else {
-    _JSON_PARSER_EAT(STRING, 1);
-    const char* state_str = _json_parser_get_string(parser);
-    for (size_t i = 0; i < strlen(state_str); ++i) {
-      eval_cells_set(cells, i, get_cell(state_str[i]));
+    cells_packer_t packer = {.cells = cells, .word = ~(uint)0};
+    if (!_json_parser_eat_string_chunks(parser, pack_cells, &packer)) {
+      err = 1;
+      logg_s("failed to load cells");
+      goto error;
     }
+    if (packer.count % CELLS_PER_WORD) {
+      err = _cells_set_packed(cells, packer.count / CELLS_PER_WORD, packer.word);
+      CHECK_ERROR({})
+    }
+    *cells_count = packer.count;
   }
 
   _JSON_PARSER_EAT_KEY("words", 1)
@@ -346,11 +556,15 @@ sint _eval_cells_load_json(struct json_parser_t* parser, eval_state_t* state) {
     _JSON_PARSER_EAT(NULL, 1);
   } else {
     _JSON_PARSER_EAT(ARRAY, 1);
-    size_t words_count = parser->entries_count;
-    for (size_t i = 0; i < words_count; ++i) {
+    while (_json_parser_next_entry(parser)) {
       _JSON_PARSER_EAT(OBJECT, 1);
       _JSON_PARSER_EAT_KEY("index", 1)
       _JSON_PARSER_EAT(INTEGER, 1);
+      if (parser->digested_integer < 0) {
+        err = 1;
+        logg_s("negative word index");
+        goto error;
+      }
       size_t index = parser->digested_integer;
       _JSON_PARSER_EAT_KEY("payload", 1)
       if (_json_parser_match(parser, JSON_TOKEN_INTEGER)) {
@@ -366,10 +580,14 @@ sint _eval_cells_load_json(struct json_parser_t* parser, eval_state_t* state) {
         err = eval_cells_set_word(cells, index, symbol);
         CHECK_ERROR({})
       } else {
-        assert(0 && "unreachable");
+        err = 1;
+        logg_s("expected integer or string payload");
+        goto error;
       }
+      _JSON_PARSER_EAT(END, 1);
     }
   }
+  _JSON_PARSER_EAT(END, 1);
 
 error:
   return err;
@@ -377,92 +595,195 @@ error:
 
 // ********************** JSON DUMPING **********************
 
-#define CHECK(cond)                                                                                \
-  if (!(cond)) {                                                                                   \
-    goto error;                                                                                    \
+// NOTE: output is collected into a fixed buffer and handed to the writer once it fills up
+typedef struct {
+  char buffer[JSON_CHUNK_SIZE];
+  size_t len;
+  eval_writer_t write;
+  void* ctx;
+  sint err;
+} json_writer_t;
+
+static void writer_flush(json_writer_t* w) {
+  if (w->len && !w->err && w->write(w->ctx, w->buffer, w->len) != 0) {
+    w->err = ERR_VAL;
   }
+  w->len = 0;
+}
 
-static sint dump_apply_stack(struct string_buffer_t* json_out, const size_t* stack) {
-  sint result = 0;
-  _sb_printf(json_out, "\"apply_stack\": [");
-  for (size_t i = 0; i < stbds_arrlenu(stack); ++i) {
-    size_t e = stack[i];
-    if (e == TOKEN_APPLY) {
-      _sb_printf(json_out, "%d, ", -1);
-    } else {
-      _sb_printf(json_out, "%zu, ", e);
-    }
+// NOTE: makes room for n bytes, n is at most JSON_CHUNK_SIZE
+static char* writer_reserve(json_writer_t* w, size_t n) {
+  if (w->len + n > sizeof(w->buffer)) {
+    writer_flush(w);
   }
-  _sb_try_chop_suffix(json_out, ", ");
-  _sb_append_str(json_out, "]");
-
-  return result;
+  return w->buffer + w->len;
 }
 
-static sint dump_result_stack(struct string_buffer_t* json_out, const size_t* stack) {
-  sint result = 0;
-  _sb_printf(json_out, "\"result_stack\": [");
-  for (size_t i = 0; i < stbds_arrlenu(stack); ++i) {
-    _sb_printf(json_out, "%zu, ", stack[i]);
+static void writer_put(json_writer_t* w, const char* data, size_t len) {
+  while (len) {
+    size_t n = sizeof(w->buffer) - w->len;
+    n = n < len ? n : len;
+    memcpy(w->buffer + w->len, data, n);
+    w->len += n;
+    data += n;
+    len -= n;
+    if (w->len == sizeof(w->buffer)) {
+      writer_flush(w);
+    }
   }
-
-  _sb_try_chop_suffix(json_out, ", ");
-  _sb_append_str(json_out, "]");
-
-  return result;
 }
 
-sint eval_dump_json(struct string_buffer_t* json_out, eval_state_t* state) {
-  sint result = 0;
-  _sb_append_str(json_out, "{\n");
-
-  result = _eval_cells_dump_json(json_out, state->cells);
-  CHECK(result == 0);
-  _sb_append_str(json_out, ",\n");
-
-  result = dump_apply_stack(json_out, state->apply_stack);
-  CHECK(result == 0);
-  _sb_append_str(json_out, ",\n");
-
-  result = dump_result_stack(json_out, state->result_stack);
-  CHECK(result == 0);
-  _sb_append_str(json_out, ",\n");
-
-  if (_sb_try_chop_suffix(json_out, ",\n")) {
-    _sb_append_char(json_out, '\n');
+#define WRITER_PUT_STR(w, str) writer_put((w), (str), sizeof(str) - 1)
+
+static void writer_uint(json_writer_t* w, uint64_t value) {
+  char digits[20];
+  size_t n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  char* out = writer_reserve(w, n);
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = digits[n - 1 - i];
   }
-  _sb_append_char(json_out, '}');
-error:
-  return result;
+  w->len += n;
 }
 
-sint _eval_cells_dump_json(struct string_buffer_t* json_out, allocator_t* cells) {
-  sint result = 0;
-  char mappings[] = {'*', '^', '$', '#'};
+static void writer_int(json_writer_t* w, int64_t value) {
+  if (value < 0) {
+    writer_put(w, "-", 1);
+    writer_uint(w, -(uint64_t)value);
+  } else {
+    writer_uint(w, value);
+  }
+}
 
-  _sb_printf(json_out, "\"cells\": \"");
-  size_t i = 0;
-  while (eval_cells_is_set(cells, i)) {
-    u8 cell = eval_cells_get(cells, i);
-    _sb_append_char(json_out, mappings[cell]);
-    i++;
+// NOTE: cells are dumped up to the heap top, a word of cells at a time. Cells the collector
+// freed are written as nil and lose their words, so a reloaded heap holds no dead references
+static size_t dump_cells(json_writer_t* w, eval_state_t* state) {
+  allocator_t* cells = state->cells;
+  WRITER_PUT_STR(w, "\"cells\": {\"state\": \"");
+  size_t count = 0;
+  for (size_t word_index = 0; count < state->heap_top; ++word_index) {
+    uint word = cells->cells[word_index];
+    size_t cell_index = word_index * CELLS_PER_WORD;
+    uint used = state->free_bitmap[cell_index / BITS_PER_WORD] >> (cell_index % BITS_PER_WORD);
+    size_t limit = state->heap_top - count;
+    limit = limit < CELLS_PER_WORD ? limit : CELLS_PER_WORD;
+    char* out = writer_reserve(w, CELLS_PER_WORD);
+    size_t n = 0;
+    while (n < limit) {
+      bool live = used & 1;
+      if (live && (word & CELL_UNSET) == CELL_UNSET) {
+        break;
+      }
+      out[n++] = live ? CELL_TO_CHAR[word & CELL_UNSET] : '*';
+      word >>= BITS_PER_CELL;
+      used >>= 1;
+    }
+    w->len += n;
+    count += n;
+    if (n < CELLS_PER_WORD) {
+      break;
+    }
   }
-  _sb_printf(json_out, "\",\n");
+  WRITER_PUT_STR(w, "\",\n");
+
+  // NOTE: the k-th set bit of a block's bitmap owns the k-th word of the block
+  WRITER_PUT_STR(w, "\"words\": [");
+  bool first = true;
+  for (size_t block = 0; block * PAYLOAD_BLOCK_CELLS < count; ++block) {
+    const sint* payloads = cells->payload_blocks[block];
+    size_t rank = 0;
+    for (size_t b = 0; b < PAYLOAD_BLOCK_WORDS; ++b) {
+      size_t bitmap_index = block * PAYLOAD_BLOCK_WORDS + b;
+      if (bitmap_index * BITS_PER_WORD >= count) {
+        break;
+      }
+      uint bits = cells->words_bitmap[bitmap_index];
+      while (bits) {
+        size_t index = bitmap_index * BITS_PER_WORD + __builtin_ctzll(bits);
+        if (index >= count) {
+          break;
+        }
+        sint payload = payloads[rank++];
+        bits &= bits - 1;
+        if (!_bitmap_get_bit(state->free_bitmap, index)) {
+          continue;
+        }
+        if (!first) {
+          WRITER_PUT_STR(w, ", ");
+        }
+        first = false;
+        WRITER_PUT_STR(w, "{\"index\": ");
+        writer_uint(w, index);
+        WRITER_PUT_STR(w, ", \"payload\": ");
+        writer_int(w, payload);
+        WRITER_PUT_STR(w, "}");
+      }
+    }
+  }
+  WRITER_PUT_STR(w, "]}");
+  return count;
+}
 
-  _sb_printf(json_out, "\"words\": [");
-  i = 0;
-  while (eval_cells_is_set(cells, i)) {
-    sint i_word = 0;
-    sint err = eval_cells_get_word(cells, i, &i_word);
-    if (err != ERR_VAL) {
-      _sb_printf(json_out, "{ \"index\": %zu, \"payload\": %ld }, ", i, i_word);
+static void dump_stack(json_writer_t* w, const size_t* stack) {
+  WRITER_PUT_STR(w, "[");
+  bool first = true;
+  for (size_t i = 0; i < stbds_arrlenu(stack); ++i) {
+    size_t e = stack[i];
+    if (_eval_is_bookkeeping(e)) {
+      continue;
     }
-    i++;
+    if (!first) {
+      WRITER_PUT_STR(w, ", ");
+    }
+    first = false;
+    if (e == TOKEN_APPLY) {
+      WRITER_PUT_STR(w, "-1");
+    } else {
+      writer_uint(w, e);
+    }
+  }
+  WRITER_PUT_STR(w, "]");
+}
+
+// NOTE: refused while a thunk is forced, same as snapshots
+sint eval_dump_json_stream(eval_writer_t write, void* ctx, eval_state_t* state) {
+  if (!write || !state) {
+    return ERR_VAL;
+  }
+  _decoded_store(state);
+  if (!_eval_stack_portable(state->apply_stack)) {
+    return ERR_VAL;
   }
-  _sb_try_chop_suffix(json_out, ", ");
-  _sb_append_str(json_out, "]");
+  json_writer_t* w = malloc(sizeof(*w));
+  if (!w) {
+    return ERR_VAL;
+  }
+  w->len = 0;
+  w->write = write;
+  w->ctx = ctx;
+  w->err = 0;
+
+  WRITER_PUT_STR(w, "{\n");
+  dump_cells(w, state);
+  WRITER_PUT_STR(w, ",\n\"apply_stack\": ");
+  dump_stack(w, state->apply_stack);
+  WRITER_PUT_STR(w, ",\n\"result_stack\": ");
+  dump_stack(w, state->result_stack);
+  WRITER_PUT_STR(w, "\n}");
+  writer_flush(w);
+
+  sint err = w->err;
+  free(w);
+  return err;
+}
 
-  return result;
+sint eval_dump_json_fd(int fd, eval_state_t* state) {
+  return eval_dump_json_stream(_output_write_fd, &fd, state);
 }
 
-#undef CHECK
+sint eval_dump_json(struct string_buffer_t* json_out, eval_state_t* state) {
+  return eval_dump_json_stream(_output_write_string_buffer, json_out, state);
+}
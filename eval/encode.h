@@ -13,19 +13,29 @@ enum json_token_t {
   JSON_TOKEN_STRING,
   JSON_TOKEN_ARRAY,
   JSON_TOKEN_OBJECT,
+  JSON_TOKEN_END, // closing bracket of an array or an object
 };
 
-struct jsmntok;
+// NOTE: input is bytes read from fd in chunks, or one chunk owned by the caller
+#define JSON_CHUNK_SIZE (1 << 16)
+
+// NOTE: an open array or object, count is the keys and values read in it so far
+typedef struct {
+  char closer;
+  size_t count;
+} json_level_t;
 
 typedef struct json_parser_t {
-  const char* json;
-  struct jsmntok* tokens;
-  size_t tokens_len;
-  size_t cur_token;
+  const char* chunk;
+  size_t chunk_len;
+  size_t pos;
+  int fd;
+  char* read_buffer;
   bool was_err;
   bool at_eof;
-
-  size_t entries_count;
+  // NOTE: the separator read before the token at the cursor, zero if there was none
+  char separator;
+  json_level_t* levels;
 
   enum {
     JSON_DIGESTED_INVALID,
@@ -35,21 +45,32 @@ typedef struct json_parser_t {
     JSON_DIGESTED_STRING,
     JSON_DIGESTED_ARRAY,
     JSON_DIGESTED_OBJECT,
+    JSON_DIGESTED_END,
   } digested;
 
   string_buffer_t digested_string;
 
   union {
-    double digested_integer;
+    sint digested_integer;
     bool digested_bool;
   };
 } json_parser_t;
 
+// NOTE: receives the raw contents of a string as they are read, non zero stops the parser
+typedef sint (*json_string_sink_t)(void* ctx, const char* data, size_t len);
+
 // NOTE: doesn't take ownership of json
 sint _json_parser_init(const char* json, json_parser_t* parser);
+sint _json_parser_init_buffer(const char* data, size_t len, json_parser_t* parser);
+// NOTE: doesn't take ownership of fd
+sint _json_parser_init_fd(int fd, json_parser_t* parser);
 void _json_parser_free(json_parser_t* parser);
 bool _json_parser_match(json_parser_t* parser, enum json_token_t token);
 bool _json_parser_eat(json_parser_t* parser, enum json_token_t token);
+bool _json_parser_eat_string_chunks(json_parser_t* parser, json_string_sink_t sink, void* ctx);
+// NOTE: true while the current array or object has entries left, eats its closing bracket
+// otherwise. Running out of input inside of it is an error
+bool _json_parser_next_entry(json_parser_t* parser);
 const char* _json_parser_get_string(json_parser_t* parser);
 
 #define _JSON_PARSER_EAT(type, errval)                                                             \
@@ -77,8 +98,7 @@ const char* _json_parser_get_string(json_parser_t* parser);
 void _eval_debug_dump(eval_state_t* state, string_buffer_t* buffer);
 
 sint _eval_load_json(struct json_parser_t* parser, eval_state_t* state);
-sint _eval_cells_load_json(struct json_parser_t* parser, eval_state_t* state);
-
-sint _eval_cells_dump_json(string_buffer_t* json_out, allocator_t* cells);
+sint _eval_cells_load_json(
+    struct json_parser_t* parser, eval_state_t* state, size_t* cells_count);
 
 #endif
@@ -12,27 +12,59 @@
 #include "vendor/stb_ds.h"
 
 #include "eval.h"
+#include "heap.h"
 #include "memory.h"
 
-#define ERROR_BUF_SIZE 65536
-static char g_error_buf[ERROR_BUF_SIZE] = {};
+void _errbuf_clear(eval_state_t* state) {
+  state->error_code = 0;
+  state->error_file = NULL;
+  state->error_function = NULL;
+  state->error_line = 0;
+  state->error_len = 0;
+  state->error_buf[0] = '\0';
+}
 
-void _errbuf_clear() {
-  g_error_buf[0] = '\0';
+void _errbuf_raise(
+    eval_state_t* state, u8 code, const char* file, size_t line, const char* function) {
+  state->error_code = code;
+  state->error_file = file;
+  state->error_line = line;
+  state->error_function = function;
 }
 
-void _errbuf_write(const char* format, ...) {
+void _errbuf_write(eval_state_t* state, const char* format, ...) {
+  size_t remaining_space = ERROR_BUF_SIZE - state->error_len;
+  if (remaining_space <= 1) {
+    return;
+  }
   va_list args;
   va_start(args, format);
+  int written = vsnprintf(state->error_buf + state->error_len, remaining_space, format, args);
+  va_end(args);
+  if (written > 0) {
+    state->error_len += (size_t)written < remaining_space ? (size_t)written : remaining_space - 1;
+  }
+}
 
-  size_t current_length = strlen(g_error_buf);
-  size_t remaining_space = ERROR_BUF_SIZE - current_length;
-
-  if (remaining_space > 0) {
-    vsnprintf(g_error_buf + current_length, remaining_space, format, args);
+u8 eval_get_error(eval_state_t* state, const char** message) {
+  if (message) {
+    *message = state->error_buf;
   }
+  return state->error_code;
+}
 
-  va_end(args);
+sint eval_get_error_info(eval_state_t* state, eval_error_t* error) {
+  if (!state || !error) {
+    return ERR_VAL;
+  }
+  *error = (eval_error_t){
+      .code = state->error_code,
+      .file = state->error_file,
+      .function = state->error_function,
+      .line = state->error_line,
+      .message = state->error_buf,
+  };
+  return 0;
 }
 
 sint eval_init(eval_state_t** state) {
@@ -40,7 +72,7 @@ sint eval_init(eval_state_t** state) {
   if (s == NULL) {
     return ERR_VAL;
   }
-  s->error = g_error_buf;
+  s->error = s->error_buf;
 
   size_t cells_capacity = 4;
   sint res = eval_cells_init(&s->cells, cells_capacity);
@@ -50,6 +82,8 @@ sint eval_init(eval_state_t** state) {
 
   s->free_capacity = BITMAP_SIZE(cells_capacity * CELLS_PER_WORD);
   s->free_bitmap = calloc(1, s->free_capacity * sizeof(*s->free_bitmap));
+  s->gc_threshold = GC_MIN_THRESHOLD;
+  s->output_fd = STDOUT_FILENO;
   *state = s;
   return 0;
 }
@@ -59,9 +93,18 @@ sint eval_free(eval_state_t** state) {
   eval_cells_free(&s->cells);
   stbds_arrfree(s->apply_stack);
   stbds_arrfree(s->result_stack);
-  stbds_arrfree(s->match_stack);
   stbds_shfree(s->native_symbols);
-  free(s->free_bitmap);
+  stbds_hmfree(s->native_words);
+  _heap_free(s);
+  _memo_free(s);
+  stbds_arrfree(s->memo_frames);
+  stbds_arrfree(s->joins);
+  _lazy_free(s);
+  _fuse_free(s);
+  _decoded_drop(s);
+  _output_free(s);
+  _bytes_free(s);
+  _trace_free(s);
   free(s);
   *state = NULL;
   return 0;
@@ -69,7 +112,11 @@ sint eval_free(eval_state_t** state) {
 
 sint _eval_reset_cells(eval_state_t* state) {
   sint err = eval_cells_reset(state->cells);
-  memset(state->free_bitmap, 0, state->free_capacity * sizeof(*state->free_bitmap));
+  _heap_reset(state);
+  _memo_clear(state);
+  _lazy_clear(state);
+  _fuse_clear(state);
+  _bytes_clear(state);
   return err;
 }
 
@@ -77,28 +124,56 @@ sint eval_reset(eval_state_t* state) {
   if (!state) {
     return ERR_VAL;
   }
-  _errbuf_clear();
+  _errbuf_clear(state);
+  _decoded_drop(state);
   sint err = _eval_reset_cells(state);
   CHECK_ERROR({})
   stbds_arrsetlen(state->apply_stack, 0);
   stbds_arrsetlen(state->result_stack, 0);
-  stbds_arrsetlen(state->match_stack, 0);
-  for (size_t i = 0; i < stbds_shlenu(state->native_symbols); i++) {
-    native_entry_t e = state->native_symbols[i];
-    stbds_shdel(state->native_symbols, e.key);
-  }
-  stbds_arrsetlen(state->apply_stack, 0);
+  stbds_shfree(state->native_symbols);
+  stbds_hmfree(state->native_words);
+  _stats_clear(state);
   state->error_code = 0;
   return 0;
 error:
   return 1;
 }
 
-sint eval_add_native(eval_state_t* state, const char* name, uint symbol) {
+// NOTE: a name registered again drops its old word, unless another name still has it
+static void register_symbol(eval_state_t* state, const char* name, uint symbol, bool callable) {
+  ptrdiff_t previous = stbds_shgeti(state->native_symbols, name);
+  if (previous >= 0) {
+    uint word = state->native_symbols[previous].value;
+    bool shared = false;
+    for (size_t i = 0; i < stbds_shlenu(state->native_symbols) && !shared; ++i) {
+      shared = (ptrdiff_t)i != previous && state->native_symbols[i].value == word;
+    }
+    if (!shared) {
+      stbds_hmdel(state->native_words, word);
+    }
+  }
   stbds_shput(state->native_symbols, name, symbol);
+  stbds_hmput(state->native_words, symbol, callable);
+}
+
+sint eval_add_native(eval_state_t* state, const char* name, uint symbol) {
+  register_symbol(state, name, symbol, true);
   return 0;
 }
 
+sint _eval_add_tag(eval_state_t* state, const char* name, uint symbol) {
+  register_symbol(state, name, symbol, false);
+  return 0;
+}
+
+bool _eval_native_registered(eval_state_t* state, sint word) {
+  return stbds_hmgeti(state->native_words, (uint)word) >= 0;
+}
+
+bool _eval_native_callable(eval_state_t* state, sint word) {
+  return stbds_hmget(state->native_words, (uint)word);
+}
+
 sint eval_get_native(eval_state_t* state, const char* name, uint* symbol) {
   sint entry = stbds_shgeti(state->native_symbols, name);
   if (entry == -1) {
@@ -108,36 +183,226 @@ sint eval_get_native(eval_state_t* state, const char* name, uint* symbol) {
   return 0;
 }
 
-// ********************** ACTUAL EVALUATION **********************
+sint eval_set_option(eval_state_t* state, sint option, sint value) {
+  if (!state) {
+    return ERR_VAL;
+  }
+  switch (option) {
+  case EVAL_OPTION_INTERN:
+    if (value && state->lazy) {
+      return ERR_VAL;
+    }
+    if (!value) {
+      _cells_intern_clear(state->cells);
+    }
+    state->cells->interning = value != 0;
+    return 0;
+  case EVAL_OPTION_MEMO:
+    // NOTE: the cache is keyed on canonical ids, so it needs interning
+    if (value > 0) {
+      if (state->lazy) {
+        return ERR_VAL;
+      }
+      state->cells->interning = true;
+    }
+    return _memo_resize(state, value > 0 ? (size_t)value : 0);
+  case EVAL_OPTION_PARALLEL:
+    state->parallel_workers = value > 0 ? (size_t)value : 0;
+    return 0;
+  case EVAL_OPTION_LAZY:
+    // NOTE: thunks have no canonical id, so neither interning nor the memo cache apply
+    if (value && (state->cells->interning || state->memo_sets)) {
+      return ERR_VAL;
+    }
+    if (value && state->engine == EVAL_ENGINE_DECODED) {
+      return ERR_VAL;
+    }
+    state->lazy = value != 0;
+    return 0;
+  case EVAL_OPTION_ENGINE:
+    if (value != EVAL_ENGINE_CELLS && value != EVAL_ENGINE_DECODED) {
+      return ERR_VAL;
+    }
+    if (value == EVAL_ENGINE_DECODED && (state->lazy || state->trace || state->fuse)) {
+      return ERR_VAL;
+    }
+    _decoded_store(state);
+    state->engine = value;
+    return 0;
+  case EVAL_OPTION_FUSE:
+    if (value != EVAL_FUSE_OFF && value != EVAL_FUSE_ON && value != EVAL_FUSE_CHECK) {
+      return ERR_VAL;
+    }
+    // NOTE: the decoded engine has no fused rules
+    if (value != EVAL_FUSE_OFF && state->engine == EVAL_ENGINE_DECODED) {
+      return ERR_VAL;
+    }
+    state->fuse = value;
+    _fuse_tag(state);
+    return 0;
+  default:
+    return ERR_VAL;
+  }
+}
 
-#define EXPECT(cond, code, msg)                                                                    \
-  if (!(cond)) {                                                                                   \
-    goto error;                                                                                    \
+sint eval_intern_stats(eval_state_t* state, eval_intern_stats_t* stats) {
+  if (!state || !stats) {
+    return ERR_VAL;
   }
+  allocator_t* cells = state->cells;
+  stats->lookups = cells->intern_lookups;
+  stats->hits = cells->intern_hits;
+  stats->entries = stbds_hmlenu(cells->intern_table);
+  stats->hit_rate = cells->intern_lookups ? (double)cells->intern_hits / cells->intern_lookups : 0;
+  return 0;
+}
 
-static size_t next_n_vacant_cells(eval_state_t* state, size_t n) {
-  assert(n != 0);
-  for (size_t w = 0; w < state->free_capacity; ++w) {
-    if (state->free_bitmap[w] != (uint)-1) {
-      uint mask = (1ULL << n) - 1;
-      for (size_t b = 0; b < BITS_PER_WORD - n + 1; ++b) {
-        if ((state->free_bitmap[w] & mask) == 0) {
-          state->free_bitmap[w] |= mask;
-          return (w * BITS_PER_WORD) + b;
+sint eval_memo_stats(eval_state_t* state, eval_memo_stats_t* stats) {
+  if (!state || !stats) {
+    return ERR_VAL;
+  }
+  stats->capacity = state->memo_sets * MEMO_WAYS;
+  stats->lookups = state->memo_lookups;
+  stats->hits = state->memo_hits;
+  stats->evictions = state->memo_evictions;
+  stats->hit_rate = state->memo_lookups ? (double)state->memo_hits / state->memo_lookups : 0;
+  return 0;
+}
+
+// NOTE: canonical id of the node at index, interning it and every subnode without one.
+// Nodes are keyed by kind and canonical ids of their children, so equal ids mean equal trees.
+// returns CANON_NIL for nil and the passed index if the tree is broken
+size_t _eval_canonical(eval_state_t* state, size_t index) {
+  allocator_t* cells = state->cells;
+  index = _eval_dereference(state, index);
+  size_t canonical = index;
+  if (eval_cells_get(cells, index) == SIGIL_NIL) {
+    return CANON_NIL;
+  }
+  if (_cells_get_canon(cells, index, &canonical) != ERR_VAL) {
+    return canonical;
+  }
+
+  size_t* pending = NULL;
+  stbds_arrput(pending, index);
+  while (stbds_arrlenu(pending) > 0) {
+    size_t node = pending[stbds_arrlenu(pending) - 1];
+    if (_cells_get_canon(cells, node, &canonical) != ERR_VAL) {
+      stbds_arrpop(pending);
+      continue;
+    }
+
+    intern_key_t key = {0};
+    if (_eval_cell_test(state, node, _eval_is_native)) {
+      sint word = 0;
+      EVAL_ASSERT(eval_cells_get_word(cells, node, &word) != ERR_VAL, ERROR_INVALID_TREE, "");
+      key.kind = NODE_NATIVE;
+      key.left = (size_t)word;
+    } else {
+      EVAL_ASSERT(eval_cells_get(cells, node) == SIGIL_TREE, ERROR_INVALID_TREE, "");
+      size_t children[2] = {_eval_get_left_node(state, node), _eval_get_right_node(state, node)};
+      size_t ids[2] = {CANON_NIL, CANON_NIL};
+      bool ready = true;
+      for (size_t i = 0; i < 2; ++i) {
+        EVAL_ASSERT(children[i] != node, ERROR_INVALID_TREE, "");
+        if (eval_cells_get(cells, children[i]) == SIGIL_NIL) {
+          continue;
+        }
+        if (_cells_get_canon(cells, children[i], &ids[i]) == ERR_VAL) {
+          stbds_arrput(pending, children[i]);
+          ready = false;
         }
-        mask <<= 1;
       }
+      if (!ready) {
+        continue;
+      }
+      key.kind = ids[0] == CANON_NIL ? NODE_LEAF : ids[1] == CANON_NIL ? NODE_STEM : NODE_FORK;
+      key.left = ids[0];
+      key.right = ids[1];
+    }
+
+    stbds_arrpop(pending);
+    if (_cells_intern_find(cells, key, &canonical) != ERR_VAL) {
+      _cells_set_canon(cells, node, canonical);
+    } else {
+      _cells_intern_add(cells, key, node);
+    }
+  }
+  stbds_arrfree(pending);
+  _cells_get_canon(cells, index, &canonical);
+  return canonical;
+
+error:
+  stbds_arrfree(pending);
+  return index;
+}
+
+static bool is_node_start(eval_state_t* state, size_t index) {
+  u8 kind = _eval_node_kind(state, index);
+  return index < state->heap_top && kind != NODE_NONE && kind != NODE_NIL;
+}
+
+static bool verify_stack(eval_state_t* state, const size_t* stack) {
+  for (size_t i = 0; i < stbds_arrlenu(stack); ++i) {
+    size_t e = stack[i];
+    if (!_eval_is_token(e) && !is_node_start(state, e)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// NOTE: one pass over a loaded heap, run once instead of checking cells on every step.
+// The node index has to cover the heap (so it is well-formed), references have to land
+// on trees or natives (or updated thunks with call-by-need), thunks on their application,
+// natives have to carry their word and stacks have to hold nodes
+bool _eval_verify(eval_state_t* state) {
+  state->verified = false;
+  if (!state->node_index_valid) {
+    return false;
+  }
+  for (size_t i = 0; i < state->heap_top; ++i) {
+    u8 kind = _eval_node_kind(state, i);
+    if (kind != NODE_REF && kind != NODE_NATIVE && kind != NODE_THUNK) {
+      continue;
+    }
+    sint word = 0;
+    if (eval_cells_get_word(state->cells, i, &word) == ERR_VAL) {
+      return false;
+    }
+    if (kind == NODE_REF) {
+      size_t target = i + word;
+      u8 target_kind = _eval_node_kind(state, target);
+      if (!is_node_start(state, target) || (target_kind == NODE_REF && !state->lazy)) {
+        return false;
+      }
+    }
+    if (kind == NODE_THUNK && _eval_node_kind(state, i + word) != NODE_FORK) {
+      return false;
     }
   }
-  size_t old_cap = state->free_capacity;
-  state->free_capacity *= 2;
-  state->free_bitmap =
-      realloc(state->free_bitmap, state->free_capacity * sizeof(*state->free_bitmap));
-  memset(state->free_bitmap + old_cap, 0, old_cap * sizeof(*state->free_bitmap));
-  return next_n_vacant_cells(state, n);
+  if (!verify_stack(state, state->apply_stack) || !verify_stack(state, state->result_stack)) {
+    return false;
+  }
+  state->verified = true;
+  return true;
 }
 
-// TODO: need to verify the tree for validity before evaluation
+bool _eval_stack_portable(const size_t* stack) {
+  for (size_t i = 0; i < stbds_arrlenu(stack); ++i) {
+    if (stack[i] == TOKEN_UPDATE || stack[i] == TOKEN_JOIN) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// ********************** ACTUAL EVALUATION **********************
+
+#define EXPECT(cond, code, msg)                                                                    \
+  if (!(cond)) {                                                                                   \
+    goto error;                                                                                    \
+  }
 
 // NOTE: Two following algorithms: given a root, get the corresponding node index
 // works only for tree nodes, because others are essentially terminals
@@ -146,6 +411,18 @@ static size_t next_n_vacant_cells(eval_state_t* state, size_t n) {
 // returns the passed index if no corresponding node exists
 
 size_t _eval_get_left_node(eval_state_t* state, size_t root_index) {
+  u8 kind = _eval_node_kind(state, root_index);
+  if (kind != NODE_NONE) {
+    if (!_eval_kind_is_tree(kind)) {
+      return root_index;
+    }
+    size_t lhs_index = root_index + 1;
+    if (_eval_node_kind(state, lhs_index) == NODE_NIL) {
+      return lhs_index;
+    }
+    return _eval_dereference(state, lhs_index);
+  }
+
   sint root_cell = eval_cells_get(state->cells, root_index);
   if (root_cell == ERR_VAL || root_cell != SIGIL_TREE) {
     return root_index;
@@ -163,44 +440,43 @@ error:
 }
 
 size_t _eval_get_right_node(eval_state_t* state, size_t root_index) {
-  stbds_arrsetlen(state->match_stack, 0);
+  u8 kind = _eval_node_kind(state, root_index);
+  if (kind != NODE_NONE) {
+    if (!_eval_kind_is_tree(kind)) {
+      return root_index;
+    }
+    size_t lhs_index = root_index + 1;
+    return _eval_dereference(state, lhs_index + _eval_node_span(state, lhs_index));
+  }
+
   sint root_cell = eval_cells_get(state->cells, root_index);
   if (root_cell == ERR_VAL || root_cell != SIGIL_TREE) {
     return root_index;
   }
 
-  size_t cur = root_index + 1;
-  while (true) {
-    if (stbds_arrlenu(state->match_stack) == 1 && state->match_stack[0] == SIGIL_NIL) {
-      break;
-    }
+  size_t rhs_index = root_index;
+  sint err = eval_cells_subtree_end(state->cells, root_index + 1, &rhs_index);
+  EVAL_ASSERT(err != ERR_VAL, ERROR_INVALID_TREE, "");
 
-    if (stbds_arrlenu(state->match_stack) >= 3) {
-      size_t last = stbds_arrlenu(state->match_stack) - 1;
-      u8 rhs = state->match_stack[last];
-      u8 lhs = state->match_stack[last - 1];
-      u8 root = state->match_stack[last - 2];
-      if (_eval_is_leaf(root, lhs, rhs) || _eval_is_ref(root, lhs, rhs)
-          || _eval_is_native(root, lhs, rhs)) {
-        stbds_arrpop(state->match_stack); // rhs
-        stbds_arrpop(state->match_stack); // lhs
-        stbds_arrpop(state->match_stack); // root
-        stbds_arrput(state->match_stack, SIGIL_NIL);
-        continue;
+error:
+  return _eval_dereference(state, rhs_index);
+}
+
+static inline size_t dereference_once(eval_state_t* state, size_t index) {
+  u8 kind = _eval_node_kind(state, index);
+  if (kind != NODE_NONE) {
+    if (kind == NODE_REF) {
+      if (state->verified) {
+        return index + _cells_get_word_unchecked(state->cells, index);
       }
+      sint index_word = 0;
+      sint err = eval_cells_get_word(state->cells, index, &index_word);
+      EVAL_ASSERT(err != ERR_VAL, ERROR_GENERIC, "");
+      index += index_word;
     }
-
-    sint cell = eval_cells_get(state->cells, cur);
-    EVAL_ASSERT(cell != ERR_VAL, ERROR_INVALID_TREE, "");
-    stbds_arrput(state->match_stack, cell);
-    cur++;
+    return index;
   }
 
-error:
-  return _eval_dereference(state, cur);
-}
-
-size_t _eval_dereference(eval_state_t* state, size_t index) {
   sint index_cell = eval_cells_get(state->cells, index);
   sint index_left_cell = eval_cells_get(state->cells, index + 1);
   sint index_right_cell = eval_cells_get(state->cells, index + 2);
@@ -214,7 +490,23 @@ error:
   return index;
 }
 
+size_t _eval_dereference(eval_state_t* state, size_t index) {
+  size_t target = dereference_once(state, index);
+  // NOTE: with call-by-need a reference can land on an updated thunk, see lazy.c
+  while (state->lazy && target != index) {
+    index = target;
+    target = dereference_once(state, index);
+  }
+  return target;
+}
+
 bool _eval_is_terminal(eval_state_t* state, size_t index) {
+  u8 kind = _eval_node_kind(state, index);
+  if (kind != NODE_NONE) {
+    return kind == NODE_NIL || kind == NODE_LEAF || kind == NODE_REF || kind == NODE_NATIVE
+           || kind == NODE_THUNK;
+  }
+
   sint root = eval_cells_get(state->cells, index);
   sint left = eval_cells_get(state->cells, index + 1);
   sint right = eval_cells_get(state->cells, index + 2);
@@ -231,6 +523,7 @@ bool _eval_is_terminal(eval_state_t* state, size_t index) {
   result |= _eval_is_leaf(root, left, right);
   result |= _eval_is_ref(root, left, right);
   result |= _eval_is_native(root, left, right);
+  result |= _eval_is_thunk(root, left, right);
 
 error:
   return result;
@@ -244,47 +537,151 @@ error:
 // 1,2        ^   w   x   y   z
 // 1,2,3      ^   ^   w   x   y   ^   u   v
 // 0.a        ^   *   *   z
-// 0.b        ^   ^   *   *   *   z
+// 0.b        ^   A   *   z
 
 // clang-format on
 
-sint eval_step(eval_state_t* state) {
+// NOTE: with interning on, a rule 0 result equal to an existing node is that node.
+// key is filled in either way, so a miss can be added once the result is built
+static inline bool find_interned(
+    eval_state_t* state, intern_key_t* key, size_t left, size_t right, size_t* shared) {
+  if (!state->cells->interning) {
+    return false;
+  }
+  key->kind = right == CANON_NIL ? NODE_STEM : NODE_FORK;
+  key->left = _eval_canonical(state, left);
+  key->right = right == CANON_NIL ? CANON_NIL : _eval_canonical(state, right);
+  return _cells_intern_find(state->cells, *key, shared) != ERR_VAL;
+}
+
+// NOTE: with the memo cache on, an application that spawns further work is either
+// answered from the cache, or gets a TOKEN_MEMO under its work to store the result
+static inline bool memoized(eval_state_t* state, size_t F, size_t z) {
+  if (!state->memo_sets) {
+    return false;
+  }
+  size_t f_id = _eval_canonical(state, F);
+  size_t z_id = _eval_canonical(state, z);
+  size_t result = 0;
+  if (_memo_find(state, f_id, z_id, &result)) {
+    stbds_arrput(state->apply_stack, result);
+    return true;
+  }
+  memo_frame_t frame = {.f = f_id, .z = z_id, .native_calls = state->native_calls};
+  stbds_arrput(state->memo_frames, frame);
+  stbds_arrput(state->apply_stack, TOKEN_MEMO);
+  return false;
+}
+
+static inline void memo_complete(eval_state_t* state) {
+  EVAL_ASSERT(stbds_arrlenu(state->memo_frames) > 0, ERROR_STACK_UNDERFLOW, "no memo frame");
+  memo_frame_t frame = stbds_arrpop(state->memo_frames);
+  if (frame.native_calls == state->native_calls && stbds_arrlenu(state->result_stack) > 0) {
+    size_t result = state->result_stack[stbds_arrlenu(state->result_stack) - 1];
+    _memo_add(state, frame.f, frame.z, result);
+  }
+
+error:
+  return;
+}
+
+// NOTE: a verified heap is read without checks, see `_eval_verify`
+static inline sint cell_at(eval_state_t* state, size_t index) {
+  if (state->verified) {
+    return _cells_get_unchecked(state->cells, index);
+  }
+  return eval_cells_get(state->cells, index);
+}
+
+static inline void fired(eval_state_t* state, u8 rule, size_t F, size_t z) {
+  STATS_ADD(state->stats.rules[rule], 1);
+  if (state->trace) {
+    _trace_begin(state, rule, F, z);
+  }
+}
+
+// NOTE: single reduction, shared by `eval_step` and `eval_run`
+// so the run loop doesn't cross the library boundary on every rewrite
+static inline sint reduce(eval_state_t* state) {
+  // NOTE: between rewrites every live tree is reachable from the stacks
+  if (state->gc_allocated >= state->gc_threshold) {
+    _heap_collect(state);
+  }
+
+  STATS_PEAK(state->stats.apply_stack_peak, stbds_arrlenu(state->apply_stack));
   if (stbds_arrlenu(state->apply_stack) == 0) {
     EVAL_CHECK_STATE(state)
-    return true;
+    return !(state->lazy && _lazy_force_result(state));
   }
 
   bool was_apply = false;
   while (stbds_arrlenu(state->apply_stack) > 0) {
     size_t i = stbds_arrpop(state->apply_stack);
-    if (i == SIZE_MAX) {
+    if (i == TOKEN_APPLY) {
       was_apply = true;
       break;
     }
+    if (i == TOKEN_MEMO) {
+      memo_complete(state);
+      EVAL_CHECK_STATE(state)
+      continue;
+    }
+    if (i == TOKEN_JOIN) {
+      size_t joined = 0;
+      if (!_parallel_join(state, &joined)) {
+        goto error;
+      }
+      stbds_arrput(state->result_stack, joined);
+      continue;
+    }
+    if (i == TOKEN_UPDATE) {
+      EVAL_ASSERT(_lazy_update(state), ERROR_STACK_UNDERFLOW, "");
+      continue;
+    }
+    if (i == TOKEN_CHECK) {
+      EVAL_ASSERT(_fuse_check(state), ERROR_FUSE_MISMATCH, "fused and plain results differ");
+      continue;
+    }
     stbds_arrput(state->result_stack, _eval_dereference(state, i));
   }
+  STATS_PEAK(state->stats.result_stack_peak, stbds_arrlenu(state->result_stack));
 
   if (!was_apply) {
     EVAL_CHECK_STATE(state)
-    return true;
+    return !(state->lazy && _lazy_force_result(state));
   }
 
   EVAL_ASSERT(stbds_arrlenu(state->result_stack) >= 2, ERROR_STACK_UNDERFLOW, "");
 
   size_t F = stbds_arrpop(state->result_stack);
   size_t z = stbds_arrpop(state->result_stack);
-  sint F_cell = eval_cells_get(state->cells, F);
-  sint F_left = eval_cells_get(state->cells, F + 1);
-  sint F_right = eval_cells_get(state->cells, F + 2);
+  if (state->lazy && _lazy_blocked(state, F, z)) {
+    EVAL_CHECK_STATE(state)
+    return false;
+  }
+  if (state->fuse && _fuse_reduce(state, F, z)) {
+    fired(state, EVAL_RULE_FUSED, F, z);
+    EVAL_CHECK_STATE(state)
+    return false;
+  }
+  sint F_cell = cell_at(state, F);
+  sint F_left = cell_at(state, F + 1);
+  sint F_right = cell_at(state, F + 2);
 
   if (_eval_is_native(F_cell, F_left, F_right)) {
     sint word = 0;
-    sint err = eval_cells_get_word(state->cells, F, &word);
-    EVAL_ASSERT(err != ERR_VAL, ERROR_GENERIC, "");
+    if (state->verified) {
+      word = _cells_get_word_unchecked(state->cells, F);
+    } else {
+      EVAL_ASSERT(eval_cells_get_word(state->cells, F, &word) != ERR_VAL, ERROR_GENERIC, "");
+    }
+    EVAL_ASSERT(_eval_native_callable(state, word), ERROR_INVALID_TREE, "not a native");
     native_function_t func = (native_function_t)word;
+    state->native_calls++;
+    fired(state, EVAL_RULE_NATIVE, F, z);
     size_t res = func(state, z);
-    stbds_arrput(state->apply_stack, res);
     EVAL_CHECK_STATE(state)
+    stbds_arrput(state->apply_stack, res);
     return false;
   }
 
@@ -292,19 +689,28 @@ sint eval_step(eval_state_t* state) {
 
   size_t A = _eval_get_left_node(state, F);
   EVAL_ASSERT(A != F, ERROR_INVALID_TREE, "");
-  sint A_cell = eval_cells_get(state->cells, A);
+  sint A_cell = cell_at(state, A);
 
   size_t y = _eval_get_right_node(state, F);
   EVAL_ASSERT(y != F, ERROR_INVALID_TREE, "");
   size_t w = _eval_get_left_node(state, A);
   size_t x = _eval_get_right_node(state, A);
-  sint y_cell = eval_cells_get(state->cells, y);
-  sint w_cell = eval_cells_get(state->cells, w);
-  sint x_cell = eval_cells_get(state->cells, x);
+  sint y_cell = cell_at(state, y);
+  sint w_cell = cell_at(state, w);
+  sint x_cell = cell_at(state, x);
 
   // rule 0.a
   if (A_cell == SIGIL_NIL && y_cell == SIGIL_NIL) {
-    size_t new = next_n_vacant_cells(state, 5);
+    fired(state, EVAL_RULE_0A, F, z);
+    intern_key_t key = {0};
+    size_t shared = 0;
+    if (find_interned(state, &key, z, CANON_NIL, &shared)) {
+      stbds_arrput(state->apply_stack, shared);
+      EVAL_CHECK_STATE(state)
+      return false;
+    }
+    size_t new = _heap_alloc(state, 5);
+    EVAL_CHECK_STATE(state)
     size_t ref = new + 1;
     eval_cells_set(state->cells, new + 0, SIGIL_TREE);
     eval_cells_set(state->cells, ref, SIGIL_REF);
@@ -312,16 +718,27 @@ sint eval_step(eval_state_t* state) {
     eval_cells_set(state->cells, new + 3, SIGIL_NIL);
     eval_cells_set(state->cells, new + 4, SIGIL_NIL);
     eval_cells_set_word(state->cells, ref, z - ref);
+    _heap_index_range(state, new, new + 5);
+    if (state->cells->interning) {
+      _cells_intern_add(state->cells, key, new);
+    }
     stbds_arrput(state->apply_stack, new);
     EVAL_CHECK_STATE(state)
     return false;
   }
-  EVAL_ASSERT(w != A, ERROR_INVALID_TREE, "");
-  EVAL_ASSERT(x != A, ERROR_INVALID_TREE, "");
 
-  // rule 0.b
-  if (w_cell == SIGIL_NIL && x_cell == SIGIL_NIL && y_cell == SIGIL_NIL) {
-    size_t new = next_n_vacant_cells(state, 7);
+  // rule 0.b, any stem
+  if (y_cell == SIGIL_NIL) {
+    fired(state, EVAL_RULE_0B, F, z);
+    intern_key_t key = {0};
+    size_t shared = 0;
+    if (find_interned(state, &key, A, z, &shared)) {
+      stbds_arrput(state->apply_stack, shared);
+      EVAL_CHECK_STATE(state)
+      return false;
+    }
+    size_t new = _heap_alloc(state, 7);
+    EVAL_CHECK_STATE(state)
     size_t ref1 = new + 1;
     size_t ref2 = new + 4;
     eval_cells_set(state->cells, new + 0, SIGIL_TREE);
@@ -331,15 +748,22 @@ sint eval_step(eval_state_t* state) {
     eval_cells_set(state->cells, ref2, SIGIL_REF);
     eval_cells_set(state->cells, new + 5, SIGIL_NIL);
     eval_cells_set(state->cells, new + 6, SIGIL_NIL);
-    eval_cells_set_word(state->cells, ref2, A - ref1);
+    eval_cells_set_word(state->cells, ref1, A - ref1);
     eval_cells_set_word(state->cells, ref2, z - ref2);
+    _heap_index_range(state, new, new + 7);
+    if (state->cells->interning) {
+      _cells_intern_add(state->cells, key, new);
+    }
     stbds_arrput(state->apply_stack, new);
     EVAL_CHECK_STATE(state)
     return false;
   }
+  EVAL_ASSERT(w != A, ERROR_INVALID_TREE, "");
+  EVAL_ASSERT(x != A, ERROR_INVALID_TREE, "");
 
   if (w_cell == SIGIL_NIL && x_cell == SIGIL_NIL) {
     // rule 1
+    fired(state, EVAL_RULE_1, F, z);
     stbds_arrpush(state->apply_stack, y);
     EVAL_CHECK_STATE(state)
     return false;
@@ -350,7 +774,32 @@ sint eval_step(eval_state_t* state) {
   }
   if (w_cell != SIGIL_NIL && x_cell == SIGIL_NIL) {
     // rule 2
+    fired(state, EVAL_RULE_2, F, z);
+    if (memoized(state, F, z)) {
+      EVAL_CHECK_STATE(state)
+      return false;
+    }
     x = w; // NOTE: because I've unified all rules together, names have clashed
+    if (state->worker && _parallel_fork(state, x, z)) {
+      stbds_arrpush(state->apply_stack, TOKEN_APPLY);
+      stbds_arrpush(state->apply_stack, TOKEN_JOIN);
+      stbds_arrpush(state->apply_stack, TOKEN_APPLY);
+      stbds_arrpush(state->apply_stack, y);
+      stbds_arrpush(state->apply_stack, z);
+      EVAL_CHECK_STATE(state)
+      return false;
+    }
+    if (state->lazy) {
+      size_t thunk = _lazy_suspend(state, y, z);
+      EVAL_CHECK_STATE(state)
+      stbds_arrpush(state->apply_stack, TOKEN_APPLY);
+      stbds_arrpush(state->apply_stack, TOKEN_APPLY);
+      stbds_arrpush(state->apply_stack, x);
+      stbds_arrpush(state->apply_stack, z);
+      stbds_arrpush(state->apply_stack, thunk);
+      EVAL_CHECK_STATE(state)
+      return false;
+    }
     stbds_arrpush(state->apply_stack, TOKEN_APPLY);
     stbds_arrpush(state->apply_stack, TOKEN_APPLY);
     stbds_arrpush(state->apply_stack, x);
@@ -367,12 +816,13 @@ sint eval_step(eval_state_t* state) {
     EVAL_ASSERT(u != z, ERROR_INVALID_TREE, "");
     size_t v = _eval_get_right_node(state, z);
     EVAL_ASSERT(v != z, ERROR_INVALID_TREE, "");
-    sint u_cell = eval_cells_get(state->cells, u);
-    sint v_cell = eval_cells_get(state->cells, v);
+    sint u_cell = cell_at(state, u);
+    sint v_cell = cell_at(state, v);
     EVAL_ASSERT(u_cell != ERR_VAL, ERROR_INVALID_TREE, "");
     EVAL_ASSERT(v_cell != ERR_VAL, ERROR_INVALID_TREE, "");
     if (u_cell == SIGIL_NIL && v_cell == SIGIL_NIL) {
       // rule 3a
+      fired(state, EVAL_RULE_3A, F, z);
       stbds_arrpush(state->apply_stack, w);
       EVAL_CHECK_STATE(state)
       return false;
@@ -383,6 +833,11 @@ sint eval_step(eval_state_t* state) {
     }
     if (u_cell != SIGIL_NIL && v_cell == SIGIL_NIL) {
       // rule 3b
+      fired(state, EVAL_RULE_3B, F, z);
+      if (memoized(state, F, z)) {
+        EVAL_CHECK_STATE(state)
+        return false;
+      }
       stbds_arrpush(state->apply_stack, TOKEN_APPLY);
       stbds_arrpush(state->apply_stack, x);
       stbds_arrpush(state->apply_stack, u);
@@ -391,6 +846,11 @@ sint eval_step(eval_state_t* state) {
     }
     if (u_cell != SIGIL_NIL && v_cell != SIGIL_NIL) {
       // rule 3c
+      fired(state, EVAL_RULE_3C, F, z);
+      if (memoized(state, F, z)) {
+        EVAL_CHECK_STATE(state)
+        return false;
+      }
       stbds_arrpush(state->apply_stack, TOKEN_APPLY);
       stbds_arrpush(state->apply_stack, TOKEN_APPLY);
       stbds_arrpush(state->apply_stack, y);
@@ -405,6 +865,58 @@ error:
   return false;
 }
 
+sint eval_step(eval_state_t* state) {
+  STATS_CLOCK(start);
+  sint done = false;
+  if (state->engine == EVAL_ENGINE_DECODED) {
+    done = _decoded_run(state, 1, NULL);
+  } else {
+    done = reduce(state);
+    if (state->trace) {
+      _trace_end(state);
+    }
+  }
+  if (done || state->error_code) {
+    _output_flush(state);
+  }
+  STATS_ELAPSED(state, start);
+  return done && !state->error_code;
+}
+
+static sint run(eval_state_t* state, size_t max_steps, size_t* steps_done) {
+  if (state->engine == EVAL_ENGINE_DECODED) {
+    return _decoded_run(state, max_steps, steps_done);
+  }
+  if (state->parallel_workers > 1 && !state->worker && !state->lazy && !state->trace
+      && max_steps == EVAL_STEPS_UNLIMITED) {
+    return _parallel_run(state, state->parallel_workers, steps_done);
+  }
+  size_t steps = 0;
+  sint done = false;
+  while (steps < max_steps) {
+    done = reduce(state);
+    if (state->trace) {
+      _trace_end(state);
+    }
+    if (done || state->error_code) {
+      break;
+    }
+    steps++;
+  }
+  if (steps_done) {
+    *steps_done = steps;
+  }
+  return done && !state->error_code;
+}
+
+sint eval_run(eval_state_t* state, size_t max_steps, size_t* steps_done) {
+  STATS_CLOCK(start);
+  sint done = run(state, max_steps, steps_done);
+  _output_flush(state);
+  STATS_ELAPSED(state, start);
+  return done && !state->error_code;
+}
+
 #undef CALCULATE_OFFSET
 #undef EXPECT
 #undef ASSERT
@@ -4,23 +4,46 @@
 #include "api.h"
 #include <stdbool.h>
 
+#include "bytes.h"
+#include "decoded.h"
+#include "fuse.h"
+#include "heap.h"
+#include "lazy.h"
+#include "memo.h"
+#include "output.h"
+#include "parallel.h"
+#include "stats.h"
+#include "trace.h"
+
 #define SIGIL_NIL  0
 #define SIGIL_TREE 1
 #define SIGIL_REF  2
 
-#define TOKEN_APPLY SIZE_MAX
-
-#define ERROR_PARSE           1
-#define ERROR_STACK_UNDERFLOW 2
-#define ERROR_APPLY_TO_VALUE  3
-#define ERROR_INVALID_TREE    4
-#define ERROR_INVALID_CAST    5
-#define ERROR_GENERIC         127
+#define TOKEN_APPLY  SIZE_MAX
+#define TOKEN_MEMO   (SIZE_MAX - 1)
+#define TOKEN_JOIN   (SIZE_MAX - 2)
+#define TOKEN_UPDATE (SIZE_MAX - 3)
+#define TOKEN_CHECK  (SIZE_MAX - 4)
+
+#define NODE_NONE      0
+#define NODE_NIL       1
+#define NODE_LEAF      2
+#define NODE_STEM      3
+#define NODE_FORK      4
+#define NODE_REF       5
+#define NODE_NATIVE    6
+#define NODE_THUNK     7
+#define NODE_KIND_BITS 3
+#define NODE_KIND_MASK ((1u << NODE_KIND_BITS) - 1)
+#define NODE_SPAN_MAX  (UINT32_MAX >> NODE_KIND_BITS)
+
+// NOTE: messages past this are truncated, the code and the location are always kept
+#define ERROR_BUF_SIZE 4096
 
 #define EVAL_ASSERT(cond, code, msg)                                                               \
   if (!(cond)) {                                                                                   \
-    state->error_code = (code);                                                                    \
-    _errbuf_write("%s %s %s\n", #cond, #code, msg);                                                \
+    _errbuf_raise(state, (code), __FILE__, __LINE__, __func__);                                    \
+    _errbuf_write(state, "%s %s %s\n", #cond, #code, msg);                                         \
     goto error;                                                                                    \
   }
 
@@ -36,6 +59,11 @@ typedef struct {
   uint value;
 } native_entry_t;
 
+typedef struct {
+  uint key;
+  bool value;
+} native_word_t;
+
 struct eval_state_t {
   allocator_t* cells;
   size_t* apply_stack;
@@ -43,11 +71,92 @@ struct eval_state_t {
 
   uint* free_bitmap;
   size_t free_capacity;
-  u8* match_stack;
+  size_t heap_top;
+  size_t heap_used;
+  size_t* heap_classes[HEAP_RUN_MIN];
+  heap_run_t* heap_runs;
+  size_t heap_cursor;
+  size_t gc_allocated;
+  size_t gc_threshold;
+  size_t gc_collections;
+  size_t heap_allocated;
+
+  // NOTE: per cell kind and subtree length of the node starting there,
+  // NODE_NONE for cells inside terminals
+  uint32_t* node_index;
+  size_t node_capacity;
+  bool node_index_valid;
+  // NOTE: set by `_eval_verify` after a load, rule results keep the heap well-formed
+  bool verified;
+  index_frame_t* index_stack;
+
+  // NOTE: optional (F z) -> normal form cache over canonical ids, see memo.h
+  memo_entry_t* memo_entries;
+  u8* memo_hands;
+  size_t memo_sets;
+  memo_frame_t* memo_frames;
+  size_t memo_lookups;
+  size_t memo_hits;
+  size_t memo_evictions;
+  size_t native_calls;
+
+  // NOTE: optional parallel reduction, see parallel.h. worker is set while a pool runs the
+  // state, joins holds its forked tasks in the order of their TOKEN_JOIN
+  size_t parallel_workers;
+  struct parallel_worker_t* worker;
+  struct parallel_task_t** joins;
+
+  // NOTE: optional call-by-need, see lazy.h. lazy_updates holds the thunks being forced in
+  // the order of their TOKEN_UPDATE, the rest drives forcing a result to its normal form
+  bool lazy;
+  size_t* lazy_updates;
+  bool lazy_forcing;
+  size_t* lazy_frontier;
+  lazy_seen_t* lazy_seen;
+  size_t lazy_thunks;
+  size_t lazy_forced;
+
+  // NOTE: one of EVAL_ENGINE_*, decoded is the translation of the decoded engine, see decoded.h
+  sint engine;
+  struct decoded_t* decoded;
+
+  // NOTE: one of EVAL_FUSE_*, fuse_tags holds a FUSE_* tag per loaded cell, see fuse.h.
+  // fuse_checks holds the fused results waiting for their TOKEN_CHECK
+  sint fuse;
+  u8* fuse_tags;
+  size_t fuse_capacity;
+  size_t* fuse_checks;
+  size_t fuse_hits;
+
+  // NOTE: kept only with EVAL_STATS, see stats.h
+  eval_stats_t stats;
+  // NOTE: the step trace while one runs, see trace.h
+  struct trace_t* trace;
 
   native_entry_t* native_symbols;
+  // NOTE: the registered words, true for the ones that can be called. A native is only
+  // called with one of those. Terminals of values (integer payloads, byte string ids) are
+  // natives too, so a heap can't be checked for them once at load. Type tags are registered
+  // by name but are never called
+  native_word_t* native_words;
+  // NOTE: byte strings by id and the ids free for reuse, see bytes.h
+  bytes_entry_t* bytes;
+  size_t* bytes_free;
+  // NOTE: the output sink is output_write with output_ctx, or output_fd without a writer
+  eval_writer_t output_write;
+  void* output_ctx;
+  int output_fd;
+  char* output_chunk;
+  size_t output_len;
+
+  // NOTE: owned by the state, so states on different threads don't share anything
   uint8_t error_code;
   const char* error;
+  const char* error_file;
+  const char* error_function;
+  size_t error_line;
+  size_t error_len;
+  char error_buf[ERROR_BUF_SIZE];
 };
 
 sint _eval_reset_cells(eval_state_t* state);
@@ -69,6 +178,36 @@ static inline bool _eval_is_native(sint root, sint left, sint right) {
   return root == SIGIL_REF && left == SIGIL_REF && right == SIGIL_NIL;
 }
 
+static inline bool _eval_is_thunk(sint root, sint left, sint right) {
+  return root == SIGIL_REF && left == SIGIL_TREE && right == SIGIL_NIL;
+}
+
+static inline bool _eval_is_token(size_t entry) {
+  return entry >= TOKEN_CHECK;
+}
+
+// NOTE: memo frames and fuse checks only serve the run that pushed them, dumps and snapshots
+// leave their tokens out. Forcing and joins can't be resumed without their frames, so a
+// stack holding their tokens is not saved at all, see `_eval_stack_portable`
+static inline bool _eval_is_bookkeeping(size_t entry) {
+  return entry == TOKEN_MEMO || entry == TOKEN_CHECK;
+}
+
+static inline u8 _eval_node_kind(eval_state_t* state, size_t index) {
+  if (!state->node_index_valid || index >= state->node_capacity) {
+    return NODE_NONE;
+  }
+  return state->node_index[index] & NODE_KIND_MASK;
+}
+
+static inline size_t _eval_node_span(eval_state_t* state, size_t index) {
+  return state->node_index[index] >> NODE_KIND_BITS;
+}
+
+static inline bool _eval_kind_is_tree(u8 kind) {
+  return kind == NODE_LEAF || kind == NODE_STEM || kind == NODE_FORK;
+}
+
 static inline bool _eval_cell_test(
     eval_state_t* state, size_t index, bool (*tester)(sint root, sint left, sint right)) {
   sint root = eval_cells_get(state->cells, index);
@@ -81,8 +220,16 @@ bool _eval_is_terminal(eval_state_t* state, size_t index);
 size_t _eval_get_left_node(eval_state_t* state, size_t root_index);
 size_t _eval_get_right_node(eval_state_t* state, size_t root_index);
 size_t _eval_dereference(eval_state_t* state, size_t index);
-
-void _errbuf_write(const char* format, ...);
-void _errbuf_clear();
+size_t _eval_canonical(eval_state_t* state, size_t index);
+bool _eval_verify(eval_state_t* state);
+bool _eval_stack_portable(const size_t* stack);
+sint _eval_add_tag(eval_state_t* state, const char* name, uint symbol);
+bool _eval_native_registered(eval_state_t* state, sint word);
+bool _eval_native_callable(eval_state_t* state, sint word);
+
+void _errbuf_raise(
+    eval_state_t* state, u8 code, const char* file, size_t line, const char* function);
+void _errbuf_write(eval_state_t* state, const char* format, ...);
+void _errbuf_clear(eval_state_t* state);
 
 #endif
@@ -14,6 +14,7 @@ if not os.path.exists(LIB_PATH):
         f"Was searching for {LIB_PATH}")
 
 EvalState = ctypes.c_void_p
+STEPS_UNLIMITED = 2**(8 * ctypes.sizeof(ctypes.c_size_t)) - 1
 
 
 def load_rt_lib():
@@ -32,8 +33,11 @@ class EvalLib:
         self.rt_lib.eval_init.restype = ctypes.c_size_t
         self.rt_lib.eval_free.argtypes = [ctypes.POINTER(EvalState)]
         self.rt_lib.eval_free.restype = ctypes.c_size_t
-        self.rt_lib.eval_eval.argtypes = [EvalState]
-        self.rt_lib.eval_eval.restype = ctypes.c_size_t
+        self.rt_lib.eval_run.argtypes = [
+            EvalState, ctypes.c_size_t,
+            ctypes.POINTER(ctypes.c_size_t)
+        ]
+        self.rt_lib.eval_run.restype = ctypes.c_size_t
         self.rt_lib.eval_step.argtypes = [EvalState]
         self.rt_lib.eval_step.restype = ctypes.c_size_t
         self.rt_lib.eval_get_error.argtypes = [
@@ -53,8 +57,10 @@ class EvalLib:
         self.rt_lib.eval_free(ctypes.byref(state))
         return state
 
-    def evaluate(self, state: EvalState):
-        return self.rt_lib.eval_eval(state)
+    def evaluate(self, state: EvalState, max_steps: int = STEPS_UNLIMITED):
+        steps_done = ctypes.c_size_t(0)
+        done = self.rt_lib.eval_run(state, max_steps, ctypes.byref(steps_done))
+        return done, steps_done.value
 
 
 class Evaluator:
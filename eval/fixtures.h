@@ -0,0 +1,32 @@
+#ifndef __EVAL_FIXTURES__
+#define __EVAL_FIXTURES__
+
+#include "api.h"
+#include <stdbool.h>
+
+#include "memory.h"
+
+// NOTE: trees shared by the tests and the micro-benchmarks, not part of the library
+
+// NOTE: writes a random tree of at most depth levels at index and returns where it ends.
+// Leaves are nil, refs #** and natives ##*, along with thunks #^* when thunks is set
+static inline size_t _fixture_random_tree(
+    allocator_t* cells, size_t index, uint* seed, size_t depth, bool thunks) {
+  *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  uint roll = (*seed >> 33) % 8;
+  if (depth == 0 || roll == 0) {
+    eval_cells_set(cells, index++, SIGIL_NIL);
+    return index;
+  }
+  if (roll <= 2 || (thunks && roll == 3)) {
+    eval_cells_set(cells, index++, SIGIL_REF);
+    eval_cells_set(cells, index++, roll == 1 ? SIGIL_NIL : roll == 2 ? SIGIL_REF : SIGIL_TREE);
+    eval_cells_set(cells, index++, SIGIL_NIL);
+    return index;
+  }
+  eval_cells_set(cells, index++, SIGIL_TREE);
+  index = _fixture_random_tree(cells, index, seed, depth - 1, thunks);
+  return _fixture_random_tree(cells, index, seed, depth - 1, thunks);
+}
+
+#endif
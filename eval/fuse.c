@@ -0,0 +1,219 @@
+#include "api.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vendor/stb_ds.h"
+
+#include "eval.h"
+#include "fuse.h"
+#include "memory.h"
+#include "util.h"
+
+// NOTE: K, S and triage are rules 1, 2 and 3 themselves, so they already take one step.
+// What costs several is an idiom whose rules only shuffle values that are already there:
+// I z goes through K z twice and rule 1, taking the second of a pair through K I u v
+// is a triage, rule 1 and I. Each of those ends in a node of F or z, so a fused step
+// pushes that node and allocates nothing. Tags are read from the node index, which holds
+// the heap as it was loaded, and rule results are never tagged: cells written again are
+// untagged by `_heap_index_range`
+
+static bool is(eval_state_t* state, size_t index, u8 kind) {
+  return _eval_node_kind(state, index) == kind;
+}
+
+static size_t left(eval_state_t* state, size_t index) {
+  return _eval_get_left_node(state, index);
+}
+
+static size_t right(eval_state_t* state, size_t index) {
+  return _eval_get_right_node(state, index);
+}
+
+static bool is_k(eval_state_t* state, size_t index) {
+  return is(state, index, NODE_STEM) && is(state, left(state, index), NODE_LEAF);
+}
+
+// NOTE: K c, the result of applying K, which ignores its argument
+static bool is_const(eval_state_t* state, size_t index) {
+  return is(state, index, NODE_FORK) && is(state, left(state, index), NODE_LEAF);
+}
+
+static bool is_i(eval_state_t* state, size_t index) {
+  if (!is(state, index, NODE_FORK)) {
+    return false;
+  }
+  size_t A = left(state, index);
+  return is(state, A, NODE_STEM) && is_k(state, left(state, A))
+         && is_k(state, right(state, index));
+}
+
+static u8 classify(eval_state_t* state, size_t F) {
+  if (!is(state, F, NODE_FORK)) {
+    return FUSE_NONE;
+  }
+  if (is_i(state, F)) {
+    return FUSE_I;
+  }
+  size_t A = left(state, F);
+  if (!is(state, A, NODE_FORK)) {
+    return FUSE_NONE;
+  }
+  size_t x = right(state, A);
+  size_t y = right(state, F);
+  u8 tag = FUSE_NONE;
+  if (is_const(state, x)) {
+    tag |= FUSE_STEM_CONST;
+  } else if (is_i(state, x)) {
+    tag |= FUSE_STEM_ID;
+  }
+  if (is_k(state, y)) {
+    tag |= FUSE_FORK_FIRST;
+  } else if (is_const(state, y) && is_i(state, right(state, y))) {
+    tag |= FUSE_FORK_SECOND;
+  } else if (is_const(state, y) && is_const(state, right(state, y))) {
+    tag |= FUSE_FORK_CONST;
+  }
+  return tag;
+}
+
+// NOTE: the result of a fused step, SIZE_MAX when z doesn't have the shape the tag needs
+static size_t fused(eval_state_t* state, u8 tag, size_t F, size_t z) {
+  if (tag == FUSE_I) {
+    return z;
+  }
+  u8 kind = _eval_node_kind(state, z);
+  if (kind == NODE_STEM) {
+    switch (tag & FUSE_STEM_MASK) {
+    case FUSE_STEM_CONST:
+      return right(state, right(state, left(state, F)));
+    case FUSE_STEM_ID:
+      return left(state, z);
+    }
+  } else if (kind == NODE_FORK) {
+    switch (tag & FUSE_FORK_MASK) {
+    case FUSE_FORK_FIRST:
+      return left(state, z);
+    case FUSE_FORK_SECOND:
+      return right(state, z);
+    case FUSE_FORK_CONST:
+      return right(state, right(state, right(state, F)));
+    }
+  }
+  return SIZE_MAX;
+}
+
+// NOTE: natives are equal when they call the same function, thunks only to themselves
+static bool same_tree(eval_state_t* state, size_t a, size_t b) {
+  size_t* pending = NULL;
+  bool same = true;
+  stbds_arrput(pending, a);
+  stbds_arrput(pending, b);
+  while (same && stbds_arrlenu(pending) > 0) {
+    size_t rhs = _eval_dereference(state, stbds_arrpop(pending));
+    size_t lhs = _eval_dereference(state, stbds_arrpop(pending));
+    if (lhs == rhs) {
+      continue;
+    }
+    sint cell = eval_cells_get(state->cells, lhs);
+    if (cell != eval_cells_get(state->cells, rhs)) {
+      same = false;
+    } else if (cell == SIGIL_TREE) {
+      stbds_arrput(pending, left(state, lhs));
+      stbds_arrput(pending, left(state, rhs));
+      stbds_arrput(pending, right(state, lhs));
+      stbds_arrput(pending, right(state, rhs));
+    } else if (cell == SIGIL_REF) {
+      sint lhs_word = 0;
+      sint rhs_word = 0;
+      eval_cells_get_word(state->cells, lhs, &lhs_word);
+      eval_cells_get_word(state->cells, rhs, &rhs_word);
+      same = _eval_cell_test(state, lhs, _eval_is_native)
+             && _eval_cell_test(state, rhs, _eval_is_native) && lhs_word == rhs_word;
+    }
+  }
+  stbds_arrfree(pending);
+  return same;
+}
+
+void _fuse_tag(eval_state_t* state) {
+  free(state->fuse_tags);
+  state->fuse_tags = NULL;
+  state->fuse_capacity = 0;
+  if (state->fuse == EVAL_FUSE_OFF || !state->node_index_valid) {
+    return;
+  }
+  state->fuse_tags = calloc(state->node_capacity, sizeof(*state->fuse_tags));
+  if (!state->fuse_tags) {
+    return;
+  }
+  state->fuse_capacity = state->node_capacity;
+  size_t top = state->heap_top < state->fuse_capacity ? state->heap_top : state->fuse_capacity;
+  for (size_t i = 0; i < top; ++i) {
+    if (_bitmap_get_bit(state->free_bitmap, i)) {
+      state->fuse_tags[i] = classify(state, i);
+    }
+  }
+}
+
+// NOTE: fused results are not saved with the stacks, so the checks of a loaded stack are
+// dropped along with their tokens
+void _fuse_loaded(eval_state_t* state) {
+  _fuse_clear(state);
+  size_t kept = 0;
+  for (size_t i = 0; i < stbds_arrlenu(state->apply_stack); ++i) {
+    if (state->apply_stack[i] != TOKEN_CHECK) {
+      state->apply_stack[kept++] = state->apply_stack[i];
+    }
+  }
+  stbds_arrsetlen(state->apply_stack, kept);
+  _fuse_tag(state);
+}
+
+void _fuse_untag(eval_state_t* state, size_t from, size_t to) {
+  if (from >= state->fuse_capacity) {
+    return;
+  }
+  size_t end = to < state->fuse_capacity ? to : state->fuse_capacity;
+  memset(state->fuse_tags + from, FUSE_NONE, end - from);
+}
+
+// NOTE: in check mode the fused result waits in fuse_checks under a TOKEN_CHECK and the
+// plain rules run anyway, popping the token compares the two
+bool _fuse_reduce(eval_state_t* state, size_t F, size_t z) {
+  u8 tag = F < state->fuse_capacity ? state->fuse_tags[F] : FUSE_NONE;
+  if (tag == FUSE_NONE) {
+    return false;
+  }
+  size_t result = fused(state, tag, F, z);
+  if (result == SIZE_MAX) {
+    return false;
+  }
+  state->fuse_hits++;
+  if (state->fuse == EVAL_FUSE_CHECK) {
+    stbds_arrput(state->fuse_checks, result);
+    stbds_arrput(state->apply_stack, TOKEN_CHECK);
+    return false;
+  }
+  stbds_arrput(state->apply_stack, result);
+  return true;
+}
+
+bool _fuse_check(eval_state_t* state) {
+  if (stbds_arrlenu(state->fuse_checks) == 0 || stbds_arrlenu(state->result_stack) == 0) {
+    return false;
+  }
+  size_t expected = stbds_arrpop(state->fuse_checks);
+  return same_tree(state, expected, stbds_arrlast(state->result_stack));
+}
+
+void _fuse_clear(eval_state_t* state) {
+  stbds_arrsetlen(state->fuse_checks, 0);
+}
+
+void _fuse_free(eval_state_t* state) {
+  free(state->fuse_tags);
+  state->fuse_tags = NULL;
+  state->fuse_capacity = 0;
+  stbds_arrfree(state->fuse_checks);
+}
@@ -0,0 +1,30 @@
+#ifndef __EVAL_FUSE__
+#define __EVAL_FUSE__
+
+#include "api.h"
+#include <stdbool.h>
+
+// NOTE: opt-in superinstructions, see fuse.c. Loaded forks that spell a known idiom are
+// tagged, applying a tagged fork to an argument of the matching shape is a single step.
+// With K = ^^ and I = ^(^K)K, a tag is FUSE_I or a triage ^(^wx)y, whose stem and fork
+// branches are tagged on their own
+
+#define FUSE_NONE        0
+#define FUSE_I           1        // I z = z
+#define FUSE_STEM_MASK   (3 << 1) //
+#define FUSE_STEM_CONST  (1 << 1) // x = K c, ^(^wx)y (^u) = c
+#define FUSE_STEM_ID     (2 << 1) // x = I, ^(^wx)y (^u) = u
+#define FUSE_FORK_MASK   (3 << 3) //
+#define FUSE_FORK_FIRST  (1 << 3) // y = K, ^(^wx)y (^uv) = u
+#define FUSE_FORK_SECOND (2 << 3) // y = K I, ^(^wx)y (^uv) = v
+#define FUSE_FORK_CONST  (3 << 3) // y = K (K c), ^(^wx)y (^uv) = c
+
+void _fuse_tag(eval_state_t* state);
+void _fuse_loaded(eval_state_t* state);
+void _fuse_untag(eval_state_t* state, size_t from, size_t to);
+bool _fuse_reduce(eval_state_t* state, size_t F, size_t z);
+bool _fuse_check(eval_state_t* state);
+void _fuse_clear(eval_state_t* state);
+void _fuse_free(eval_state_t* state);
+
+#endif
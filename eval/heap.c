@@ -0,0 +1,481 @@
+#include "api.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vendor/stb_ds.h"
+
+#include "eval.h"
+#include "fuse.h"
+#include "heap.h"
+#include "memory.h"
+#include "util.h"
+
+static sint reserve_node_index(eval_state_t* state) {
+  size_t capacity = state->free_capacity * BITS_PER_WORD;
+  if (capacity <= state->node_capacity) {
+    return 0;
+  }
+  uint32_t* index = realloc(state->node_index, capacity * sizeof(*state->node_index));
+  if (!index) {
+    return ERR_VAL;
+  }
+  memset(
+      index + state->node_capacity,
+      0,
+      (capacity - state->node_capacity) * sizeof(*state->node_index));
+  state->node_index = index;
+  state->node_capacity = capacity;
+  return 0;
+}
+
+sint _heap_reserve(eval_state_t* state, size_t cells_count) {
+  size_t needed = BITMAP_SIZE(cells_count);
+  if (needed <= state->free_capacity) {
+    return reserve_node_index(state);
+  }
+  size_t new_capacity = state->free_capacity;
+  while (new_capacity < needed) {
+    new_capacity *= 2;
+  }
+  uint* bitmap = realloc(state->free_bitmap, new_capacity * sizeof(*state->free_bitmap));
+  if (!bitmap) {
+    return ERR_VAL;
+  }
+  memset(
+      bitmap + state->free_capacity,
+      0,
+      (new_capacity - state->free_capacity) * sizeof(*state->free_bitmap));
+  state->free_bitmap = bitmap;
+  state->free_capacity = new_capacity;
+  STATS_ADD(state->stats.heap_growths, 1);
+  return reserve_node_index(state);
+}
+
+static void clear_free_lists(eval_state_t* state) {
+  for (size_t i = 0; i < HEAP_RUN_MIN; ++i) {
+    stbds_arrsetlen(state->heap_classes[i], 0);
+  }
+  stbds_arrsetlen(state->heap_runs, 0);
+  state->heap_cursor = 0;
+}
+
+void _heap_reset(eval_state_t* state) {
+  memset(state->free_bitmap, 0, state->free_capacity * sizeof(*state->free_bitmap));
+  clear_free_lists(state);
+  state->heap_top = 0;
+  state->heap_used = 0;
+  state->gc_allocated = 0;
+  state->gc_threshold = GC_MIN_THRESHOLD;
+  state->node_index_valid = true;
+  state->verified = false;
+}
+
+void _heap_free(eval_state_t* state) {
+  for (size_t i = 0; i < HEAP_RUN_MIN; ++i) {
+    stbds_arrfree(state->heap_classes[i]);
+  }
+  stbds_arrfree(state->heap_runs);
+  stbds_arrfree(state->index_stack);
+  free(state->free_bitmap);
+  state->free_bitmap = NULL;
+  free(state->node_index);
+  state->node_index = NULL;
+}
+
+sint _heap_mark_loaded(eval_state_t* state, size_t cells_count) {
+  sint err = _heap_reserve(state, cells_count);
+  if (err == ERR_VAL) {
+    return err;
+  }
+  for (size_t i = 0; i < cells_count; ++i) {
+    if (!_bitmap_get_bit(state->free_bitmap, i)) {
+      _bitmap_set_bit(state->free_bitmap, i, 1);
+      state->heap_used++;
+    }
+  }
+  if (cells_count > state->heap_top) {
+    state->heap_top = cells_count;
+  }
+  // NOTE: a malformed image is still loaded, accessors just fall back to scanning cells
+  state->node_index_valid = _heap_index_range(state, 0, cells_count) != ERR_VAL;
+  return 0;
+}
+
+static void put_free_block(eval_state_t* state, size_t start, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  if (len < HEAP_RUN_MIN) {
+    stbds_arrput(state->heap_classes[len], start);
+    return;
+  }
+  stbds_arrput(state->heap_runs, ((heap_run_t){.start = start, .len = len}));
+}
+
+static void claim(eval_state_t* state, size_t start, size_t n) {
+  for (size_t i = start; i < start + n; ++i) {
+    _bitmap_set_bit(state->free_bitmap, i, 1);
+  }
+  state->heap_used += n;
+  state->gc_allocated += n;
+  state->heap_allocated += n;
+  STATS_ADD(state->stats.cells_allocated, n);
+}
+
+// NOTE: exact size list first, then next-fit over the runs, then the bump pointer.
+// The cursor only moves forward between collections, so every run is skipped at most once.
+// Answers SIZE_MAX with the state's error set when the cells can't be reserved
+size_t _heap_alloc(eval_state_t* state, size_t n) {
+  EVAL_ASSERT(n != 0, ERROR_GENERIC, "empty allocation");
+  if (n < HEAP_RUN_MIN && stbds_arrlenu(state->heap_classes[n]) > 0) {
+    size_t start = stbds_arrpop(state->heap_classes[n]);
+    claim(state, start, n);
+    return start;
+  }
+
+  while (state->heap_cursor < stbds_arrlenu(state->heap_runs)) {
+    heap_run_t* run = &state->heap_runs[state->heap_cursor];
+    STATS_ADD(state->stats.run_probes, 1);
+    if (run->len < n) {
+      state->heap_cursor++;
+      continue;
+    }
+    size_t start = run->start;
+    run->start += n;
+    run->len -= n;
+    if (run->len < HEAP_RUN_MIN) {
+      put_free_block(state, run->start, run->len);
+      run->len = 0;
+      state->heap_cursor++;
+    }
+    claim(state, start, n);
+    return start;
+  }
+
+  size_t start = state->heap_top;
+  EVAL_ASSERT(_heap_reserve(state, start + n) != ERR_VAL, ERROR_GENERIC, "out of cells");
+  state->heap_top += n;
+  claim(state, start, n);
+  return start;
+
+error:
+  return SIZE_MAX;
+}
+
+static size_t find_next(const uint* bitmap, size_t from, size_t limit, bool value) {
+  size_t i = from;
+  while (i < limit) {
+    uint word = bitmap[i / BITS_PER_WORD];
+    if (!value) {
+      word = ~word;
+    }
+    word &= (uint)-1 << (i % BITS_PER_WORD);
+    if (word) {
+      size_t found = (i - (i % BITS_PER_WORD)) + __builtin_ctzll(word);
+      return found < limit ? found : limit;
+    }
+    i = (i - (i % BITS_PER_WORD)) + BITS_PER_WORD;
+  }
+  return limit;
+}
+
+// NOTE: rebuilds free lists from the bitmap, a free block touching the top lowers it instead
+static void rebuild_free_lists(eval_state_t* state) {
+  clear_free_lists(state);
+  size_t i = 0;
+  while (i < state->heap_top) {
+    size_t start = find_next(state->free_bitmap, i, state->heap_top, false);
+    if (start == state->heap_top) {
+      break;
+    }
+    size_t end = find_next(state->free_bitmap, start, state->heap_top, true);
+    if (end == state->heap_top) {
+      state->heap_top = start;
+      break;
+    }
+    put_free_block(state, start, end - start);
+    i = end;
+  }
+}
+
+// NOTE: adopts a saved allocation bitmap. Every allocated run holds whole trees
+// (collections free whole subtrees), so each run is indexed on its own
+sint _heap_restore(eval_state_t* state, const uint* used, size_t top) {
+  sint err = _heap_reserve(state, top);
+  if (err == ERR_VAL) {
+    return err;
+  }
+  memset(state->free_bitmap, 0, state->free_capacity * sizeof(*state->free_bitmap));
+  memcpy(state->free_bitmap, used, BITMAP_SIZE(top) * sizeof(*used));
+  if (top % BITS_PER_WORD) {
+    state->free_bitmap[top / BITS_PER_WORD] &= ((uint)1 << (top % BITS_PER_WORD)) - 1;
+  }
+  state->heap_top = top;
+  state->heap_used = 0;
+  for (size_t w = 0; w < BITMAP_SIZE(top); ++w) {
+    state->heap_used += __builtin_popcountll(state->free_bitmap[w]);
+  }
+  rebuild_free_lists(state);
+
+  state->node_index_valid = true;
+  size_t i = 0;
+  while (i < state->heap_top) {
+    size_t start = find_next(state->free_bitmap, i, state->heap_top, true);
+    size_t end = find_next(state->free_bitmap, start, state->heap_top, false);
+    if (start < end && _heap_index_range(state, start, end) == ERR_VAL) {
+      state->node_index_valid = false;
+    }
+    i = end;
+  }
+  return 0;
+}
+
+sint eval_heap_stats(eval_state_t* state, eval_heap_stats_t* stats) {
+  if (!state || !stats) {
+    return ERR_VAL;
+  }
+  _decoded_store(state);
+  *stats = (eval_heap_stats_t){
+      .capacity = state->free_capacity * BITS_PER_WORD,
+      .top = state->heap_top,
+      .used = state->heap_used,
+      .collections = state->gc_collections,
+      .allocated = state->heap_allocated,
+  };
+  for (size_t len = 1; len < HEAP_RUN_MIN; ++len) {
+    size_t count = stbds_arrlenu(state->heap_classes[len]);
+    stats->free_listed += count * len;
+    if (count > 0 && len > stats->largest_run) {
+      stats->largest_run = len;
+    }
+  }
+  for (size_t i = 0; i < stbds_arrlenu(state->heap_runs); ++i) {
+    size_t len = state->heap_runs[i].len;
+    stats->free_runs += len;
+    if (len > stats->largest_run) {
+      stats->largest_run = len;
+    }
+  }
+  size_t free_cells = stats->free_listed + stats->free_runs;
+  if (free_cells > 0) {
+    stats->fragmentation = 1.0 - ((double)stats->largest_run / (double)free_cells);
+  }
+  return 0;
+}
+
+// ********************** NODE INDEX **********************
+
+static void set_node(eval_state_t* state, size_t index, u8 kind, size_t span) {
+  state->node_index[index] = (uint32_t)(span << NODE_KIND_BITS) | kind;
+}
+
+static u8 tree_kind(eval_state_t* state, size_t root) {
+  size_t lhs = root + 1;
+  size_t rhs = lhs + _eval_node_span(state, lhs);
+  if (_eval_node_kind(state, rhs) != NODE_NIL) {
+    return NODE_FORK;
+  }
+  return _eval_node_kind(state, lhs) == NODE_NIL ? NODE_LEAF : NODE_STEM;
+}
+
+// NOTE: one forward pass, a tree node is recorded once its last child is closed.
+// The range must hold complete nodes only
+sint _heap_index_range(eval_state_t* state, size_t from, size_t to) {
+  sint err = _heap_reserve(state, to);
+  if (err == ERR_VAL) {
+    return err;
+  }
+  stbds_arrsetlen(state->index_stack, 0);
+  _fuse_untag(state, from, to);
+  bool was_valid = state->node_index_valid;
+  // NOTE: `tree_kind` reads back entries written by this pass
+  state->node_index_valid = true;
+
+  size_t cur = from;
+  while (cur < to) {
+    sint cell = eval_cells_get(state->cells, cur);
+    if (cell == ERR_VAL) {
+      goto error;
+    }
+    if (cell == SIGIL_TREE) {
+      stbds_arrput(state->index_stack, ((index_frame_t){.start = cur, .open = 2}));
+      cur++;
+      continue;
+    }
+    if (cell == SIGIL_NIL) {
+      set_node(state, cur, NODE_NIL, 1);
+      cur++;
+    } else {
+      sint left = eval_cells_get(state->cells, cur + 1);
+      sint right = eval_cells_get(state->cells, cur + 2);
+      if (cur + 3 > to || right != SIGIL_NIL || left == ERR_VAL) {
+        goto error;
+      }
+      u8 kind = left == SIGIL_REF ? NODE_NATIVE : left == SIGIL_TREE ? NODE_THUNK : NODE_REF;
+      set_node(state, cur, kind, 3);
+      set_node(state, cur + 1, NODE_NONE, 0);
+      set_node(state, cur + 2, NODE_NONE, 0);
+      cur += 3;
+    }
+
+    while (stbds_arrlenu(state->index_stack) > 0) {
+      index_frame_t* top = &stbds_arrlast(state->index_stack);
+      if (--top->open > 0) {
+        break;
+      }
+      size_t span = cur - top->start;
+      if (span > NODE_SPAN_MAX) {
+        goto error;
+      }
+      set_node(state, top->start, tree_kind(state, top->start), span);
+      stbds_arrpop(state->index_stack);
+    }
+  }
+  if (stbds_arrlenu(state->index_stack) > 0) {
+    goto error;
+  }
+  state->node_index_valid = was_valid;
+  return 0;
+
+error:
+  state->node_index_valid = was_valid;
+  return ERR_VAL;
+}
+
+// ********************** MARK & SWEEP **********************
+
+static bool is_marked(const uint* marks, size_t marks_bits, size_t index) {
+  return index >= marks_bits || _bitmap_get_bit(marks, index);
+}
+
+// NOTE: walks the subtree in prefix order, counting nodes that are still open:
+// a tree cell opens two children, everything else closes one.
+// References, thunks and natives are three-cell terminals, natives aren't followed
+static void mark_subtree(
+    eval_state_t* state, uint* marks, size_t marks_bits, size_t root, size_t** pending) {
+  size_t cur = root;
+  size_t open = 1;
+  while (open > 0 && cur < marks_bits) {
+    sint cell = eval_cells_get(state->cells, cur);
+    if (cell == ERR_VAL) {
+      return;
+    }
+    // NOTE: a marked node start had its whole subtree walked already, stacks often hold
+    // many nodes of one deep inline tree
+    if (cur != root && _bitmap_get_bit(marks, cur)
+        && _eval_kind_is_tree(_eval_node_kind(state, cur))) {
+      cur += _eval_node_span(state, cur);
+      open--;
+      continue;
+    }
+    _bitmap_set_bit(marks, cur, 1);
+    // NOTE: an interned node keeps its canonical node alive
+    size_t canonical = cur;
+    if (cell != SIGIL_NIL && _cells_get_canon(state->cells, cur, &canonical) != ERR_VAL
+        && canonical != cur) {
+      stbds_arrput(*pending, canonical);
+    }
+    if (cell == SIGIL_TREE) {
+      open++;
+      cur++;
+      continue;
+    }
+    if (cell == SIGIL_NIL) {
+      open--;
+      cur++;
+      continue;
+    }
+
+    for (size_t i = 1; i < 3 && cur + i < marks_bits; ++i) {
+      _bitmap_set_bit(marks, cur + i, 1);
+    }
+    sint left = eval_cells_get(state->cells, cur + 1);
+    sint right = eval_cells_get(state->cells, cur + 2);
+    if (_eval_is_ref(cell, left, right) || _eval_is_thunk(cell, left, right)) {
+      sint offset = 0;
+      if (eval_cells_get_word(state->cells, cur, &offset) != ERR_VAL) {
+        stbds_arrput(*pending, cur + offset);
+      }
+    }
+    open--;
+    cur += 3;
+  }
+}
+
+static void mark_stack(const size_t* stack, size_t** pending) {
+  for (size_t i = 0; i < stbds_arrlenu(stack); ++i) {
+    if (!_eval_is_token(stack[i])) {
+      stbds_arrput(*pending, stack[i]);
+    }
+  }
+}
+
+size_t _heap_collect(eval_state_t* state) {
+  size_t marks_bits = state->free_capacity * BITS_PER_WORD;
+  uint* marks = calloc(state->free_capacity, sizeof(*marks));
+  if (!marks) {
+    return 0;
+  }
+
+  size_t* pending = NULL;
+  mark_stack(state->apply_stack, &pending);
+  mark_stack(state->result_stack, &pending);
+  mark_stack(state->lazy_updates, &pending);
+  mark_stack(state->lazy_frontier, &pending);
+  mark_stack(state->fuse_checks, &pending);
+  // NOTE: ids of pending applications must not be reused before they are stored
+  for (size_t i = 0; i < stbds_arrlenu(state->memo_frames); ++i) {
+    stbds_arrput(pending, state->memo_frames[i].f);
+    stbds_arrput(pending, state->memo_frames[i].z);
+  }
+  while (stbds_arrlenu(pending) > 0) {
+    size_t root = stbds_arrpop(pending);
+    // NOTE: a marked node start means its whole subtree was already walked
+    if (is_marked(marks, marks_bits, root)) {
+      continue;
+    }
+    mark_subtree(state, marks, marks_bits, root, &pending);
+  }
+  stbds_arrfree(pending);
+
+  size_t freed = 0;
+  size_t live = 0;
+  for (size_t w = 0; w < BITMAP_SIZE(state->heap_top); ++w) {
+    uint dead = state->free_bitmap[w] & ~marks[w];
+    while (dead) {
+      size_t index = (w * BITS_PER_WORD) + __builtin_ctzll(dead);
+      if (eval_cells_get(state->cells, index) == SIGIL_REF) {
+        eval_cells_drop_word(state->cells, index);
+      }
+      dead &= dead - 1;
+      freed++;
+    }
+    state->free_bitmap[w] &= marks[w];
+    live += __builtin_popcountll(state->free_bitmap[w]);
+  }
+  if (state->cells->interning) {
+    _cells_intern_sweep(state->cells, marks, marks_bits);
+  }
+  if (state->memo_sets) {
+    _memo_sweep(state, marks, marks_bits);
+  }
+  _bytes_sweep(state, marks, marks_bits);
+  free(marks);
+  rebuild_free_lists(state);
+
+  state->heap_used = live;
+  state->gc_collections++;
+  STATS_ADD(state->stats.cells_freed, freed);
+  state->gc_allocated = 0;
+  state->gc_threshold = live > GC_MIN_THRESHOLD ? live : GC_MIN_THRESHOLD;
+  return freed;
+}
+
+sint eval_gc(eval_state_t* state) {
+  if (!state) {
+    return ERR_VAL;
+  }
+  _decoded_store(state);
+  return (sint)_heap_collect(state);
+}
@@ -0,0 +1,33 @@
+#ifndef __EVAL_HEAP__
+#define __EVAL_HEAP__
+
+#include "api.h"
+
+// NOTE: collection is triggered once this many cells were allocated since the last one,
+// or as many as survived it, whichever is bigger
+#define GC_MIN_THRESHOLD (1 << 14)
+
+// NOTE: free blocks shorter than this are only reused for requests of exactly their size,
+// longer ones are carved by next-fit. Rules allocate 5 and 7 cells
+#define HEAP_RUN_MIN 10
+
+typedef struct {
+  size_t start;
+  size_t len;
+} heap_run_t;
+
+typedef struct {
+  size_t start;
+  u8 open;
+} index_frame_t;
+
+sint _heap_reserve(eval_state_t* state, size_t cells_count);
+void _heap_reset(eval_state_t* state);
+void _heap_free(eval_state_t* state);
+sint _heap_mark_loaded(eval_state_t* state, size_t cells_count);
+sint _heap_restore(eval_state_t* state, const uint* used, size_t top);
+size_t _heap_alloc(eval_state_t* state, size_t n);
+size_t _heap_collect(eval_state_t* state);
+sint _heap_index_range(eval_state_t* state, size_t from, size_t to);
+
+#endif
@@ -0,0 +1,207 @@
+#include "api.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "vendor/stb_ds.h"
+
+#include "eval.h"
+#include "heap.h"
+#include "lazy.h"
+#include "memory.h"
+
+// NOTE: a thunk is the three-cell terminal #^*, its word points at a fork of references to
+// the suspended application. Both come from one allocation:
+//   ^ #** #** #^*
+// Updating turns the thunk into #** pointing at the value. References made while it was
+// suspended now land on a reference, so dereferencing follows one more hop in this mode.
+// Values are forced to a tree or a native before the update, chains never get longer
+
+static bool is_kind(
+    eval_state_t* state, size_t index, u8 kind, bool (*tester)(sint root, sint left, sint right)) {
+  if (state->node_index_valid) {
+    return _eval_node_kind(state, index) == kind;
+  }
+  return _eval_cell_test(state, index, tester);
+}
+
+static bool is_thunk(eval_state_t* state, size_t index) {
+  return is_kind(state, index, NODE_THUNK, _eval_is_thunk);
+}
+
+static bool is_nil(eval_state_t* state, size_t index) {
+  return eval_cells_get(state->cells, index) == SIGIL_NIL;
+}
+
+static void force(eval_state_t* state, size_t thunk) {
+  sint word = 0;
+  if (state->verified) {
+    word = _cells_get_word_unchecked(state->cells, thunk);
+  } else {
+    eval_cells_get_word(state->cells, thunk, &word);
+  }
+  size_t application = thunk + word;
+  stbds_arrput(state->lazy_updates, thunk);
+  stbds_arrput(state->apply_stack, TOKEN_UPDATE);
+  stbds_arrput(state->apply_stack, TOKEN_APPLY);
+  stbds_arrput(state->apply_stack, _eval_get_left_node(state, application));
+  stbds_arrput(state->apply_stack, _eval_get_right_node(state, application));
+  state->lazy_forced++;
+}
+
+// NOTE: every thunk reachable from the pending nodes goes to found once, thunks themselves
+// are not entered. seen keeps the nodes already walked
+static void collect(eval_state_t* state, size_t** pending, lazy_seen_t** seen, size_t** found) {
+  while (stbds_arrlenu(*pending) > 0) {
+    size_t node = _eval_dereference(state, stbds_arrpop(*pending));
+    if (is_nil(state, node) || stbds_hmgeti(*seen, node) >= 0) {
+      continue;
+    }
+    stbds_hmput(*seen, node, true);
+    if (is_thunk(state, node)) {
+      stbds_arrput(*found, node);
+      continue;
+    }
+    if (eval_cells_get(state->cells, node) != SIGIL_TREE) {
+      continue;
+    }
+    stbds_arrput(*pending, _eval_get_left_node(state, node));
+    stbds_arrput(*pending, _eval_get_right_node(state, node));
+  }
+}
+
+size_t _lazy_suspend(eval_state_t* state, size_t f, size_t z) {
+  size_t new = _heap_alloc(state, 10);
+  if (new == SIZE_MAX) {
+    return SIZE_MAX;
+  }
+  size_t ref1 = new + 1;
+  size_t ref2 = new + 4;
+  size_t thunk = new + 7;
+  eval_cells_set(state->cells, new + 0, SIGIL_TREE);
+  eval_cells_set(state->cells, ref1, SIGIL_REF);
+  eval_cells_set(state->cells, new + 2, SIGIL_NIL);
+  eval_cells_set(state->cells, new + 3, SIGIL_NIL);
+  eval_cells_set(state->cells, ref2, SIGIL_REF);
+  eval_cells_set(state->cells, new + 5, SIGIL_NIL);
+  eval_cells_set(state->cells, new + 6, SIGIL_NIL);
+  eval_cells_set(state->cells, thunk, SIGIL_REF);
+  eval_cells_set(state->cells, thunk + 1, SIGIL_TREE);
+  eval_cells_set(state->cells, thunk + 2, SIGIL_NIL);
+  eval_cells_set_word(state->cells, ref1, f - ref1);
+  eval_cells_set_word(state->cells, ref2, z - ref2);
+  eval_cells_set_word(state->cells, thunk, new - thunk);
+  _heap_index_range(state, new, new + 10);
+  state->lazy_thunks++;
+  return thunk;
+}
+
+// NOTE: rules look into F, into its left child when it has a right one and into z when that
+// left child is a fork, a thunk is never nil so the other checks don't need a value.
+// Natives read their argument as data, so all of it is forced. A blocked application
+// is put back under the forcing work and retried
+bool _lazy_blocked(eval_state_t* state, size_t F, size_t z) {
+  size_t thunk = SIZE_MAX;
+  size_t* found = NULL;
+  if (is_thunk(state, F)) {
+    thunk = F;
+  } else if (is_kind(state, F, NODE_NATIVE, _eval_is_native)) {
+    size_t* pending = NULL;
+    lazy_seen_t* seen = NULL;
+    stbds_arrput(pending, z);
+    collect(state, &pending, &seen, &found);
+    stbds_arrfree(pending);
+    stbds_hmfree(seen);
+  } else {
+    size_t A = _eval_get_left_node(state, F);
+    size_t y = _eval_get_right_node(state, F);
+    if (!is_nil(state, A) && !is_nil(state, y)) {
+      if (is_thunk(state, A)) {
+        thunk = A;
+      } else if (
+          !is_nil(state, _eval_get_left_node(state, A))
+          && !is_nil(state, _eval_get_right_node(state, A)) && is_thunk(state, z)) {
+        thunk = z;
+      }
+    }
+  }
+  if (thunk == SIZE_MAX && stbds_arrlenu(found) == 0) {
+    stbds_arrfree(found);
+    return false;
+  }
+
+  stbds_arrput(state->apply_stack, TOKEN_APPLY);
+  stbds_arrput(state->apply_stack, F);
+  stbds_arrput(state->apply_stack, z);
+  if (thunk != SIZE_MAX) {
+    force(state, thunk);
+  }
+  for (size_t i = 0; i < stbds_arrlenu(found); ++i) {
+    force(state, found[i]);
+  }
+  stbds_arrfree(found);
+  return true;
+}
+
+bool _lazy_update(eval_state_t* state) {
+  if (stbds_arrlenu(state->lazy_updates) == 0 || stbds_arrlenu(state->result_stack) == 0) {
+    return false;
+  }
+  size_t thunk = stbds_arrlast(state->lazy_updates);
+  size_t value = stbds_arrpop(state->result_stack);
+  // NOTE: a value that is suspended itself is forced first, its update runs above this one
+  if (is_thunk(state, value)) {
+    stbds_arrput(state->apply_stack, TOKEN_UPDATE);
+    stbds_arrput(state->apply_stack, value);
+    force(state, value);
+    return true;
+  }
+  stbds_arrpop(state->lazy_updates);
+  if (!is_thunk(state, thunk)) {
+    return true;
+  }
+  eval_cells_set(state->cells, thunk + 1, SIGIL_NIL);
+  eval_cells_set_word(state->cells, thunk, value - thunk);
+  _heap_index_range(state, thunk, thunk + 3);
+  return true;
+}
+
+// NOTE: a lazy run ends with thunks left in its results, they are forced a layer per round
+// until the results are normal forms. A round walks only the values of the thunks forced
+// in the previous one, everything else was seen already
+bool _lazy_force_result(eval_state_t* state) {
+  if (!state->lazy_forcing) {
+    state->lazy_forcing = true;
+    stbds_arrsetlen(state->lazy_frontier, 0);
+    for (size_t i = 0; i < stbds_arrlenu(state->result_stack); ++i) {
+      stbds_arrput(state->lazy_frontier, state->result_stack[i]);
+    }
+  }
+  size_t* found = NULL;
+  collect(state, &state->lazy_frontier, &state->lazy_seen, &found);
+  stbds_arrfree(state->lazy_frontier);
+  state->lazy_frontier = found;
+  if (stbds_arrlenu(found) == 0) {
+    for (size_t i = 0; i < stbds_arrlenu(state->result_stack); ++i) {
+      state->result_stack[i] = _eval_dereference(state, state->result_stack[i]);
+    }
+    _lazy_clear(state);
+    return false;
+  }
+  for (size_t i = 0; i < stbds_arrlenu(found); ++i) {
+    force(state, found[i]);
+  }
+  return true;
+}
+
+void _lazy_clear(eval_state_t* state) {
+  stbds_arrsetlen(state->lazy_updates, 0);
+  stbds_arrsetlen(state->lazy_frontier, 0);
+  stbds_hmfree(state->lazy_seen);
+  state->lazy_forcing = false;
+}
+
+void _lazy_free(eval_state_t* state) {
+  _lazy_clear(state);
+  stbds_arrfree(state->lazy_updates);
+  stbds_arrfree(state->lazy_frontier);
+}
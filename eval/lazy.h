@@ -0,0 +1,24 @@
+#ifndef __EVAL_LAZY__
+#define __EVAL_LAZY__
+
+#include "api.h"
+#include <stdbool.h>
+
+// NOTE: opt-in call-by-need, see lazy.c. Rule 2 suspends (y z) in a thunk instead of
+// reducing it. An application that has to look into a thunk is put back and the thunk is
+// forced first, popping the TOKEN_UPDATE under the forcing work overwrites the thunk with
+// a reference to its value, so every other use shares it
+
+typedef struct {
+  size_t key;
+  bool value;
+} lazy_seen_t;
+
+size_t _lazy_suspend(eval_state_t* state, size_t f, size_t z);
+bool _lazy_blocked(eval_state_t* state, size_t F, size_t z);
+bool _lazy_update(eval_state_t* state);
+bool _lazy_force_result(eval_state_t* state);
+void _lazy_clear(eval_state_t* state);
+void _lazy_free(eval_state_t* state);
+
+#endif
@@ -0,0 +1,111 @@
+#include "api.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "vendor/stb_ds.h"
+
+#include "eval.h"
+#include "memo.h"
+#include "util.h"
+
+static size_t set_of(eval_state_t* state, size_t f, size_t z) {
+  uint h = (f * 0x9E3779B97F4A7C15ULL) ^ (z * 0xC2B2AE3D27D4EB4FULL);
+  h ^= h >> 29;
+  return h & (state->memo_sets - 1);
+}
+
+sint _memo_resize(eval_state_t* state, size_t capacity) {
+  _memo_free(state);
+  if (capacity == 0) {
+    return 0;
+  }
+  size_t sets = 1;
+  while (sets * MEMO_WAYS < capacity) {
+    sets *= 2;
+  }
+  state->memo_entries = malloc(sets * MEMO_WAYS * sizeof(*state->memo_entries));
+  state->memo_hands = calloc(sets, sizeof(*state->memo_hands));
+  if (!state->memo_entries || !state->memo_hands) {
+    _memo_free(state);
+    return ERR_VAL;
+  }
+  state->memo_sets = sets;
+  _memo_clear(state);
+  return 0;
+}
+
+void _memo_clear(eval_state_t* state) {
+  for (size_t i = 0; i < state->memo_sets * MEMO_WAYS; ++i) {
+    state->memo_entries[i].result = MEMO_EMPTY;
+    state->memo_entries[i].referenced = false;
+  }
+  stbds_arrsetlen(state->memo_frames, 0);
+}
+
+void _memo_free(eval_state_t* state) {
+  free(state->memo_entries);
+  free(state->memo_hands);
+  state->memo_entries = NULL;
+  state->memo_hands = NULL;
+  state->memo_sets = 0;
+  stbds_arrsetlen(state->memo_frames, 0);
+}
+
+bool _memo_find(eval_state_t* state, size_t f, size_t z, size_t* result) {
+  state->memo_lookups++;
+  memo_entry_t* set = state->memo_entries + set_of(state, f, z) * MEMO_WAYS;
+  for (size_t i = 0; i < MEMO_WAYS; ++i) {
+    if (set[i].result != MEMO_EMPTY && set[i].f == f && set[i].z == z) {
+      set[i].referenced = true;
+      state->memo_hits++;
+      *result = set[i].result;
+      return true;
+    }
+  }
+  return false;
+}
+
+void _memo_add(eval_state_t* state, size_t f, size_t z, size_t result) {
+  size_t set_index = set_of(state, f, z);
+  memo_entry_t* set = state->memo_entries + set_index * MEMO_WAYS;
+  size_t victim = MEMO_WAYS;
+  for (size_t i = 0; i < MEMO_WAYS; ++i) {
+    if (set[i].result == MEMO_EMPTY || (set[i].f == f && set[i].z == z)) {
+      victim = i;
+      break;
+    }
+  }
+  if (victim == MEMO_WAYS) {
+    u8* hand = &state->memo_hands[set_index];
+    while (set[*hand].referenced) {
+      set[*hand].referenced = false;
+      *hand = (*hand + 1) % MEMO_WAYS;
+    }
+    victim = *hand;
+    *hand = (*hand + 1) % MEMO_WAYS;
+    state->memo_evictions++;
+  }
+  set[victim] = (memo_entry_t){.f = f, .z = z, .result = result, .referenced = false};
+}
+
+static bool is_live(const uint* live, size_t live_bits, size_t index) {
+  return index < live_bits && _bitmap_get_bit(live, index);
+}
+
+// NOTE: entries are weak, the collector forgets those mentioning a dead node
+size_t _memo_sweep(eval_state_t* state, const uint* live, size_t live_bits) {
+  size_t dropped = 0;
+  for (size_t i = 0; i < state->memo_sets * MEMO_WAYS; ++i) {
+    memo_entry_t* e = &state->memo_entries[i];
+    if (e->result == MEMO_EMPTY) {
+      continue;
+    }
+    if (!is_live(live, live_bits, e->f) || !is_live(live, live_bits, e->z)
+        || !is_live(live, live_bits, e->result)) {
+      e->result = MEMO_EMPTY;
+      e->referenced = false;
+      dropped++;
+    }
+  }
+  return dropped;
+}
@@ -0,0 +1,34 @@
+#ifndef __EVAL_MEMO__
+#define __EVAL_MEMO__
+
+#include "api.h"
+#include <stdbool.h>
+
+// NOTE: the cache is split into sets of this many entries, each set is replaced by clock
+#define MEMO_WAYS 4
+
+#define MEMO_EMPTY SIZE_MAX
+
+typedef struct {
+  size_t f; // canonical ids of the application
+  size_t z;
+  size_t result; // normal form, MEMO_EMPTY for a vacant entry
+  bool referenced;
+} memo_entry_t;
+
+// NOTE: an application being reduced, completed when its TOKEN_MEMO is popped.
+// Results of reductions that called natives are not stored, natives may have effects
+typedef struct {
+  size_t f;
+  size_t z;
+  size_t native_calls;
+} memo_frame_t;
+
+sint _memo_resize(eval_state_t* state, size_t capacity);
+void _memo_clear(eval_state_t* state);
+void _memo_free(eval_state_t* state);
+bool _memo_find(eval_state_t* state, size_t f, size_t z, size_t* result);
+void _memo_add(eval_state_t* state, size_t f, size_t z, size_t result);
+size_t _memo_sweep(eval_state_t* state, const uint* live, size_t live_bits);
+
+#endif
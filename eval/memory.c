@@ -1,15 +1,18 @@
 
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "vendor/stb_ds.h"
 
+#include "eval.h"
 #include "memory.h"
 
-#define CELLS_BITMAP_SIZE(cap) BITMAP_SIZE(cap* CELLS_PER_WORD)
+#define WORDS_BITMAP_SIZE(cap) BITMAP_SIZE(cap* CELLS_PER_WORD)
 
 uint* _bitmap_init(size_t capacity) {
   return calloc(1, BITMAP_SIZE(capacity) * sizeof(uint));
@@ -53,88 +56,168 @@ sint eval_cells_init(allocator_t** alloc, size_t words_count) {
   if (!cells) {
     return ERR_VAL;
   }
-  cells->cells = calloc(1, words_count * sizeof(*cells->cells));
+  cells->cells = malloc(words_count * sizeof(*cells->cells));
   cells->cells_capacity = words_count;
   if (!cells->cells) {
     return ERR_VAL;
   }
+  memset(cells->cells, CELLS_UNSET_BYTE, words_count * sizeof(*cells->cells));
 
-  cells->cells_bitmap =
-      calloc(1, CELLS_BITMAP_SIZE(cells->cells_capacity) * sizeof(*cells->cells_bitmap));
-  if (!cells->cells_bitmap) {
+  cells->words_bitmap =
+      calloc(1, WORDS_BITMAP_SIZE(cells->cells_capacity) * sizeof(*cells->words_bitmap));
+  if (!cells->words_bitmap) {
+    return ERR_VAL;
+  }
+  cells->payload_blocks =
+      calloc(1, PAYLOAD_BLOCKS(cells->cells_capacity) * sizeof(*cells->payload_blocks));
+  if (!cells->payload_blocks) {
     return ERR_VAL;
   }
-  stbds_arrsetcap(cells->payloads, 32);
 
   *alloc = cells;
   return 0;
 }
 
+// NOTE: cells may live in a private file mapping (see snapshot.c), released as a whole
+static void release_cells(allocator_t* cells) {
+  if (cells->mapping) {
+    munmap(cells->mapping, cells->mapping_len);
+    cells->mapping = NULL;
+    cells->mapping_len = 0;
+  } else {
+    free(cells->cells);
+  }
+  cells->cells = NULL;
+}
+
+static uint* resize_cells(allocator_t* cells, size_t words_count) {
+  if (!cells->mapping) {
+    return realloc(cells->cells, words_count * sizeof(*cells->cells));
+  }
+  uint* words = malloc(words_count * sizeof(*words));
+  if (!words) {
+    return NULL;
+  }
+  size_t kept = words_count < cells->cells_capacity ? words_count : cells->cells_capacity;
+  memcpy(words, cells->cells, kept * sizeof(*words));
+  release_cells(cells);
+  return words;
+}
+
 sint eval_cells_free(allocator_t** alloc) {
   allocator_t* cells = *alloc;
-  free(cells->cells);
-  free(cells->cells_bitmap);
-  stbds_hmfree(cells->payload_index);
-  stbds_arrfree(cells->payloads);
+  release_cells(cells);
+  free(cells->words_bitmap);
+  for (size_t i = 0; i < PAYLOAD_BLOCKS(cells->cells_capacity); ++i) {
+    stbds_arrfree(cells->payload_blocks[i]);
+  }
+  free(cells->payload_blocks);
+  stbds_hmfree(cells->intern_table);
+  free(cells->canon);
   free(cells);
   *alloc = NULL;
   return 0;
 }
 
 sint eval_cells_get(allocator_t* cells, size_t index) {
-  if (!index_valid(index, cells->cells_capacity) || !_bitmap_get_bit(cells->cells_bitmap, index)) {
+  if (!index_valid(index, cells->cells_capacity)) {
     return ERR_VAL;
   }
-  return get_cell_val(cells, index);
+  u8 cell = get_cell_val(cells, index);
+  return cell == CELL_UNSET ? ERR_VAL : cell;
 }
 
 sint eval_cells_get_word(allocator_t* cells, size_t index, sint* word) {
-  if (!index_valid(index, cells->cells_capacity) || !_bitmap_get_bit(cells->cells_bitmap, index)) {
+  if (!index_valid(index, cells->cells_capacity) || !_bitmap_get_bit(cells->words_bitmap, index)) {
     return ERR_VAL;
   }
-  int64_t pair_idx = stbds_hmgeti(cells->payload_index, index);
-  if (pair_idx == -1) {
+  *word = cells->payload_blocks[index / PAYLOAD_BLOCK_CELLS][_cells_payload_rank(cells, index)];
+  return 0;
+}
+
+static sint grow_cells(allocator_t* cells, size_t words_count) {
+  size_t old_capacity = cells->cells_capacity;
+  size_t new_capacity = old_capacity ? old_capacity : 1;
+  while (new_capacity < words_count) {
+    new_capacity *= 2;
+  }
+  size_t old_bitmap_size = WORDS_BITMAP_SIZE(old_capacity);
+  cells->cells = resize_cells(cells, new_capacity);
+  if (!cells->cells) {
+    return ERR_VAL;
+  }
+  cells->cells_capacity = new_capacity;
+  size_t new_bitmap_size = WORDS_BITMAP_SIZE(cells->cells_capacity);
+  memset(
+      cells->cells + old_capacity,
+      CELLS_UNSET_BYTE,
+      (cells->cells_capacity - old_capacity) * sizeof(*cells->cells));
+  cells->words_bitmap =
+      realloc(cells->words_bitmap, new_bitmap_size * sizeof(*cells->words_bitmap));
+  if (!cells->words_bitmap) {
+    return ERR_VAL;
+  }
+  memset(
+      cells->words_bitmap + old_bitmap_size,
+      0,
+      (new_bitmap_size - old_bitmap_size) * sizeof(*cells->words_bitmap));
+  size_t old_blocks = PAYLOAD_BLOCKS(old_capacity);
+  size_t new_blocks = PAYLOAD_BLOCKS(cells->cells_capacity);
+  cells->payload_blocks =
+      realloc(cells->payload_blocks, new_blocks * sizeof(*cells->payload_blocks));
+  if (!cells->payload_blocks) {
     return ERR_VAL;
   }
-  size_t payload_idx = cells->payload_index[pair_idx].value;
-  *word = cells->payloads[payload_idx];
+  memset(
+      cells->payload_blocks + old_blocks,
+      0,
+      (new_blocks - old_blocks) * sizeof(*cells->payload_blocks));
   return 0;
 }
 
 sint eval_cells_set(allocator_t* cells, size_t index, u8 value) {
-  if (!index_valid(index, cells->cells_capacity)) {
-    cells->cells_capacity *= 2;
-    cells->cells = realloc(cells->cells, cells->cells_capacity * sizeof(*cells->cells));
-    if (!cells->cells) {
-      return ERR_VAL;
-    }
-    cells->cells_bitmap = realloc(
-        cells->cells_bitmap,
-        CELLS_BITMAP_SIZE(cells->cells_capacity) * sizeof(*cells->cells_bitmap));
-    if (!cells->cells_bitmap) {
-      return ERR_VAL;
-    }
-    return eval_cells_set(cells, index, value);
+  if (!index_valid(index, cells->cells_capacity)
+      && grow_cells(cells, index / CELLS_PER_WORD + 1) == ERR_VAL) {
+    return ERR_VAL;
+  }
+  if (value >= CELL_UNSET) {
+    return ERR_VAL;
   }
   set_cell_val(cells, index, value);
-  _bitmap_set_bit(cells->cells_bitmap, index, 1);
+  return 0;
+}
+
+// NOTE: stores a whole packed word of cells, for loaders that pack cells themselves
+sint _cells_set_packed(allocator_t* cells, size_t word_index, uint word) {
+  if (word_index >= cells->cells_capacity && grow_cells(cells, word_index + 1) == ERR_VAL) {
+    return ERR_VAL;
+  }
+  cells->cells[word_index] = word;
   return 0;
 }
 
 sint eval_cells_set_word(allocator_t* cells, size_t index, sint value) {
-  if (!index_valid(index, cells->cells_capacity) || !_bitmap_get_bit(cells->cells_bitmap, index)) {
+  if (eval_cells_get(cells, index) == ERR_VAL) {
     return ERR_VAL;
   }
-  int64_t pair_idx = stbds_hmgeti(cells->payload_index, index);
-  if (pair_idx != -1) {
-    size_t word_idx = cells->payload_index[pair_idx].value;
-    cells->payloads[word_idx] = value;
+  sint** block = &cells->payload_blocks[index / PAYLOAD_BLOCK_CELLS];
+  size_t rank = _cells_payload_rank(cells, index);
+  if (_bitmap_get_bit(cells->words_bitmap, index)) {
+    (*block)[rank] = value;
     return 0;
   }
+  stbds_arrins(*block, rank, value);
+  _bitmap_set_bit(cells->words_bitmap, index, 1);
+  return 0;
+}
 
-  size_t word_idx = stbds_arrlenu(cells->payloads);
-  stbds_arrput(cells->payloads, value);
-  stbds_hmput(cells->payload_index, index, word_idx);
+sint eval_cells_drop_word(allocator_t* cells, size_t index) {
+  if (!index_valid(index, cells->cells_capacity) || !_bitmap_get_bit(cells->words_bitmap, index)) {
+    return ERR_VAL;
+  }
+  size_t rank = _cells_payload_rank(cells, index);
+  stbds_arrdel(cells->payload_blocks[index / PAYLOAD_BLOCK_CELLS], rank);
+  _bitmap_set_bit(cells->words_bitmap, index, 0);
   return 0;
 }
 
@@ -153,18 +236,213 @@ sint eval_cells_reset(allocator_t* cells) {
   if (!cells->cells) {
     return ERR_VAL;
   }
-  memset(cells->cells, 0, cells->cells_capacity * sizeof(*cells->cells));
-  if (!cells->cells_bitmap) {
-    return ERR_VAL;
-  }
+  memset(cells->cells, CELLS_UNSET_BYTE, cells->cells_capacity * sizeof(*cells->cells));
   memset(
-      cells->cells_bitmap,
+      cells->words_bitmap,
       0,
-      CELLS_BITMAP_SIZE(cells->cells_capacity) * sizeof(*cells->cells_bitmap));
-  for (size_t i = 0; i < stbds_hmlenu(cells->payload_index); ++i) {
-    int res = stbds_hmdel(cells->payload_index, cells->payload_index[i].key);
-    assert(res == 1);
+      WORDS_BITMAP_SIZE(cells->cells_capacity) * sizeof(*cells->words_bitmap));
+  for (size_t i = 0; i < PAYLOAD_BLOCKS(cells->cells_capacity); ++i) {
+    stbds_arrsetlen(cells->payload_blocks[i], 0);
+  }
+  _cells_intern_clear(cells);
+  return 0;
+}
+
+// NOTE: Subtree end search as an excess scan over the prefix encoding.
+// Every cell opens (+1) or closes (-1) one pending node:
+// ^ opens, * closes, # opens unless the previous cell is #
+// (the second # of a native ##* and the tail of #** are closing cells).
+// The node rooted at index ends at the first cell where the excess drops to zero.
+// end receives the index one past the last cell of the subtree
+
+#define EVEN_BITS 0x5555555555555555ULL
+
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+static inline uint32_t compact_even_bits(uint x) {
+#if defined(__BMI2__)
+  return (uint32_t)_pext_u64(x, EVEN_BITS);
+#else
+  x &= EVEN_BITS;
+  x = (x | (x >> 1)) & 0x3333333333333333ULL;
+  x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+  x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+  x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+  x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+  return (uint32_t)x;
+#endif
+}
+
+sint eval_cells_subtree_end(allocator_t* cells, size_t index, size_t* end) {
+  sint excess = 1;
+  size_t first = index % CELLS_PER_WORD;
+  // the root always opens, whatever precedes it
+  uint prev_ref = 0;
+  uint root_ref = 1ULL << (first * BITS_PER_CELL);
+  for (size_t w = index / CELLS_PER_WORD; w < cells->cells_capacity; w++, first = 0) {
+    uint word = cells->cells[w];
+    uint lo = word & EVEN_BITS;
+    uint hi = (word >> 1) & EVEN_BITS;
+    uint refs = ((hi << BITS_PER_CELL) | prev_ref) & ~root_ref;
+    uint32_t opens = compact_even_bits((lo | hi) & ~refs);
+    uint32_t set = ~compact_even_bits(lo & hi);
+    prev_ref = hi >> (BITS_PER_WORD - BITS_PER_CELL);
+    root_ref = 0;
+
+    uint32_t taken = UINT32_MAX << first;
+    size_t count = CELLS_PER_WORD - first;
+    // the excess moves by one per cell, so a whole word can be skipped
+    if ((sint)count < excess) {
+      if ((set & taken) != taken) {
+        return ERR_VAL;
+      }
+      excess += 2 * __builtin_popcount(opens & taken) - (sint)count;
+      continue;
+    }
+
+    for (size_t c = first; c < CELLS_PER_WORD;) {
+      size_t chunk = 8 - c % 8;
+      uint32_t chunk_mask = ((1U << chunk) - 1) << c;
+      if ((sint)chunk < excess && (set & chunk_mask) == chunk_mask) {
+        excess += 2 * __builtin_popcount(opens & chunk_mask) - (sint)chunk;
+        c += chunk;
+        continue;
+      }
+      for (size_t stop = c + chunk; c < stop; c++) {
+        if (!((set >> c) & 1)) {
+          return ERR_VAL;
+        }
+        excess += ((opens >> c) & 1) ? 1 : -1;
+        if (excess == 0) {
+          *end = w * CELLS_PER_WORD + c + 1;
+          return 0;
+        }
+      }
+    }
+  }
+  return ERR_VAL;
+}
+
+sint eval_cells_subtree_end_scalar(allocator_t* cells, size_t index, size_t* end) {
+  sint excess = 1;
+  sint prev = SIGIL_NIL;
+  for (size_t i = index; index_valid(i, cells->cells_capacity); i++) {
+    u8 cell = get_cell_val(cells, i);
+    if (cell == CELL_UNSET) {
+      return ERR_VAL;
+    }
+    // NOTE: the cell after a reference cell is part of a terminal (#**, ##* or #^*)
+    bool opens = cell != SIGIL_NIL && (i == index || prev != SIGIL_REF);
+    excess += opens ? 1 : -1;
+    if (excess == 0) {
+      *end = i + 1;
+      return 0;
+    }
+    prev = cell;
+  }
+  return ERR_VAL;
+}
+
+// NOTE: takes over words_count (at least one) packed cell words, resizing the side tables
+// to match. With a mapping the words live inside it and are never freed on their own
+sint _cells_adopt(
+    allocator_t* cells, uint* words, size_t words_count, void* mapping, size_t mapping_len) {
+  uint* words_bitmap = calloc(WORDS_BITMAP_SIZE(words_count), sizeof(*words_bitmap));
+  sint** blocks = calloc(PAYLOAD_BLOCKS(words_count), sizeof(*blocks));
+  if (!words_bitmap || !blocks) {
+    free(words_bitmap);
+    free(blocks);
+    return ERR_VAL;
+  }
+  for (size_t i = 0; i < PAYLOAD_BLOCKS(cells->cells_capacity); ++i) {
+    stbds_arrfree(cells->payload_blocks[i]);
+  }
+  free(cells->payload_blocks);
+  free(cells->words_bitmap);
+  release_cells(cells);
+
+  cells->cells = words;
+  cells->cells_capacity = words_count;
+  cells->words_bitmap = words_bitmap;
+  cells->payload_blocks = blocks;
+  cells->mapping = mapping;
+  cells->mapping_len = mapping_len;
+  _cells_intern_clear(cells);
+  return 0;
+}
+
+// ********************** INTERNING **********************
+
+sint _cells_intern_find(allocator_t* cells, intern_key_t key, size_t* canonical) {
+  cells->intern_lookups++;
+  sint entry = stbds_hmgeti(cells->intern_table, key);
+  if (entry == -1) {
+    return ERR_VAL;
   }
-  memset(cells->payloads, 0, stbds_arrlenu(cells->payloads) * sizeof(*cells->payloads));
+  cells->intern_hits++;
+  *canonical = cells->intern_table[entry].value;
   return 0;
 }
+
+sint _cells_intern_add(allocator_t* cells, intern_key_t key, size_t canonical) {
+  stbds_hmput(cells->intern_table, key, canonical);
+  return _cells_set_canon(cells, canonical, canonical);
+}
+
+sint _cells_get_canon(allocator_t* cells, size_t index, size_t* canonical) {
+  if (index >= cells->canon_capacity || cells->canon[index] == 0) {
+    return ERR_VAL;
+  }
+  *canonical = cells->canon[index] - 1;
+  return 0;
+}
+
+sint _cells_set_canon(allocator_t* cells, size_t index, size_t canonical) {
+  if (index >= cells->canon_capacity) {
+    size_t capacity = cells->canon_capacity ? cells->canon_capacity : CELLS_PER_WORD;
+    while (capacity <= index) {
+      capacity *= 2;
+    }
+    size_t* canon = realloc(cells->canon, capacity * sizeof(*canon));
+    if (!canon) {
+      return ERR_VAL;
+    }
+    memset(canon + cells->canon_capacity, 0, (capacity - cells->canon_capacity) * sizeof(*canon));
+    cells->canon = canon;
+    cells->canon_capacity = capacity;
+  }
+  cells->canon[index] = canonical + 1;
+  return 0;
+}
+
+// NOTE: forgets canonical ids of dead cells and entries whose canonical node died.
+// The collector keeps canonical nodes of live cells alive, so keys of the remaining
+// entries never mention a reusable index
+size_t _cells_intern_sweep(allocator_t* cells, const uint* live, size_t live_bits) {
+  for (size_t i = 0; i < cells->canon_capacity; ++i) {
+    if (cells->canon[i] != 0 && (i >= live_bits || !_bitmap_get_bit(live, i))) {
+      cells->canon[i] = 0;
+    }
+  }
+  size_t dropped = 0;
+  // NOTE: deletion moves the last entry into the hole, so walk backwards
+  for (sint i = (sint)stbds_hmlen(cells->intern_table) - 1; i >= 0; --i) {
+    size_t value = cells->intern_table[i].value;
+    if (value >= live_bits || !_bitmap_get_bit(live, value)) {
+      stbds_hmdel(cells->intern_table, cells->intern_table[i].key);
+      dropped++;
+    }
+  }
+  return dropped;
+}
+
+void _cells_intern_clear(allocator_t* cells) {
+  stbds_hmfree(cells->intern_table);
+  if (cells->canon) {
+    memset(cells->canon, 0, cells->canon_capacity * sizeof(*cells->canon));
+  }
+  cells->intern_lookups = 0;
+  cells->intern_hits = 0;
+}
@@ -2,27 +2,94 @@
 #define __EVAL_MEMORY__
 
 #include "api.h"
+#include <stdbool.h>
+
+#include "stats.h"
 
 #define BITS_PER_CELL    2
 #define CELLS_PER_WORD   (BITS_PER_WORD / BITS_PER_CELL)
 #define BITS_PER_WORD    (sizeof(uint) * 8)
 #define BITMAP_SIZE(cap) (((cap) + BITS_PER_WORD - 1) / BITS_PER_WORD)
 
+// NOTE: only three sigils exist, the fourth cell value marks a cell that was never set
+#define CELL_UNSET       3
+#define CELLS_UNSET_BYTE 0xFF
+
+// NOTE: payload words of a block of cells are kept densely in cell order,
+// a word is found by the rank of its cell among the cells of the block that have one
+#define PAYLOAD_BLOCK_CELLS 512
+#define PAYLOAD_BLOCK_WORDS (PAYLOAD_BLOCK_CELLS / BITS_PER_WORD)
+#define PAYLOAD_BLOCKS(cap)                                                                        \
+  (((cap) * CELLS_PER_WORD + PAYLOAD_BLOCK_CELLS - 1) / PAYLOAD_BLOCK_CELLS)
+
+// NOTE: hash-consing key, children are canonical ids (CANON_NIL for a nil child),
+// natives are keyed by their word
 typedef struct {
-  size_t key;
+  size_t kind;
+  size_t left;
+  size_t right;
+} intern_key_t;
+
+typedef struct {
+  intern_key_t key;
   size_t value;
-} cell_word_t;
+} intern_entry_t;
+
+#define CANON_NIL SIZE_MAX
 
 struct allocator_t {
   uint* cells;
-  uint* cells_bitmap;
+  void* mapping;
+  size_t mapping_len;
   size_t cells_capacity;
 
-  cell_word_t* payload_index;
+  uint* words_bitmap;
+  sint** payload_blocks;
 
-  sint* payloads;
+  // NOTE: optional interning, structurally equal nodes resolve to one canonical index.
+  // canon is per cell, canonical index + 1 or 0 when not known yet
+  bool interning;
+  intern_entry_t* intern_table;
+  size_t* canon;
+  size_t canon_capacity;
+  size_t intern_lookups;
+  size_t intern_hits;
+  size_t payload_lookups;
 };
 
+// NOTE: position of the word of cell index in the dense array of its block
+static inline size_t _cells_payload_rank(allocator_t* cells, size_t index) {
+  STATS_ADD(cells->payload_lookups, 1);
+  size_t first = index / PAYLOAD_BLOCK_CELLS * PAYLOAD_BLOCK_WORDS;
+  size_t last = index / BITS_PER_WORD;
+  size_t rank = 0;
+  for (size_t w = first; w < last; ++w) {
+    rank += __builtin_popcountll(cells->words_bitmap[w]);
+  }
+  uint below = (1ULL << (index % BITS_PER_WORD)) - 1;
+  return rank + __builtin_popcountll(cells->words_bitmap[last] & below);
+}
+
+// NOTE: accessors without bounds, unset or has-word checks, for verified heaps only
+static inline u8 _cells_get_unchecked(const allocator_t* cells, size_t index) {
+  size_t shift = (index % CELLS_PER_WORD) * BITS_PER_CELL;
+  return (cells->cells[index / CELLS_PER_WORD] >> shift) & 0x3;
+}
+
+static inline sint _cells_get_word_unchecked(allocator_t* cells, size_t index) {
+  return cells->payload_blocks[index / PAYLOAD_BLOCK_CELLS][_cells_payload_rank(cells, index)];
+}
+
+sint _cells_adopt(
+    allocator_t* cells, uint* words, size_t words_count, void* mapping, size_t mapping_len);
+sint _cells_set_packed(allocator_t* cells, size_t word_index, uint word);
+sint _cells_intern_find(allocator_t* cells, intern_key_t key, size_t* canonical);
+sint _cells_intern_add(allocator_t* cells, intern_key_t key, size_t canonical);
+sint _cells_get_canon(allocator_t* cells, size_t index, size_t* canonical);
+sint _cells_set_canon(allocator_t* cells, size_t index, size_t canonical);
+size_t _cells_intern_sweep(allocator_t* cells, const uint* live, size_t live_bits);
+void _cells_intern_clear(allocator_t* cells);
+
 static inline u8 _tv_get_tag(uint tagged_value) {
   return (u8)(tagged_value & 0xF);
 }
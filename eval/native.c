@@ -1,21 +1,74 @@
 #include "api.h"
-#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "bytes.h"
 #include "eval.h"
+#include "heap.h"
 #include "native.h"
+#include "output.h"
 #include "util.h"
 
+#define INT_ADD 0
+#define INT_SUB 1
+#define INT_MUL 2
+#define INT_AND 3
+#define INT_OR  4
+#define INT_XOR 5
+#define INT_SHL 6
+#define INT_SHR 7
+
 sint native_load_standard(eval_state_t* state) {
   sint err = 0;
   // ^ T [integer]
-  err = eval_add_native(state, "type.integer", NATIVE_TYPE_INTEGER);
+  err = _eval_add_tag(state, "type.integer", NATIVE_TYPE_INTEGER);
   CHECK_ERROR({})
   // ^ T [ref] -> ^ a ^ b ... ^ z *
-  err = eval_add_native(state, "type.list", NATIVE_TYPE_LIST);
+  err = _eval_add_tag(state, "type.list", NATIVE_TYPE_LIST);
+  CHECK_ERROR({})
+  // ^ T [id], see bytes.h
+  err = _eval_add_tag(state, "type.bytes", NATIVE_TYPE_BYTES);
   CHECK_ERROR({})
 
   err = eval_add_native(state, "io.print", (uint)_native_io_print);
   CHECK_ERROR({})
+
+  // NOTE: see native.h for the semantics
+  err = eval_add_native(state, "bytes.from_list", (uint)_native_bytes_from_list);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "bytes.to_list", (uint)_native_bytes_to_list);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "bytes.concat", (uint)_native_bytes_concat);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "bytes.length", (uint)_native_bytes_length);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "int.add", (uint)_native_int_add);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "int.sub", (uint)_native_int_sub);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "int.mul", (uint)_native_int_mul);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "int.divmod", (uint)_native_int_divmod);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "int.compare", (uint)_native_int_compare);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "int.and", (uint)_native_int_and);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "int.or", (uint)_native_int_or);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "int.xor", (uint)_native_int_xor);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "int.not", (uint)_native_int_not);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "int.shl", (uint)_native_int_shl);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "int.shr", (uint)_native_int_shr);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "int.from_tree", (uint)_native_int_from_tree);
+  CHECK_ERROR({})
+  err = eval_add_native(state, "int.to_tree", (uint)_native_int_to_tree);
+  CHECK_ERROR({})
 error:
   return err;
 }
@@ -52,12 +105,49 @@ error:
   return -1;
 }
 
+bool _native_is_pure(uint word) {
+  static const native_function_t PURE[] = {
+      _native_int_add,
+      _native_int_sub,
+      _native_int_mul,
+      _native_int_divmod,
+      _native_int_compare,
+      _native_int_and,
+      _native_int_or,
+      _native_int_xor,
+      _native_int_not,
+      _native_int_shl,
+      _native_int_shr,
+      _native_int_from_tree,
+      _native_int_to_tree,
+  };
+  if (word == NATIVE_TYPE_INTEGER || word == NATIVE_TYPE_LIST) {
+    return true;
+  }
+  for (size_t i = 0; i < sizeof(PURE) / sizeof(*PURE); ++i) {
+    if (word == (uint)PURE[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// NOTE: integers are written as one byte each, lists element by element. Anything else,
+// a byte string whose id doesn't resolve in this state included, raises ERROR_INVALID_CAST
 size_t _native_io_print(eval_state_t* state, size_t arg) {
+  const char* data = NULL;
+  size_t len = 0;
+  if (_bytes_get(state, arg, &data, &len)) {
+    _output_write(state, data, len);
+    goto success;
+  }
+
   if (_native_is_integer(state, arg)) {
     sint n = _native_as_integer(state, arg);
     EVAL_CHECK_STATE(state)
     // TODO: no unicode for now :(
-    printf("%c", (char)n);
+    char c = (char)n;
+    _output_write(state, &c, 1);
     goto success;
   }
 
@@ -78,8 +168,322 @@ size_t _native_io_print(eval_state_t* state, size_t arg) {
       payload_cell = eval_cells_get(state->cells, payload);
       EVAL_ASSERT(payload_cell != ERR_VAL, ERROR_INVALID_TREE, "")
     }
+    goto success;
   }
+  EVAL_ASSERT(false, ERROR_INVALID_CAST, "expected bytes, an integer or a list");
 error:
 success:
   return arg;
 }
+
+// ********************** INTEGERS **********************
+
+static void set_terminal(eval_state_t* state, size_t at, sint word) {
+  eval_cells_set(state->cells, at, SIGIL_REF);
+  eval_cells_set(state->cells, at + 1, SIGIL_REF);
+  eval_cells_set(state->cells, at + 2, SIGIL_NIL);
+  eval_cells_set_word(state->cells, at, word);
+}
+
+// NOTE: ^ [tag] [word], the shape of integers and byte strings
+size_t _native_new_value(eval_state_t* state, uint tag, sint word) {
+  size_t new = _heap_alloc(state, 7);
+  if (new == SIZE_MAX) {
+    return SIZE_MAX;
+  }
+  eval_cells_set(state->cells, new, SIGIL_TREE);
+  set_terminal(state, new + 1, (sint)tag);
+  set_terminal(state, new + 4, word);
+  _heap_index_range(state, new, new + 7);
+  return new;
+}
+
+// NOTE: a reference to child, or nil for SIZE_MAX, answers the cell after it
+static size_t set_child(eval_state_t* state, size_t at, size_t child) {
+  if (child == SIZE_MAX) {
+    eval_cells_set(state->cells, at, SIGIL_NIL);
+    return at + 1;
+  }
+  eval_cells_set(state->cells, at, SIGIL_REF);
+  eval_cells_set(state->cells, at + 1, SIGIL_NIL);
+  eval_cells_set(state->cells, at + 2, SIGIL_NIL);
+  eval_cells_set_word(state->cells, at, child - at);
+  return at + 3;
+}
+
+static size_t child_cells(size_t child) {
+  return child == SIZE_MAX ? 1 : 3;
+}
+
+static size_t new_node(eval_state_t* state, size_t lhs, size_t rhs) {
+  size_t n = 1 + child_cells(lhs) + child_cells(rhs);
+  size_t new = _heap_alloc(state, n);
+  if (new == SIZE_MAX) {
+    return SIZE_MAX;
+  }
+  eval_cells_set(state->cells, new, SIGIL_TREE);
+  set_child(state, set_child(state, new + 1, lhs), rhs);
+  _heap_index_range(state, new, new + n);
+  return new;
+}
+
+// NOTE: ^ type.list payload, payload is a chain of ^ value next ending in nil
+static size_t new_list(eval_state_t* state, size_t payload) {
+  size_t n = 4 + child_cells(payload);
+  size_t new = _heap_alloc(state, n);
+  if (new == SIZE_MAX) {
+    return SIZE_MAX;
+  }
+  eval_cells_set(state->cells, new, SIGIL_TREE);
+  set_terminal(state, new + 1, NATIVE_TYPE_LIST);
+  set_child(state, new + 4, payload);
+  _heap_index_range(state, new, new + n);
+  return new;
+}
+
+// NOTE: a tree without references, spelled in sigils
+static size_t new_shape(eval_state_t* state, const char* shape) {
+  size_t n = strlen(shape);
+  size_t new = _heap_alloc(state, n);
+  if (new == SIZE_MAX) {
+    return SIZE_MAX;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    eval_cells_set(state->cells, new + i, shape[i] == '^' ? SIGIL_TREE : SIGIL_NIL);
+  }
+  _heap_index_range(state, new, new + n);
+  return new;
+}
+
+static size_t new_numeral(eval_state_t* state, size_t n) {
+  size_t new = _heap_alloc(state, 2 * n + 3);
+  if (new == SIZE_MAX) {
+    return SIZE_MAX;
+  }
+  for (size_t i = 0; i < n + 1; ++i) {
+    eval_cells_set(state->cells, new + i, SIGIL_TREE);
+  }
+  for (size_t i = n + 1; i < 2 * n + 3; ++i) {
+    eval_cells_set(state->cells, new + i, SIGIL_NIL);
+  }
+  _heap_index_range(state, new, new + 2 * n + 3);
+  return new;
+}
+
+static bool as_integer(eval_state_t* state, size_t value, sint* out) {
+  if (!_native_is_integer(state, value)) {
+    return false;
+  }
+  *out = _native_as_integer(state, value);
+  return !state->error_code;
+}
+
+static bool operands(eval_state_t* state, size_t arg, sint* a, sint* b) {
+  size_t lhs = _eval_get_left_node(state, arg);
+  size_t rhs = _eval_get_right_node(state, arg);
+  return lhs != arg && as_integer(state, lhs, a) && as_integer(state, rhs, b);
+}
+
+// NOTE: computed on unsigned words, so overflow wraps instead of being undefined
+static size_t binary(eval_state_t* state, size_t arg, u8 op) {
+  sint a = 0;
+  sint b = 0;
+  EVAL_ASSERT(operands(state, arg, &a, &b), ERROR_INVALID_CAST, "expected ^ a b of integers");
+  uint lhs = (uint)a;
+  uint rhs = (uint)b;
+  uint result = 0;
+  switch (op) {
+  case INT_ADD:
+    result = lhs + rhs;
+    break;
+  case INT_SUB:
+    result = lhs - rhs;
+    break;
+  case INT_MUL:
+    result = lhs * rhs;
+    break;
+  case INT_AND:
+    result = lhs & rhs;
+    break;
+  case INT_OR:
+    result = lhs | rhs;
+    break;
+  case INT_XOR:
+    result = lhs ^ rhs;
+    break;
+  case INT_SHL:
+    result = lhs << (rhs & 63);
+    break;
+  case INT_SHR:
+    result = a < 0 ? ~(~lhs >> (rhs & 63)) : lhs >> (rhs & 63);
+    break;
+  }
+  return _native_new_value(state, NATIVE_TYPE_INTEGER, (sint)result);
+error:
+  return arg;
+}
+
+size_t _native_int_add(eval_state_t* state, size_t arg) {
+  return binary(state, arg, INT_ADD);
+}
+
+size_t _native_int_sub(eval_state_t* state, size_t arg) {
+  return binary(state, arg, INT_SUB);
+}
+
+size_t _native_int_mul(eval_state_t* state, size_t arg) {
+  return binary(state, arg, INT_MUL);
+}
+
+size_t _native_int_and(eval_state_t* state, size_t arg) {
+  return binary(state, arg, INT_AND);
+}
+
+size_t _native_int_or(eval_state_t* state, size_t arg) {
+  return binary(state, arg, INT_OR);
+}
+
+size_t _native_int_xor(eval_state_t* state, size_t arg) {
+  return binary(state, arg, INT_XOR);
+}
+
+size_t _native_int_shl(eval_state_t* state, size_t arg) {
+  return binary(state, arg, INT_SHL);
+}
+
+size_t _native_int_shr(eval_state_t* state, size_t arg) {
+  return binary(state, arg, INT_SHR);
+}
+
+size_t _native_int_divmod(eval_state_t* state, size_t arg) {
+  sint a = 0;
+  sint b = 0;
+  EVAL_ASSERT(operands(state, arg, &a, &b), ERROR_INVALID_CAST, "expected ^ a b of integers");
+  EVAL_ASSERT(b != 0, ERROR_DIVIDE_BY_ZERO, "");
+  // NOTE: the one quotient that doesn't fit wraps like the other operations
+  sint q = a == INTPTR_MIN && b == -1 ? INTPTR_MIN : a / b;
+  sint r = a == INTPTR_MIN && b == -1 ? 0 : a % b;
+  size_t quotient = _native_new_value(state, NATIVE_TYPE_INTEGER, q);
+  size_t remainder = _native_new_value(state, NATIVE_TYPE_INTEGER, r);
+  return new_node(state, quotient, remainder);
+error:
+  return arg;
+}
+
+size_t _native_int_compare(eval_state_t* state, size_t arg) {
+  sint a = 0;
+  sint b = 0;
+  EVAL_ASSERT(operands(state, arg, &a, &b), ERROR_INVALID_CAST, "expected ^ a b of integers");
+  return new_shape(state, a < b ? "^**" : a == b ? "^^***" : "^^**^**");
+error:
+  return arg;
+}
+
+size_t _native_int_not(eval_state_t* state, size_t arg) {
+  sint a = 0;
+  EVAL_ASSERT(as_integer(state, arg, &a), ERROR_INVALID_CAST, "expected an integer");
+  return _native_new_value(state, NATIVE_TYPE_INTEGER, (sint)~(uint)a);
+error:
+  return arg;
+}
+
+size_t _native_int_from_tree(eval_state_t* state, size_t arg) {
+  size_t n = 0;
+  size_t node = arg;
+  while (true) {
+    EVAL_ASSERT(eval_cells_get(state->cells, node) == SIGIL_TREE, ERROR_INVALID_CAST, "");
+    size_t lhs = _eval_get_left_node(state, node);
+    size_t rhs = _eval_get_right_node(state, node);
+    EVAL_ASSERT(
+        eval_cells_get(state->cells, rhs) == SIGIL_NIL, ERROR_INVALID_CAST, "expected a numeral");
+    if (eval_cells_get(state->cells, lhs) == SIGIL_NIL) {
+      break;
+    }
+    n++;
+    node = lhs;
+  }
+  return _native_new_value(state, NATIVE_TYPE_INTEGER, (sint)n);
+error:
+  return arg;
+}
+
+size_t _native_int_to_tree(eval_state_t* state, size_t arg) {
+  sint n = 0;
+  EVAL_ASSERT(as_integer(state, arg, &n), ERROR_INVALID_CAST, "expected an integer");
+  EVAL_ASSERT(n >= 0 && n <= (sint)NATIVE_NUMERAL_MAX, ERROR_INVALID_CAST, "");
+  return new_numeral(state, (size_t)n);
+error:
+  return arg;
+}
+
+// ********************** BYTE STRINGS **********************
+
+size_t _native_bytes_from_list(eval_state_t* state, size_t arg) {
+  struct string_buffer_t out;
+  _sb_init(&out);
+  EVAL_ASSERT(_native_is_list(state, arg), ERROR_INVALID_CAST, "expected a list");
+  size_t payload = _eval_get_right_node(state, arg);
+  while (eval_cells_get(state->cells, payload) == SIGIL_TREE) {
+    size_t value = _eval_get_left_node(state, payload);
+    const char* data = NULL;
+    size_t len = 0;
+    sint n = 0;
+    if (_bytes_get(state, value, &data, &len)) {
+      _sb_append_data(&out, data, len);
+    } else {
+      EVAL_ASSERT(
+          as_integer(state, value, &n), ERROR_INVALID_CAST, "expected integers and byte strings");
+      _sb_append_char(&out, (char)n);
+    }
+    payload = _eval_get_right_node(state, payload);
+  }
+  EVAL_ASSERT(eval_cells_get(state->cells, payload) == SIGIL_NIL, ERROR_INVALID_TREE, "");
+  size_t len = out.len;
+  return _bytes_new(state, _sb_detach(&out), len);
+error:
+  _sb_free(&out);
+  return arg;
+}
+
+size_t _native_bytes_to_list(eval_state_t* state, size_t arg) {
+  const char* data = NULL;
+  size_t len = 0;
+  EVAL_ASSERT(_bytes_get(state, arg, &data, &len), ERROR_INVALID_CAST, "expected byte string");
+  size_t payload = SIZE_MAX;
+  for (size_t i = len; i > 0; --i) {
+    size_t value = _native_new_value(state, NATIVE_TYPE_INTEGER, (unsigned char)data[i - 1]);
+    payload = new_node(state, value, payload);
+  }
+  return new_list(state, payload);
+error:
+  return arg;
+}
+
+size_t _native_bytes_concat(eval_state_t* state, size_t arg) {
+  const char* lhs = NULL;
+  const char* rhs = NULL;
+  size_t lhs_len = 0;
+  size_t rhs_len = 0;
+  size_t a = _eval_get_left_node(state, arg);
+  size_t b = _eval_get_right_node(state, arg);
+  EVAL_ASSERT(
+      a != arg && _bytes_get(state, a, &lhs, &lhs_len) && _bytes_get(state, b, &rhs, &rhs_len),
+      ERROR_INVALID_CAST,
+      "expected ^ a b of byte strings");
+  char* data = malloc(lhs_len + rhs_len + 1);
+  EVAL_ASSERT(data, ERROR_GENERIC, "");
+  memcpy(data, lhs, lhs_len);
+  memcpy(data + lhs_len, rhs, rhs_len);
+  return _bytes_new(state, data, lhs_len + rhs_len);
+error:
+  return arg;
+}
+
+size_t _native_bytes_length(eval_state_t* state, size_t arg) {
+  const char* data = NULL;
+  size_t len = 0;
+  EVAL_ASSERT(_bytes_get(state, arg, &data, &len), ERROR_INVALID_CAST, "expected byte string");
+  return _native_new_value(state, NATIVE_TYPE_INTEGER, (sint)len);
+error:
+  return arg;
+}
@@ -2,10 +2,46 @@
 #define __EVAL_NATIVE__
 
 #include "api.h"
+#include <stdbool.h>
 
 #define NATIVE_TYPE_INTEGER 0
 #define NATIVE_TYPE_LIST    1
+#define NATIVE_TYPE_BYTES   2
+
+// NOTE: integer natives work on `^ type.integer [n]` and answer with a fresh integer.
+// Binary ones take their operands as a pair ^ a b. Arithmetic wraps around in two's
+// complement, division truncates toward zero and a zero divisor raises
+// ERROR_DIVIDE_BY_ZERO, shift amounts are taken modulo 64 and int.shr is arithmetic.
+// int.divmod answers ^ q r, int.compare answers ^, ^^ or ^^^ for less, equal and greater,
+// so a triage can branch on it. Tree numerals are unary, ^ is 0 and ^x is x + 1
+#define NATIVE_NUMERAL_MAX ((NODE_SPAN_MAX - 3) / 2)
+
+// NOTE: byte strings, see bytes.h. bytes.from_list takes a list of integers, one byte each,
+// and byte strings, appended whole. bytes.to_list answers a list of integers, bytes.concat
+// takes a pair ^ a b of byte strings
+size_t _native_new_value(eval_state_t* state, uint tag, sint word);
+
+// NOTE: whether a native word only depends on its argument, io.print writes to the sink
+// of its state and byte strings live in a table of their state, see parallel.c
+bool _native_is_pure(uint word);
 
 size_t _native_io_print(eval_state_t*, size_t);
+size_t _native_bytes_from_list(eval_state_t*, size_t);
+size_t _native_bytes_to_list(eval_state_t*, size_t);
+size_t _native_bytes_concat(eval_state_t*, size_t);
+size_t _native_bytes_length(eval_state_t*, size_t);
+size_t _native_int_add(eval_state_t*, size_t);
+size_t _native_int_sub(eval_state_t*, size_t);
+size_t _native_int_mul(eval_state_t*, size_t);
+size_t _native_int_divmod(eval_state_t*, size_t);
+size_t _native_int_compare(eval_state_t*, size_t);
+size_t _native_int_and(eval_state_t*, size_t);
+size_t _native_int_or(eval_state_t*, size_t);
+size_t _native_int_xor(eval_state_t*, size_t);
+size_t _native_int_not(eval_state_t*, size_t);
+size_t _native_int_shl(eval_state_t*, size_t);
+size_t _native_int_shr(eval_state_t*, size_t);
+size_t _native_int_from_tree(eval_state_t*, size_t);
+size_t _native_int_to_tree(eval_state_t*, size_t);
 
 #endif
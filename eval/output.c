@@ -0,0 +1,108 @@
+#include "api.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "eval.h"
+#include "output.h"
+#include "util.h"
+
+sint _output_write_fd(void* ctx, const char* data, size_t len) {
+  int fd = *(int*)ctx;
+  while (len) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return ERR_VAL;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+sint _output_write_string_buffer(void* ctx, const char* data, size_t len) {
+  _sb_append_data(ctx, data, len);
+  return 0;
+}
+
+// NOTE: without a writer the sink is output_fd
+static sint sink(eval_state_t* state, const char* data, size_t len) {
+  sint err = 0;
+  if (state->output_write) {
+    err = state->output_write(state->output_ctx, data, len);
+  } else {
+    err = _output_write_fd(&state->output_fd, data, len);
+  }
+  EVAL_ASSERT(err == 0, ERROR_GENERIC, "the output sink failed");
+  return 0;
+error:
+  return ERR_VAL;
+}
+
+sint _output_write(eval_state_t* state, const char* data, size_t len) {
+  if (state->output_len + len > OUTPUT_CHUNK_SIZE && _output_flush(state) == ERR_VAL) {
+    return ERR_VAL;
+  }
+  if (len >= OUTPUT_CHUNK_SIZE) {
+    return sink(state, data, len);
+  }
+  if (!state->output_chunk) {
+    state->output_chunk = malloc(OUTPUT_CHUNK_SIZE);
+    if (!state->output_chunk) {
+      return sink(state, data, len);
+    }
+  }
+  memcpy(state->output_chunk + state->output_len, data, len);
+  state->output_len += len;
+  return 0;
+}
+
+sint _output_flush(eval_state_t* state) {
+  if (state->output_len == 0) {
+    return 0;
+  }
+  size_t len = state->output_len;
+  state->output_len = 0;
+  return sink(state, state->output_chunk, len);
+}
+
+void _output_free(eval_state_t* state) {
+  _output_flush(state);
+  free(state->output_chunk);
+  state->output_chunk = NULL;
+}
+
+sint eval_set_output(eval_state_t* state, eval_writer_t write, void* ctx) {
+  if (!state || _output_flush(state) == ERR_VAL) {
+    return ERR_VAL;
+  }
+  state->output_write = write;
+  state->output_ctx = ctx;
+  return 0;
+}
+
+sint eval_set_output_fd(eval_state_t* state, int fd) {
+  if (eval_set_output(state, NULL, NULL) == ERR_VAL) {
+    return ERR_VAL;
+  }
+  state->output_fd = fd;
+  return 0;
+}
+
+sint eval_set_output_buffer(eval_state_t* state, struct string_buffer_t* buffer) {
+  if (!buffer) {
+    return ERR_VAL;
+  }
+  return eval_set_output(state, _output_write_string_buffer, buffer);
+}
+
+sint eval_flush_output(eval_state_t* state) {
+  if (!state) {
+    return ERR_VAL;
+  }
+  return _output_flush(state);
+}
@@ -0,0 +1,19 @@
+#ifndef __EVAL_OUTPUT__
+#define __EVAL_OUTPUT__
+
+#include "api.h"
+
+// NOTE: natives write to the output sink of their state through a chunk of this size,
+// the sink is called when it fills up, once a run returns and on `eval_flush_output`.
+// Writes at least this long go to the sink directly
+#define OUTPUT_CHUNK_SIZE (1 << 16)
+
+// NOTE: writers for an fd pointed to by ctx and for a string buffer, shared with the dumps
+sint _output_write_fd(void* ctx, const char* data, size_t len);
+sint _output_write_string_buffer(void* ctx, const char* data, size_t len);
+
+sint _output_write(eval_state_t* state, const char* data, size_t len);
+sint _output_flush(eval_state_t* state);
+void _output_free(eval_state_t* state);
+
+#endif
@@ -0,0 +1,392 @@
+#define _POSIX_C_SOURCE 200809L
+#include "api.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "vendor/stb_ds.h"
+
+#include "eval.h"
+#include "heap.h"
+#include "memory.h"
+#include "native.h"
+#include "parallel.h"
+
+// NOTE: every task is an application (x z) reduced in a state of its own, so workers never
+// share a heap: the forking worker copies x and z out of its heap, the joining one copies
+// the normal form back in. Copies cost the size of the trees, so a fork is made only while
+// some worker is idle. Tasks are pushed to and popped from the back of the forking worker's
+// deque and stolen from the front, where the oldest and usually biggest tasks are.
+// A task state has neither the output sink nor the byte strings of its parent, so (x z)
+// is not forked when it holds a native that isn't pure, it is reduced in place instead
+
+// NOTE: steps a worker takes between checks whether the run was stopped
+#define PARALLEL_CHUNK_STEPS (1 << 14)
+
+typedef struct parallel_task_t {
+  eval_state_t* state;
+  size_t result;
+  int done;
+} parallel_task_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  parallel_task_t** tasks;
+  size_t head;
+} parallel_deque_t;
+
+typedef struct {
+  parallel_deque_t* deques;
+  size_t workers_count;
+  size_t idle;
+  int stop;
+  size_t steps;
+  pthread_mutex_t sleep_lock;
+  pthread_cond_t wake;
+  size_t queued;
+} parallel_pool_t;
+
+typedef struct parallel_worker_t {
+  parallel_pool_t* pool;
+  size_t id;
+} parallel_worker_t;
+
+typedef struct {
+  size_t key;
+  size_t value;
+} copied_entry_t;
+
+typedef struct {
+  size_t ref;
+  size_t target;
+} pending_ref_t;
+
+// NOTE: the inline cells of the node at index, returns where the copy starts. References
+// found inside are left for the caller, natives keep their word. With pure set, a registered
+// native that isn't pure fails the copy, other words are payloads of values
+static size_t copy_span(
+    eval_state_t* dst, eval_state_t* src, size_t index, bool pure, pending_ref_t** pending) {
+  size_t end = index + 1;
+  if (eval_cells_subtree_end(src->cells, index, &end) == ERR_VAL) {
+    return SIZE_MAX;
+  }
+  size_t start = _heap_alloc(dst, end - index);
+  if (start == SIZE_MAX) {
+    return SIZE_MAX;
+  }
+  for (size_t i = index; i < end; ++i) {
+    sint cell = eval_cells_get(src->cells, i);
+    eval_cells_set(dst->cells, start + (i - index), cell);
+    if (cell != SIGIL_REF) {
+      continue;
+    }
+    sint word = 0;
+    eval_cells_get_word(src->cells, i, &word);
+    size_t to = start + (i - index);
+    if (eval_cells_get(src->cells, i + 1) == SIGIL_REF) {
+      if (pure && _eval_native_registered(src, word) && !_native_is_pure((uint)word)) {
+        return SIZE_MAX;
+      }
+      eval_cells_set_word(dst->cells, to, word);
+      eval_cells_set(dst->cells, to + 1, SIGIL_REF);
+      eval_cells_set(dst->cells, to + 2, SIGIL_NIL);
+    } else {
+      stbds_arrput(*pending, ((pending_ref_t){.ref = to, .target = i + word}));
+      eval_cells_set(dst->cells, to + 1, SIGIL_NIL);
+      eval_cells_set(dst->cells, to + 2, SIGIL_NIL);
+    }
+    i += 2;
+  }
+  _heap_index_range(dst, start, start + (end - index));
+  return start;
+}
+
+// NOTE: copies the tree at index from src into dst keeping shared subtrees shared,
+// returns its index in dst or SIZE_MAX if the tree is broken (or not pure, see copy_span)
+static size_t copy_tree(eval_state_t* dst, eval_state_t* src, size_t index, bool pure) {
+  copied_entry_t* copied = NULL;
+  pending_ref_t* pending = NULL;
+  index = _eval_dereference(src, index);
+  size_t root = copy_span(dst, src, index, pure, &pending);
+  while (root != SIZE_MAX && stbds_arrlenu(pending) > 0) {
+    pending_ref_t ref = stbds_arrpop(pending);
+    size_t target = SIZE_MAX;
+    ptrdiff_t found = stbds_hmgeti(copied, ref.target);
+    if (found >= 0) {
+      target = copied[found].value;
+    } else {
+      target = copy_span(dst, src, ref.target, pure, &pending);
+      if (target == SIZE_MAX) {
+        root = SIZE_MAX;
+        break;
+      }
+      stbds_hmput(copied, ref.target, target);
+    }
+    eval_cells_set_word(dst->cells, ref.ref, (sint)(target - ref.ref));
+  }
+  stbds_hmfree(copied);
+  stbds_arrfree(pending);
+  return root;
+}
+
+static void wake_workers(parallel_pool_t* pool) {
+  pthread_mutex_lock(&pool->sleep_lock);
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->sleep_lock);
+}
+
+static void deque_push(parallel_pool_t* pool, size_t id, parallel_task_t* task) {
+  parallel_deque_t* deque = &pool->deques[id];
+  pthread_mutex_lock(&deque->lock);
+  stbds_arrput(deque->tasks, task);
+  pthread_mutex_unlock(&deque->lock);
+  __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+  wake_workers(pool);
+}
+
+// NOTE: the owner takes the newest task, a thief the oldest one
+static parallel_task_t* deque_take(parallel_pool_t* pool, size_t id, bool steal) {
+  parallel_deque_t* deque = &pool->deques[id];
+  parallel_task_t* task = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->head < stbds_arrlenu(deque->tasks)) {
+    task = steal ? deque->tasks[deque->head++] : stbds_arrpop(deque->tasks);
+    if (deque->head == stbds_arrlenu(deque->tasks)) {
+      stbds_arrsetlen(deque->tasks, 0);
+      deque->head = 0;
+    }
+  }
+  pthread_mutex_unlock(&deque->lock);
+  if (task) {
+    __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+  }
+  return task;
+}
+
+// NOTE: takes the task back if no one has stolen it yet
+static bool deque_take_back(parallel_pool_t* pool, size_t id, parallel_task_t* task) {
+  parallel_deque_t* deque = &pool->deques[id];
+  bool found = false;
+  pthread_mutex_lock(&deque->lock);
+  size_t len = stbds_arrlenu(deque->tasks);
+  if (deque->head < len && deque->tasks[len - 1] == task) {
+    stbds_arrpop(deque->tasks);
+    found = true;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  if (found) {
+    __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+  }
+  return found;
+}
+
+static parallel_task_t* find_task(parallel_worker_t* worker) {
+  parallel_pool_t* pool = worker->pool;
+  parallel_task_t* task = deque_take(pool, worker->id, false);
+  for (size_t i = 1; !task && i < pool->workers_count; ++i) {
+    task = deque_take(pool, (worker->id + i) % pool->workers_count, true);
+  }
+  return task;
+}
+
+// NOTE: reduces the state of a worker to its normal form, forks and joins happen inside
+static void run_state(parallel_worker_t* worker, eval_state_t* state) {
+  parallel_pool_t* pool = worker->pool;
+  state->worker = worker;
+  while (!__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST)) {
+    size_t steps = 0;
+    sint done = eval_run(state, PARALLEL_CHUNK_STEPS, &steps);
+    __atomic_add_fetch(&pool->steps, steps, __ATOMIC_SEQ_CST);
+    if (done || state->error_code || steps < PARALLEL_CHUNK_STEPS) {
+      break;
+    }
+  }
+  state->worker = NULL;
+}
+
+static void run_task(parallel_worker_t* worker, parallel_task_t* task) {
+  run_state(worker, task->state);
+  if (stbds_arrlenu(task->state->result_stack) > 0) {
+    task->result = task->state->result_stack[stbds_arrlenu(task->state->result_stack) - 1];
+  }
+  __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+  // NOTE: its joiner may be waiting, see `_parallel_join`
+  wake_workers(worker->pool);
+}
+
+static void* worker_main(void* arg) {
+  parallel_worker_t* worker = arg;
+  parallel_pool_t* pool = worker->pool;
+  while (!__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST)) {
+    parallel_task_t* task = find_task(worker);
+    if (task) {
+      run_task(worker, task);
+      continue;
+    }
+    pthread_mutex_lock(&pool->sleep_lock);
+    __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST)
+           && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0) {
+      pthread_cond_wait(&pool->wake, &pool->sleep_lock);
+    }
+    __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool->sleep_lock);
+  }
+  return NULL;
+}
+
+// NOTE: along with the tasks it forked and never joined
+static void free_task(parallel_task_t* task) {
+  while (stbds_arrlenu(task->state->joins) > 0) {
+    free_task(stbds_arrpop(task->state->joins));
+  }
+  eval_free(&task->state);
+  free(task);
+}
+
+bool _parallel_fork(eval_state_t* state, size_t x, size_t z) {
+  parallel_worker_t* worker = state->worker;
+  if (!worker) {
+    return false;
+  }
+  // NOTE: no more tasks than idle workers to take them
+  size_t idle = __atomic_load_n(&worker->pool->idle, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&worker->pool->queued, __ATOMIC_SEQ_CST) >= idle) {
+    return false;
+  }
+  parallel_task_t* task = calloc(1, sizeof(*task));
+  if (!task || eval_init(&task->state) == ERR_VAL) {
+    free(task);
+    return false;
+  }
+  eval_state_t* task_state = task->state;
+  for (size_t i = 0; i < stbds_shlenu(state->native_symbols); ++i) {
+    eval_add_native(task_state, state->native_symbols[i].key, state->native_symbols[i].value);
+  }
+  size_t task_x = copy_tree(task_state, state, x, true);
+  size_t task_z = task_x == SIZE_MAX ? SIZE_MAX : copy_tree(task_state, state, z, true);
+  if (task_x == SIZE_MAX || task_z == SIZE_MAX) {
+    free_task(task);
+    return false;
+  }
+  stbds_arrput(task_state->apply_stack, TOKEN_APPLY);
+  stbds_arrput(task_state->apply_stack, task_x);
+  stbds_arrput(task_state->apply_stack, task_z);
+  _eval_verify(task_state);
+
+  stbds_arrput(state->joins, task);
+  deque_push(worker->pool, worker->id, task);
+  return true;
+}
+
+// NOTE: a task nobody stole is run right here, otherwise the worker helps with other
+// tasks until the thief is done. With none queued it sleeps until a task finishes or
+// another one is queued
+bool _parallel_join(eval_state_t* state, size_t* result) {
+  parallel_worker_t* worker = state->worker;
+  parallel_pool_t* pool = worker->pool;
+  parallel_task_t* task = stbds_arrpop(state->joins);
+  if (deque_take_back(pool, worker->id, task)) {
+    run_task(worker, task);
+  }
+  while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {
+    parallel_task_t* other = find_task(worker);
+    if (other) {
+      run_task(worker, other);
+      continue;
+    }
+    pthread_mutex_lock(&pool->sleep_lock);
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)
+           && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0) {
+      pthread_cond_wait(&pool->wake, &pool->sleep_lock);
+    }
+    pthread_mutex_unlock(&pool->sleep_lock);
+  }
+
+  bool joined = false;
+  eval_state_t* task_state = task->state;
+  if (task_state->error_code) {
+    _errbuf_raise(
+        state,
+        task_state->error_code,
+        task_state->error_file,
+        task_state->error_line,
+        task_state->error_function);
+    _errbuf_write(state, "%s", task_state->error_buf);
+  } else if (stbds_arrlenu(task_state->result_stack) != 1) {
+    // NOTE: the run was stopped before the task finished
+    _errbuf_raise(state, ERROR_GENERIC, __FILE__, __LINE__, __func__);
+    _errbuf_write(state, "task stopped before its normal form\n");
+  } else {
+    *result = copy_tree(state, task_state, task->result, false);
+    joined = *result != SIZE_MAX;
+    if (!joined) {
+      _errbuf_raise(state, ERROR_INVALID_TREE, __FILE__, __LINE__, __func__);
+      _errbuf_write(state, "task result is not a tree\n");
+    }
+  }
+  free_task(task);
+  return joined;
+}
+
+sint _parallel_run(eval_state_t* state, size_t workers_count, size_t* steps_done) {
+  parallel_pool_t pool = {.workers_count = workers_count};
+  pool.deques = calloc(workers_count, sizeof(*pool.deques));
+  parallel_worker_t* workers = calloc(workers_count, sizeof(*workers));
+  pthread_t* threads = calloc(workers_count, sizeof(*threads));
+  if (!pool.deques || !workers || !threads) {
+    free(pool.deques);
+    free(workers);
+    free(threads);
+    return ERR_VAL;
+  }
+  pthread_mutex_init(&pool.sleep_lock, NULL);
+  pthread_cond_init(&pool.wake, NULL);
+  for (size_t w = 0; w < workers_count; ++w) {
+    pthread_mutex_init(&pool.deques[w].lock, NULL);
+    workers[w] = (parallel_worker_t){.pool = &pool, .id = w};
+  }
+  size_t started = 1;
+  for (; started < workers_count; ++started) {
+    if (pthread_create(&threads[started], NULL, worker_main, &workers[started]) != 0) {
+      break;
+    }
+  }
+
+  // NOTE: the calling thread is worker 0, every task it forks is joined before it is done
+  run_state(&workers[0], state);
+  sint done = stbds_arrlenu(state->apply_stack) == 0 && !state->error_code;
+
+  __atomic_store_n(&pool.stop, 1, __ATOMIC_SEQ_CST);
+  wake_workers(&pool);
+  for (size_t w = 1; w < started; ++w) {
+    pthread_join(threads[w], NULL);
+  }
+
+  // NOTE: after an error, forks that were never joined are dropped with their tokens
+  while (stbds_arrlenu(state->joins) > 0) {
+    parallel_task_t* task = stbds_arrpop(state->joins);
+    free_task(task);
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < stbds_arrlenu(state->apply_stack); ++i) {
+    if (state->apply_stack[i] != TOKEN_JOIN) {
+      state->apply_stack[kept++] = state->apply_stack[i];
+    }
+  }
+  stbds_arrsetlen(state->apply_stack, kept);
+
+  for (size_t w = 0; w < workers_count; ++w) {
+    pthread_mutex_destroy(&pool.deques[w].lock);
+    stbds_arrfree(pool.deques[w].tasks);
+  }
+  pthread_mutex_destroy(&pool.sleep_lock);
+  pthread_cond_destroy(&pool.wake);
+  free(pool.deques);
+  free(workers);
+  free(threads);
+  if (steps_done) {
+    *steps_done = pool.steps;
+  }
+  return done;
+}
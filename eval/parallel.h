@@ -0,0 +1,17 @@
+#ifndef __EVAL_PARALLEL__
+#define __EVAL_PARALLEL__
+
+#include "api.h"
+#include <stdbool.h>
+
+// NOTE: opt-in fork-join reduction, see parallel.c. Rule 2 hands (x z) to another worker
+// and leaves a TOKEN_JOIN in its place, popping the token joins the result back
+
+struct parallel_task_t;
+struct parallel_worker_t;
+
+sint _parallel_run(eval_state_t* state, size_t workers_count, size_t* steps_done);
+bool _parallel_fork(eval_state_t* state, size_t x, size_t z);
+bool _parallel_join(eval_state_t* state, size_t* result);
+
+#endif
@@ -0,0 +1,348 @@
+#define _POSIX_C_SOURCE 200809L
+#include "api.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vendor/stb_ds.h"
+
+#include "eval.h"
+#include "heap.h"
+#include "memory.h"
+
+// NOTE: binary snapshot of an eval state, made to be mapped rather than parsed.
+// Sections are 8-byte aligned arrays of 64-bit values, the packed cell words are used
+// in place from a private mapping. Native words are process specific, so they are
+// saved by symbol name and resolved against the loading state
+
+#define SNAPSHOT_MAGIC   "VETOCHKA"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+  uint64_t offset;
+  uint64_t count;
+} snapshot_section_t;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t word_size;
+  uint64_t heap_top;
+  snapshot_section_t cells;        // packed cell words
+  snapshot_section_t used;         // allocation bitmap words
+  snapshot_section_t has_word;     // payload bitmap words
+  snapshot_section_t payloads;     // payload words in cell order
+  snapshot_section_t apply_stack;  // entries
+  snapshot_section_t result_stack; // entries
+  snapshot_section_t natives;      // bytes: value, name length, name padded to 8, per symbol
+  snapshot_section_t relocations;  // pairs of cell index and symbol number
+} snapshot_header_t;
+
+static size_t align8(size_t size) {
+  return (size + 7) & ~(size_t)7;
+}
+
+static sint write_section(FILE* f, const void* data, size_t bytes) {
+  static const char zeros[8] = {0};
+  if (bytes && fwrite(data, 1, bytes, f) != bytes) {
+    return ERR_VAL;
+  }
+  size_t padding = align8(bytes) - bytes;
+  if (padding && fwrite(zeros, 1, padding, f) != padding) {
+    return ERR_VAL;
+  }
+  return 0;
+}
+
+static uint last_word_mask(size_t bits) {
+  return bits % BITS_PER_WORD ? ((uint)1 << (bits % BITS_PER_WORD)) - 1 : (uint)-1;
+}
+
+static bool is_native_root(allocator_t* cells, size_t index) {
+  return eval_cells_get(cells, index) == SIGIL_REF && eval_cells_get(cells, index + 1) == SIGIL_REF;
+}
+
+// NOTE: refused while a thunk is forced, bookkeeping tokens are left out, see eval.h
+sint eval_snapshot_save(eval_state_t* state, const char* path) {
+  _decoded_store(state);
+  if (!_eval_stack_portable(state->apply_stack)) {
+    return ERR_VAL;
+  }
+  sint err = 0;
+  allocator_t* cells = state->cells;
+  size_t top = state->heap_top;
+  size_t cell_words = top ? (top + CELLS_PER_WORD - 1) / CELLS_PER_WORD : 1;
+  size_t bitmap_words = BITMAP_SIZE(top);
+
+  uint* has_word = calloc(bitmap_words + 1, sizeof(*has_word));
+  sint* payloads = NULL;
+  uint64_t* relocations = NULL;
+  uint64_t* natives = NULL;
+  size_t* apply_stack = NULL;
+  FILE* f = NULL;
+  if (!has_word) {
+    return ERR_VAL;
+  }
+  for (size_t i = 0; i < stbds_arrlenu(state->apply_stack); ++i) {
+    if (!_eval_is_bookkeeping(state->apply_stack[i])) {
+      stbds_arrput(apply_stack, state->apply_stack[i]);
+    }
+  }
+  memcpy(has_word, cells->words_bitmap, bitmap_words * sizeof(*has_word));
+  if (bitmap_words) {
+    has_word[bitmap_words - 1] &= last_word_mask(top);
+  }
+
+  for (size_t w = 0; w < bitmap_words; ++w) {
+    uint bits = has_word[w];
+    while (bits) {
+      size_t index = w * BITS_PER_WORD + __builtin_ctzll(bits);
+      sint word = 0;
+      eval_cells_get_word(cells, index, &word);
+      stbds_arrput(payloads, word);
+      for (size_t s = 0; is_native_root(cells, index) && s < stbds_shlenu(state->native_symbols);
+           ++s) {
+        if (state->native_symbols[s].value == (uint)word) {
+          stbds_arrput(relocations, index);
+          stbds_arrput(relocations, s);
+          break;
+        }
+      }
+      bits &= bits - 1;
+    }
+  }
+
+  for (size_t s = 0; s < stbds_shlenu(state->native_symbols); ++s) {
+    const char* name = state->native_symbols[s].key;
+    size_t len = strlen(name);
+    stbds_arrput(natives, state->native_symbols[s].value);
+    stbds_arrput(natives, len);
+    size_t at = stbds_arrlenu(natives);
+    stbds_arrsetlen(natives, at + align8(len) / 8);
+    memset(natives + at, 0, align8(len));
+    memcpy(natives + at, name, len);
+  }
+
+  snapshot_header_t header = {
+      .version = SNAPSHOT_VERSION,
+      .word_size = sizeof(uint),
+      .heap_top = top,
+  };
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  snapshot_section_t* sections[] = {
+      &header.cells,
+      &header.used,
+      &header.has_word,
+      &header.payloads,
+      &header.apply_stack,
+      &header.result_stack,
+      &header.natives,
+      &header.relocations,
+  };
+  size_t counts[] = {
+      cell_words,
+      bitmap_words,
+      bitmap_words,
+      stbds_arrlenu(payloads),
+      stbds_arrlenu(apply_stack),
+      stbds_arrlenu(state->result_stack),
+      stbds_arrlenu(natives) * sizeof(*natives),
+      stbds_arrlenu(relocations) / 2,
+  };
+  size_t elem_sizes[] = {8, 8, 8, 8, 8, 8, 1, 16};
+  size_t offset = align8(sizeof(header));
+  for (size_t i = 0; i < sizeof(sections) / sizeof(*sections); ++i) {
+    sections[i]->offset = offset;
+    sections[i]->count = counts[i];
+    offset += align8(counts[i] * elem_sizes[i]);
+  }
+
+  uint last_cells = cells->cells[cell_words - 1];
+  if (top % CELLS_PER_WORD) {
+    // NOTE: cells past the top may hold garbage, they are saved as unset
+    last_cells |= ~(uint)0 << (top % CELLS_PER_WORD * BITS_PER_CELL);
+  } else if (top == 0) {
+    last_cells = ~(uint)0;
+  }
+
+  f = fopen(path, "wb");
+  if (!f) {
+    err = ERR_VAL;
+    goto error;
+  }
+  err |= write_section(f, &header, sizeof(header));
+  err |= write_section(f, cells->cells, (cell_words - 1) * sizeof(uint));
+  err |= write_section(f, &last_cells, sizeof(last_cells));
+  err |= write_section(f, state->free_bitmap, bitmap_words * sizeof(uint));
+  err |= write_section(f, has_word, bitmap_words * sizeof(uint));
+  err |= write_section(f, payloads, stbds_arrlenu(payloads) * sizeof(*payloads));
+  err |= write_section(f, apply_stack, counts[4] * sizeof(size_t));
+  err |= write_section(f, state->result_stack, counts[5] * sizeof(size_t));
+  err |= write_section(f, natives, counts[6]);
+  err |= write_section(f, relocations, stbds_arrlenu(relocations) * sizeof(*relocations));
+  if (fclose(f) != 0) {
+    err = ERR_VAL;
+  }
+  err = err ? ERR_VAL : 0;
+
+error:
+  free(has_word);
+  stbds_arrfree(payloads);
+  stbds_arrfree(relocations);
+  stbds_arrfree(natives);
+  stbds_arrfree(apply_stack);
+  return err;
+}
+
+static bool section_fits(snapshot_section_t section, size_t elem_size, size_t file_size) {
+  return section.offset % 8 == 0 && section.offset <= file_size
+         && section.count <= (file_size - section.offset) / elem_size;
+}
+
+static sint restore(eval_state_t* state, const snapshot_header_t* header, const char* base) {
+  allocator_t* cells = state->cells;
+  size_t top = header->heap_top;
+  const uint* has_word = (const uint*)(base + header->has_word.offset);
+  const sint* payloads = (const sint*)(base + header->payloads.offset);
+  size_t next_payload = 0;
+  for (size_t w = 0; w < header->has_word.count; ++w) {
+    uint bits = has_word[w];
+    while (bits) {
+      size_t index = w * BITS_PER_WORD + __builtin_ctzll(bits);
+      if (index >= top || next_payload >= header->payloads.count) {
+        return ERR_VAL;
+      }
+      if (eval_cells_set_word(cells, index, payloads[next_payload++]) == ERR_VAL) {
+        return ERR_VAL;
+      }
+      bits &= bits - 1;
+    }
+  }
+
+  // NOTE: symbol names are resolved in table order, relocations refer to them by number
+  uint* values = NULL;
+  const char* natives = base + header->natives.offset;
+  size_t at = 0;
+  sint err = 0;
+  while (at + 16 <= header->natives.count) {
+    uint64_t len = 0;
+    memcpy(&len, natives + at + 8, sizeof(len));
+    if (len > header->natives.count - at - 16) {
+      err = ERR_VAL;
+      break;
+    }
+    char* name = calloc(len + 1, 1);
+    memcpy(name, natives + at + 16, len);
+    uint value = 0;
+    if (eval_get_native(state, name, &value) == ERR_VAL) {
+      err = ERR_VAL;
+    }
+    free(name);
+    stbds_arrput(values, value);
+    at += 16 + align8(len);
+  }
+
+  const uint64_t* relocations = (const uint64_t*)(base + header->relocations.offset);
+  for (size_t i = 0; !err && i < header->relocations.count; ++i) {
+    uint64_t index = relocations[2 * i];
+    uint64_t symbol = relocations[2 * i + 1];
+    if (symbol >= stbds_arrlenu(values) || index >= top) {
+      err = ERR_VAL;
+      break;
+    }
+    err = eval_cells_set_word(cells, index, values[symbol]);
+  }
+  stbds_arrfree(values);
+  if (err == ERR_VAL) {
+    return ERR_VAL;
+  }
+
+  if (_heap_restore(state, (const uint*)(base + header->used.offset), top) == ERR_VAL) {
+    return ERR_VAL;
+  }
+  // NOTE: an empty stack may still be NULL, which memcpy must not be given
+  stbds_arrsetlen(state->apply_stack, header->apply_stack.count);
+  if (header->apply_stack.count > 0) {
+    memcpy(
+        state->apply_stack,
+        base + header->apply_stack.offset,
+        header->apply_stack.count * sizeof(size_t));
+  }
+  stbds_arrsetlen(state->result_stack, header->result_stack.count);
+  if (header->result_stack.count > 0) {
+    memcpy(
+        state->result_stack,
+        base + header->result_stack.offset,
+        header->result_stack.count * sizeof(size_t));
+  }
+  return 0;
+}
+
+sint eval_snapshot_load(eval_state_t* state, const char* path) {
+  _decoded_drop(state);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return ERR_VAL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(snapshot_header_t)) {
+    close(fd);
+    return ERR_VAL;
+  }
+  size_t size = st.st_size;
+  // NOTE: private and writable, the cells are evaluated in place and copied on write
+  char* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return ERR_VAL;
+  }
+
+  snapshot_header_t header;
+  memcpy(&header, base, sizeof(header));
+  size_t bitmap_words = BITMAP_SIZE(header.heap_top);
+  bool valid = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0
+               && header.version == SNAPSHOT_VERSION && header.word_size == sizeof(uint)
+               && section_fits(header.cells, sizeof(uint), size)
+               && section_fits(header.used, sizeof(uint), size)
+               && section_fits(header.has_word, sizeof(uint), size)
+               && section_fits(header.payloads, sizeof(sint), size)
+               && section_fits(header.apply_stack, sizeof(size_t), size)
+               && section_fits(header.result_stack, sizeof(size_t), size)
+               && section_fits(header.natives, 1, size)
+               && section_fits(header.relocations, 2 * sizeof(uint64_t), size)
+               && header.cells.count > 0
+               && header.cells.count >= BITMAP_SIZE(header.heap_top * BITS_PER_CELL)
+               && header.used.count == bitmap_words && header.has_word.count == bitmap_words;
+  if (!valid) {
+    munmap(base, size);
+    return ERR_VAL;
+  }
+
+  sint err = _eval_reset_cells(state);
+  if (err == ERR_VAL) {
+    munmap(base, size);
+    return ERR_VAL;
+  }
+  uint* words = (uint*)(base + header.cells.offset);
+  err = _cells_adopt(state->cells, words, header.cells.count, base, size);
+  if (err == ERR_VAL) {
+    munmap(base, size);
+    return ERR_VAL;
+  }
+  _errbuf_clear(state);
+  err = restore(state, &header, base);
+  if (err == ERR_VAL) {
+    _eval_reset_cells(state);
+    stbds_arrsetlen(state->apply_stack, 0);
+    stbds_arrsetlen(state->result_stack, 0);
+    return ERR_VAL;
+  }
+  _eval_verify(state);
+  _fuse_loaded(state);
+  return 0;
+}
@@ -0,0 +1,60 @@
+#define _POSIX_C_SOURCE 199309L
+#include "api.h"
+#include <string.h>
+#include <time.h>
+
+#include "eval.h"
+#include "memory.h"
+#include "stats.h"
+#include "util.h"
+
+static const char* RULE_NAMES[EVAL_RULES] = {
+    "0a", "0b", "1", "2", "3a", "3b", "3c", "native", "fused"};
+
+double _stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void _stats_clear(eval_state_t* state) {
+  memset(&state->stats, 0, sizeof(state->stats));
+  state->cells->payload_lookups = 0;
+}
+
+sint eval_get_stats(eval_state_t* state, eval_stats_t* stats) {
+  if (!state || !stats) {
+    return ERR_VAL;
+  }
+  *stats = state->stats;
+#ifdef EVAL_STATS
+  stats->enabled = 1;
+#endif
+  stats->payload_lookups = state->cells->payload_lookups;
+  return 0;
+}
+
+sint eval_dump_stats_json(struct string_buffer_t* json_out, eval_state_t* state) {
+  eval_stats_t stats;
+  if (!json_out || eval_get_stats(state, &stats) == ERR_VAL) {
+    return ERR_VAL;
+  }
+  _sb_printf(json_out, "{\n\"enabled\": %s,\n\"rules\": {", stats.enabled ? "true" : "false");
+  for (size_t i = 0; i < EVAL_RULES; ++i) {
+    _sb_printf(json_out, "%s\"%s\": %zu", i ? ", " : "", RULE_NAMES[i], stats.rules[i]);
+  }
+  _sb_printf(
+      json_out,
+      "},\n\"cells_allocated\": %zu,\n\"cells_freed\": %zu,\n\"run_probes\": %zu,\n"
+      "\"payload_lookups\": %zu,\n\"apply_stack_peak\": %zu,\n\"result_stack_peak\": %zu,\n"
+      "\"heap_growths\": %zu,\n\"wall_time\": %.9f\n}",
+      stats.cells_allocated,
+      stats.cells_freed,
+      stats.run_probes,
+      stats.payload_lookups,
+      stats.apply_stack_peak,
+      stats.result_stack_peak,
+      stats.heap_growths,
+      stats.wall_time);
+  return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef __EVAL_STATS__
+#define __EVAL_STATS__
+
+#include "api.h"
+
+// NOTE: evaluator counters, see `eval_get_stats`. They are only kept when EVAL_STATS is
+// defined, otherwise these compile to nothing and the counters stay zero
+#ifdef EVAL_STATS
+#define STATS_ADD(counter, n)       ((counter) += (n))
+#define STATS_PEAK(peak, value)     ((peak) = (value) > (peak) ? (value) : (peak))
+#define STATS_CLOCK(start)          double start = _stats_now()
+#define STATS_ELAPSED(state, start) ((state)->stats.wall_time += _stats_now() - (start))
+#else
+#define STATS_ADD(counter, n)       ((void)0)
+#define STATS_PEAK(peak, value)     ((void)0)
+#define STATS_CLOCK(start)          ((void)0)
+#define STATS_ELAPSED(state, start) ((void)0)
+#endif
+
+double _stats_now(void);
+void _stats_clear(eval_state_t* state);
+
+#endif
@@ -1,15 +1,22 @@
 
+#define _POSIX_C_SOURCE 200809L
 #include "api.h"
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "vendor/stb_ds.h"
 
 #include "config.h"
 #include "encode.h"
 #include "eval.h"
+#include "fixtures.h"
+#include "heap.h"
+#include "memory.h"
+#include "native.h"
 #include "util.h"
 
 #ifndef PROJECT_ROOT
@@ -144,8 +151,8 @@ bool compare_trees(eval_state_t* lhs_state, eval_state_t* rhs_state, size_t lhs,
 
     sint lhs_left = eval_cells_get(lhs_state->cells, lhs + 1);
     sint lhs_right = eval_cells_get(lhs_state->cells, lhs + 2);
-    sint rhs_left = eval_cells_get(lhs_state->cells, rhs + 1);
-    sint rhs_right = eval_cells_get(lhs_state->cells, rhs + 2);
+    sint rhs_left = eval_cells_get(rhs_state->cells, rhs + 1);
+    sint rhs_right = eval_cells_get(rhs_state->cells, rhs + 2);
     UPDATE_RESULT(lhs_cell == rhs_cell);
     UPDATE_RESULT(lhs_left == rhs_left);
     UPDATE_RESULT(lhs_right == rhs_right);
@@ -208,18 +215,29 @@ bool test_memory_smoke(test_data_t _) {
   eval_cells_set(cells, idx++, 0);
   eval_cells_set(cells, idx++, 1);
   eval_cells_set(cells, idx++, 2);
-  eval_cells_set(cells, idx++, 3);
+  eval_cells_set(cells, idx++, 2);
   eval_cells_set_word(cells, idx - 1, 0xDEADBEEF);
+  // NOTE: the fourth cell value is reserved for unset cells
+  ASSERT_TRUE(eval_cells_set(cells, idx, 3) == ERR_VAL);
+  ASSERT_TRUE(!eval_cells_is_set(cells, idx));
 
   ASSERT_TRUE(eval_cells_get(cells, 0) == 0);
   ASSERT_TRUE(eval_cells_get(cells, 1) == 1);
   ASSERT_TRUE(eval_cells_get(cells, 2) == 2);
-  ASSERT_TRUE(eval_cells_get(cells, 3) == 3);
+  ASSERT_TRUE(eval_cells_get(cells, 3) == 2);
   sint word = 0;
   sint err = eval_cells_get_word(cells, 3, &word);
   ASSERT_TRUE(err != -1);
   ASSERT_TRUE(word == 0xDEADBEEF);
 
+  // NOTE: words of a block are kept in cell order, inserting and dropping shifts them
+  eval_cells_set_word(cells, 1, 11);
+  eval_cells_set_word(cells, 2, 22);
+  ASSERT_TRUE(eval_cells_drop_word(cells, 1) == 0);
+  ASSERT_TRUE(eval_cells_get_word(cells, 1, &word) == ERR_VAL);
+  ASSERT_TRUE(eval_cells_get_word(cells, 2, &word) == 0 && word == 22);
+  ASSERT_TRUE(eval_cells_get_word(cells, 3, &word) == 0 && word == 0xDEADBEEF);
+
   goto error;
 
 error:
@@ -250,7 +268,7 @@ bool test_memory_many_cells(test_data_t _) {
   test_memory_many_cells_set_cells* set_cells = NULL;
   for (size_t i = 0; i < cell_count; ++i) {
     double cell_type = (double)rand() / RAND_MAX;
-    uint8_t cell_val = cell_type / 0.25;
+    uint8_t cell_val = rand() % 3;
     eval_cells_set(cells, i, cell_val);
     if (cell_type > 0.75) {
       sint word = rand();
@@ -286,6 +304,1514 @@ error:
   return result;
 }
 
+bool test_eval_run_budget(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_init(&state);
+
+  // NOTE: "simplest rule 2" from eval-smoke, takes 4 reductions
+  const char* json = "{\"cells\": {\"state\": \"^^^***^**^**\", \"words\": []},"
+                     " \"apply_stack\": [-1, 0, 9], \"result_stack\": []}";
+  eval_load_json(json, state);
+
+  size_t steps = 0;
+  sint done = eval_run(state, 2, &steps);
+  ASSERT_TRUE(!done);
+  ASSERT_TRUE(state->error_code == 0);
+  ASSERT_TRUE(steps == 2);
+
+  done = eval_run(state, EVAL_STEPS_UNLIMITED, &steps);
+  ASSERT_TRUE(done);
+  ASSERT_TRUE(state->error_code == 0);
+  ASSERT_TRUE(steps == 2);
+  ASSERT_TRUE(stbds_arrlenu(state->apply_stack) == 0);
+  ASSERT_TRUE(stbds_arrlenu(state->result_stack) == 1);
+  ASSERT_TRUE(state->result_stack[0] == 22);
+
+  done = eval_run(state, EVAL_STEPS_UNLIMITED, &steps);
+  ASSERT_TRUE(done);
+  ASSERT_TRUE(steps == 0);
+
+error:
+  eval_free(&state);
+  return result;
+}
+
+bool test_gc_reachability(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_state_t* reference_state = NULL;
+  eval_init(&state);
+  eval_init(&reference_state);
+
+  const char* json = "{\"cells\": {\"state\": \"^^^***^**^**\", \"words\": []},"
+                     " \"apply_stack\": [-1, 0, 9], \"result_stack\": []}";
+  const char* expected = "{\"cells\": {\"state\": \"^^^***^**^**^^***^^***^^**^^***\","
+                         " \"words\": []}, \"apply_stack\": [], \"result_stack\": [22]}";
+  eval_load_json(json, state);
+  eval_load_json(expected, reference_state);
+
+  sint done = eval_run(state, EVAL_STEPS_UNLIMITED, NULL);
+  ASSERT_TRUE(done);
+  size_t root = state->result_stack[0];
+
+  sint freed = eval_gc(state);
+  ASSERT_TRUE(freed > 0);
+  ASSERT_TRUE(_bitmap_get_bit(state->free_bitmap, root));
+  // NOTE: the program itself is not reachable anymore
+  ASSERT_TRUE(!_bitmap_get_bit(state->free_bitmap, 0));
+  ASSERT_TRUE(compare_trees(state, reference_state, root, reference_state->result_stack[0]));
+
+  // NOTE: nothing is left to collect
+  ASSERT_TRUE(eval_gc(state) == 0);
+
+error:
+  eval_free(&state);
+  eval_free(&reference_state);
+  return result;
+}
+
+bool test_gc_bounded_heap(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_init(&state);
+
+  // NOTE: M M where M = ^(^I)I and I = ^(^K)K, reduces to itself forever
+  // allocating on every rule 0.b
+  const char* json = "{\"cells\": {\"state\": \"^^^^^^****^^****^^^^****^^***"
+                     "^^^^^^****^^****^^^^****^^***\", \"words\": []},"
+                     " \"apply_stack\": [-1, 0, 29], \"result_stack\": []}";
+  eval_load_json(json, state);
+
+  size_t steps = 0;
+  sint done = eval_run(state, 100000, &steps);
+  ASSERT_TRUE(!done);
+  ASSERT_TRUE(state->error_code == 0);
+  ASSERT_TRUE(steps == 100000);
+  ASSERT_TRUE(state->free_capacity * BITS_PER_WORD <= 4 * GC_MIN_THRESHOLD);
+
+error:
+  eval_free(&state);
+  return result;
+}
+
+bool test_intern(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_state_t* reference_state = NULL;
+  eval_init(&state);
+  eval_init(&reference_state);
+
+  // NOTE: equal subtrees of a loaded image share the canonical id
+  eval_set_option(state, EVAL_OPTION_INTERN, 1);
+  eval_load_json(
+      "{\"cells\": {\"state\": \"^^^***^^***^**\", \"words\": []}, \"apply_stack\": [],"
+      " \"result_stack\": []}",
+      state);
+  ASSERT_TRUE(_eval_canonical(state, 1) == _eval_canonical(state, 6));
+  ASSERT_TRUE(_eval_canonical(state, 2) == _eval_canonical(state, 11));
+  ASSERT_TRUE(_eval_canonical(state, 1) != _eval_canonical(state, 2));
+
+  const char* json = "{\"cells\": {\"state\": \"^^^***^**^**\", \"words\": []},"
+                     " \"apply_stack\": [-1, 0, 9], \"result_stack\": []}";
+  const char* expected = "{\"cells\": {\"state\": \"^^^***^**^**^^***^^***^^**^^***\","
+                         " \"words\": []}, \"apply_stack\": [], \"result_stack\": [22]}";
+  eval_load_json(json, state);
+  eval_load_json(expected, reference_state);
+  ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, NULL));
+  ASSERT_TRUE(state->error_code == 0);
+  ASSERT_TRUE(compare_trees(state, reference_state, state->result_stack[0], 22));
+  eval_gc(state);
+  ASSERT_TRUE(compare_trees(state, reference_state, state->result_stack[0], 22));
+
+  // NOTE: M M rebuilds the same trees forever, with interning it stops allocating
+  eval_load_json(
+      "{\"cells\": {\"state\": \"^^^^^^****^^****^^^^****^^***"
+      "^^^^^^****^^****^^^^****^^***\", \"words\": []},"
+      " \"apply_stack\": [-1, 0, 29], \"result_stack\": []}",
+      state);
+  eval_run(state, 10000, NULL);
+  ASSERT_TRUE(state->error_code == 0);
+  eval_gc(state);
+  eval_run(state, 10000, NULL);
+  ASSERT_TRUE(state->error_code == 0);
+  ASSERT_TRUE(state->heap_top < 256);
+
+  eval_intern_stats_t stats = {};
+  ASSERT_TRUE(eval_intern_stats(state, &stats) == 0);
+  ASSERT_TRUE(stats.hits > 0 && stats.hits <= stats.lookups);
+  ASSERT_TRUE(stats.hit_rate > 0.9);
+
+  eval_set_option(state, EVAL_OPTION_INTERN, 0);
+  eval_intern_stats(state, &stats);
+  ASSERT_TRUE(stats.entries == 0 && stats.lookups == 0);
+
+error:
+  eval_free(&state);
+  eval_free(&reference_state);
+  return result;
+}
+
+bool test_memo(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_state_t* reference_state = NULL;
+  eval_init(&state);
+  eval_init(&reference_state);
+
+  // NOTE: the same rule 2 application twice, the second one comes from the cache
+  const char* json = "{\"cells\": {\"state\": \"^^^***^**^**\", \"words\": []},"
+                     " \"apply_stack\": [-1, 0, 9, -1, 0, 9], \"result_stack\": []}";
+  const char* expected = "{\"cells\": {\"state\": \"^^^***^**^**^^***^^***^^**^^***\","
+                         " \"words\": []}, \"apply_stack\": [], \"result_stack\": [22]}";
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_MEMO, 64) == 0);
+  eval_load_json(json, state);
+  eval_load_json(expected, reference_state);
+
+  size_t steps = 0;
+  ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, &steps));
+  ASSERT_TRUE(state->error_code == 0);
+  ASSERT_TRUE(stbds_arrlenu(state->result_stack) == 2);
+  ASSERT_TRUE(state->result_stack[0] == state->result_stack[1]);
+  ASSERT_TRUE(compare_trees(state, reference_state, state->result_stack[0], 22));
+  ASSERT_TRUE(stbds_arrlenu(state->memo_frames) == 0);
+
+  eval_memo_stats_t stats = {};
+  ASSERT_TRUE(eval_memo_stats(state, &stats) == 0);
+  ASSERT_TRUE(stats.capacity >= 64);
+  ASSERT_TRUE(stats.lookups == 2 && stats.hits == 1);
+
+  // NOTE: entries are weak, once the results are gone so are they
+  stbds_arrsetlen(state->result_stack, 0);
+  eval_gc(state);
+  size_t cached = 0;
+  ASSERT_TRUE(!_memo_find(state, _eval_canonical(state, 0), _eval_canonical(state, 9), &cached));
+
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_MEMO, 0) == 0);
+  ASSERT_TRUE(eval_memo_stats(state, &stats) == 0 && stats.capacity == 0);
+
+error:
+  eval_free(&state);
+  eval_free(&reference_state);
+  return result;
+}
+
+bool test_stats(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_init(&state);
+  string_buffer_t json = {0};
+  _sb_init(&json);
+
+  // NOTE: ((^ ^) ^) ^ takes rule 0.a, rule 0.b and rule 1 once each
+  const char* program = "{\"cells\": {\"state\": \"^**\", \"words\": []},"
+                        " \"apply_stack\": [-1, -1, -1, 0, 0, 0, 0], \"result_stack\": []}";
+  eval_load_json(program, state);
+  ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, NULL));
+  eval_stats_t stats = {};
+  ASSERT_TRUE(eval_get_stats(state, &stats) == 0);
+  ASSERT_TRUE(eval_dump_stats_json(&json, state) == 0);
+#ifdef EVAL_STATS
+  size_t expected[EVAL_RULES] = {[EVAL_RULE_0A] = 1, [EVAL_RULE_0B] = 1, [EVAL_RULE_1] = 1};
+  ASSERT_TRUE(stats.enabled);
+  ASSERT_TRUE(memcmp(stats.rules, expected, sizeof(expected)) == 0);
+  ASSERT_TRUE(stats.cells_allocated == 12 && stats.payload_lookups > 0);
+  ASSERT_TRUE(stats.apply_stack_peak == 7 && stats.result_stack_peak == 4);
+  ASSERT_TRUE(stats.wall_time > 0);
+  ASSERT_TRUE(strstr(_sb_str_view(&json), "\"0a\": 1, \"0b\": 1, \"1\": 1, \"2\": 0") != NULL);
+
+  // NOTE: the decoded engine counts the same rules
+  eval_reset(state);
+  ASSERT_TRUE(eval_get_stats(state, &stats) == 0 && stats.rules[EVAL_RULE_0A] == 0);
+  eval_load_json(program, state);
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_ENGINE, EVAL_ENGINE_DECODED) == 0);
+  ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, NULL));
+  ASSERT_TRUE(eval_get_stats(state, &stats) == 0);
+  ASSERT_TRUE(memcmp(stats.rules, expected, sizeof(expected)) == 0);
+#else
+  ASSERT_TRUE(!stats.enabled && stats.rules[EVAL_RULE_0A] == 0);
+  ASSERT_TRUE(strstr(_sb_str_view(&json), "\"enabled\": false") != NULL);
+#endif
+
+error:
+  eval_free(&state);
+  _sb_free(&json);
+  return result;
+}
+
+bool test_verify(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_state_t* decoded = NULL;
+  eval_init(&state);
+  eval_init(&decoded);
+
+  // NOTE: K K with the argument given by reference
+  eval_load_json(
+      "{\"cells\": {\"state\": \"^^***^^***#**\", \"words\": [{\"index\": 10, \"payload\": -5}]},"
+      " \"apply_stack\": [-1, 0, 10], \"result_stack\": []}",
+      state);
+  ASSERT_TRUE(state->verified);
+  ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, NULL));
+  ASSERT_TRUE(state->error_code == 0);
+  ASSERT_TRUE(state->verified);
+
+  // NOTE: a reference out of the heap
+  eval_load_json(
+      "{\"cells\": {\"state\": \"^#***\", \"words\": [{\"index\": 1, \"payload\": 40}]},"
+      " \"apply_stack\": [], \"result_stack\": []}",
+      state);
+  ASSERT_TRUE(!state->verified);
+
+  // NOTE: a native without its word
+  eval_load_json(
+      "{\"cells\": {\"state\": \"^##**\", \"words\": []}, \"apply_stack\": [],"
+      " \"result_stack\": []}",
+      state);
+  ASSERT_TRUE(!state->verified);
+
+  // NOTE: a native whose word is not a registered native is refused instead of called
+  eval_load_json(
+      "{\"cells\": {\"state\": \"##*\", \"words\": [{\"index\": 0, \"payload\": 12345}]},"
+      " \"apply_stack\": [-1, 0, 0], \"result_stack\": []}",
+      state);
+  ASSERT_TRUE(state->verified);
+  ASSERT_TRUE(!eval_run(state, EVAL_STEPS_UNLIMITED, NULL));
+  ASSERT_TRUE(eval_get_error(state, NULL) == ERROR_INVALID_TREE);
+
+  // NOTE: type tags are registered words but not natives, in either engine
+  native_load_standard(state);
+  native_load_standard(decoded);
+  ASSERT_TRUE(eval_set_option(decoded, EVAL_OPTION_ENGINE, EVAL_ENGINE_DECODED) == 0);
+  eval_state_t* engines[] = {state, decoded};
+  for (size_t i = 0; i < 2; ++i) {
+    eval_load_json(
+        "{\"cells\": {\"state\": \"##*^**\", \"words\": [{\"index\": 0, \"payload\": 0}]},"
+        " \"apply_stack\": [-1, 0, 3], \"result_stack\": []}",
+        engines[i]);
+    ASSERT_TRUE(engines[i]->verified);
+    ASSERT_TRUE(!eval_run(engines[i], EVAL_STEPS_UNLIMITED, NULL));
+    ASSERT_TRUE(eval_get_error(engines[i], NULL) == ERROR_INVALID_TREE);
+  }
+
+  // NOTE: a native registered again under its name can't be called through its old word
+  uint replaced = 0;
+  uint replacement = 0;
+  ASSERT_TRUE(eval_get_native(state, "int.not", &replaced) == 0);
+  ASSERT_TRUE(eval_get_native(state, "int.to_tree", &replacement) == 0);
+  eval_add_native(state, "int.not", replacement);
+  ASSERT_TRUE(!_eval_native_callable(state, (sint)replaced));
+  ASSERT_TRUE(_eval_native_callable(state, (sint)replacement));
+
+  // NOTE: a stack entry inside of a terminal
+  eval_load_json(
+      "{\"cells\": {\"state\": \"^^***\", \"words\": []}, \"apply_stack\": [-1, 0, 3],"
+      " \"result_stack\": []}",
+      state);
+  ASSERT_TRUE(!state->verified);
+
+  // NOTE: an incomplete tree
+  eval_load_json(
+      "{\"cells\": {\"state\": \"^^*\", \"words\": []}, \"apply_stack\": [],"
+      " \"result_stack\": []}",
+      state);
+  ASSERT_TRUE(!state->verified);
+
+error:
+  eval_free(&state);
+  eval_free(&decoded);
+  return result;
+}
+
+bool test_dump_collected(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_state_t* loaded = NULL;
+  eval_init(&state);
+  eval_init(&loaded);
+  string_buffer_t json = {0};
+  _sb_init(&json);
+
+  // NOTE: M M, collections leave freed cells in place below the heap top
+  eval_load_json(
+      "{\"cells\": {\"state\": \"^^^^^^****^^****^^^^****^^***"
+      "^^^^^^****^^****^^^^****^^***\", \"words\": []},"
+      " \"apply_stack\": [-1, 0, 29], \"result_stack\": []}",
+      state);
+  eval_run(state, 40001, NULL);
+  eval_gc(state);
+  ASSERT_TRUE(state->error_code == 0);
+  eval_heap_stats_t stats = {};
+  eval_heap_stats(state, &stats);
+  ASSERT_TRUE(stats.collections > 1 && stats.used < stats.top);
+
+  ASSERT_TRUE(eval_dump_json(&json, state) == 0);
+  ASSERT_TRUE(eval_load_json(_sb_str_view(&json), loaded) == 0);
+  ASSERT_TRUE(loaded->verified);
+  ASSERT_TRUE(loaded->heap_top == state->heap_top);
+  eval_gc(loaded);
+  eval_heap_stats_t reloaded = {};
+  eval_heap_stats(loaded, &reloaded);
+  ASSERT_TRUE(reloaded.used == stats.used);
+
+error:
+  eval_free(&state);
+  eval_free(&loaded);
+  _sb_free(&json);
+  return result;
+}
+
+static bool heap_stats_consistent(eval_state_t* state) {
+  eval_heap_stats_t stats = {};
+  if (eval_heap_stats(state, &stats) == ERR_VAL) {
+    return false;
+  }
+  size_t free_cells = stats.free_listed + stats.free_runs;
+  bool result = true;
+  result &= stats.used + free_cells == stats.top;
+  result &= stats.top <= stats.capacity;
+  result &= stats.largest_run <= free_cells;
+  result &= stats.fragmentation >= 0.0 && stats.fragmentation <= 1.0;
+  return result;
+}
+
+bool test_heap_allocator(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_init(&state);
+
+  const char* json = "{\"cells\": {\"state\": \"^^^^^^****^^****^^^^****^^***"
+                     "^^^^^^****^^****^^^^****^^***\", \"words\": []},"
+                     " \"apply_stack\": [-1, 0, 29], \"result_stack\": []}";
+  eval_load_json(json, state);
+
+  // NOTE: bump allocation crosses bitmap word boundaries
+  size_t first = _heap_alloc(state, 7);
+  ASSERT_TRUE(first == 58);
+  size_t second = _heap_alloc(state, 5);
+  ASSERT_TRUE(second == 65);
+  ASSERT_TRUE(heap_stats_consistent(state));
+
+  // NOTE: both blocks are garbage at the top, so they are given back to the bump pointer
+  eval_gc(state);
+  ASSERT_TRUE(heap_stats_consistent(state));
+  eval_heap_stats_t stats = {};
+  eval_heap_stats(state, &stats);
+  ASSERT_TRUE(stats.top == 58);
+  ASSERT_TRUE(stats.collections == 1);
+
+  // NOTE: keep a leaf at the start of the first and the last block,
+  // the hole between them is reused only for an exact fit
+  first = _heap_alloc(state, 7);
+  second = _heap_alloc(state, 5);
+  size_t third = _heap_alloc(state, 7);
+  size_t leaves[] = {first, third};
+  for (size_t i = 0; i < 2; ++i) {
+    eval_cells_set(state->cells, leaves[i], SIGIL_TREE);
+    eval_cells_set(state->cells, leaves[i] + 1, SIGIL_NIL);
+    eval_cells_set(state->cells, leaves[i] + 2, SIGIL_NIL);
+    stbds_arrput(state->result_stack, leaves[i]);
+  }
+  eval_gc(state);
+  ASSERT_TRUE(heap_stats_consistent(state));
+  eval_heap_stats(state, &stats);
+  ASSERT_TRUE(stats.top == third + 3);
+  ASSERT_TRUE(stats.free_listed == 9);
+  ASSERT_TRUE(_heap_alloc(state, 9) == first + 3);
+  stbds_arrsetlen(state->result_stack, 0);
+
+  size_t steps = 0;
+  eval_run(state, 50000, &steps);
+  ASSERT_TRUE(state->error_code == 0);
+  ASSERT_TRUE(steps == 50000);
+  eval_gc(state);
+  ASSERT_TRUE(heap_stats_consistent(state));
+  for (size_t i = 0; i < 1000; ++i) {
+    _heap_alloc(state, i % 2 ? 5 : 7);
+  }
+  ASSERT_TRUE(heap_stats_consistent(state));
+
+error:
+  eval_free(&state);
+  return result;
+}
+
+bool test_load_json_stream(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_state_t* reference_state = NULL;
+  eval_init(&state);
+  eval_init(&reference_state);
+  string_buffer_t json;
+  _sb_init(&json);
+  char path[] = "/tmp/eval-json-XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_TRUE(fd >= 0);
+
+  // NOTE: the cells string spans several read chunks
+  const size_t leaves = 100000;
+  _sb_append_str(&json, "{\"cells\": {\"state\": \"");
+  for (size_t i = 0; i < leaves; ++i) {
+    _sb_append_str(&json, "^**");
+  }
+  _sb_printf(
+      &json,
+      "#**\", \"words\": [{\"index\": %zu, \"payload\": -3}]},"
+      " \"apply_stack\": [-1, 0, 3], \"result_stack\": [%zu]}",
+      3 * leaves,
+      3 * leaves);
+  ASSERT_TRUE(write(fd, _sb_str_view(&json), json.len) == (ssize_t)json.len);
+
+  ASSERT_TRUE(eval_load_json(_sb_str_view(&json), reference_state) == 0);
+  ASSERT_TRUE(lseek(fd, 0, SEEK_SET) == 0);
+  ASSERT_TRUE(eval_load_json_fd(fd, state) == 0);
+  ASSERT_TRUE(compare_states(state, reference_state));
+  ASSERT_TRUE(state->heap_top == 3 * leaves + 3);
+  sint word = 0;
+  ASSERT_TRUE(eval_cells_get_word(state->cells, 3 * leaves, &word) == 0 && word == -3);
+  ASSERT_TRUE(eval_cells_get(state->cells, 3 * leaves + 3) == ERR_VAL);
+
+  // NOTE: truncated input and unknown cells are errors
+  ASSERT_TRUE(ftruncate(fd, json.len / 2) == 0);
+  ASSERT_TRUE(lseek(fd, 0, SEEK_SET) == 0);
+  ASSERT_TRUE(eval_load_json_fd(fd, state) != 0);
+  ASSERT_TRUE(
+      eval_load_json(
+          "{\"cells\": {\"state\": \"^*x\", \"words\": []}, \"apply_stack\": [],"
+          " \"result_stack\": []}",
+          state)
+      != 0);
+
+  // NOTE: payloads past 2^53 are read exactly
+  ASSERT_TRUE(
+      eval_load_json(
+          "{\"cells\": {\"state\": \"##*\", \"words\": [{\"index\": 0, \"payload\": "
+          "9007199254740993}]}, \"apply_stack\": [], \"result_stack\": [0]}",
+          state)
+      == 0);
+  ASSERT_TRUE(eval_cells_get_word(state->cells, 0, &word) == 0 && word == 9007199254740993);
+  _sb_clear(&json);
+  ASSERT_TRUE(eval_dump_json(&json, state) == 0);
+  ASSERT_TRUE(eval_load_json(_sb_str_view(&json), reference_state) == 0);
+  ASSERT_TRUE(eval_cells_get_word(reference_state->cells, 0, &word) == 0);
+  ASSERT_TRUE(word == 9007199254740993);
+
+  // NOTE: missing or misplaced separators, mismatched brackets and negative entries
+  const char* malformed[] = {
+      "{\"cells\" {\"state\": \"^**\", \"words\": []}, \"apply_stack\": [], \"result_stack\": []}",
+      "{\"cells\": {\"state\": \"^**\", \"words\": []} \"apply_stack\": [], \"result_stack\": []}",
+      "{\"cells\": {\"state\": \"^**\", \"words\": []}, \"apply_stack\": [-1 0 0],"
+      " \"result_stack\": []}",
+      "{\"cells\": {\"state\": \"^**\", \"words\": []}, \"apply_stack\": [0,],"
+      " \"result_stack\": []}",
+      "{\"cells\": {\"state\": \"^**\", \"words\": []}, \"apply_stack\": [0:0],"
+      " \"result_stack\": []}",
+      "{\"cells\": {\"state\": \"^**\", \"words\": ]}, \"apply_stack\": [], \"result_stack\": []}",
+      "{\"cells\": {\"state\": \"^**\", \"words\": []], \"apply_stack\": [], \"result_stack\": []}",
+      "{\"cells\": {\"state\": \"^**\", \"words\": []}, \"apply_stack\": [-4],"
+      " \"result_stack\": []}",
+      "{\"cells\": {\"state\": \"^**\", \"words\": []}, \"apply_stack\": [1.5],"
+      " \"result_stack\": []}",
+  };
+  for (size_t i = 0; i < sizeof(malformed) / sizeof(*malformed); ++i) {
+    ASSERT_TRUE(eval_load_json(malformed[i], state) != 0);
+  }
+
+error:
+  if (fd >= 0) {
+    close(fd);
+    unlink(path);
+  }
+  _sb_free(&json);
+  eval_free(&state);
+  eval_free(&reference_state);
+  return result;
+}
+
+bool test_dump_json(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_state_t* loaded = NULL;
+  eval_init(&state);
+  eval_init(&loaded);
+  string_buffer_t json;
+  _sb_init(&json);
+  char path[] = "/tmp/eval-dump-XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_TRUE(fd >= 0);
+
+  // NOTE: enough steps for words in several payload blocks and cells in several chunks
+  eval_load_json(
+      "{\"cells\": {\"state\": \"^^^^^^****^^****^^^^****^^***^^^^^^****^^****^^^^****^^***"
+      "#**\", \"words\": [{\"index\": 58, \"payload\": -58}]}, \"apply_stack\": [-1, 0, 29],"
+      " \"result_stack\": [58]}",
+      state);
+  eval_run(state, 30000, NULL);
+  ASSERT_TRUE(state->error_code == 0);
+  ASSERT_TRUE(eval_dump_json(&json, state) == 0);
+  ASSERT_TRUE(json.len > JSON_CHUNK_SIZE);
+  ASSERT_TRUE(eval_load_json(_sb_str_view(&json), loaded) == 0);
+  ASSERT_TRUE(compare_states(loaded, state));
+
+  // NOTE: the same document goes to a file descriptor
+  ASSERT_TRUE(eval_dump_json_fd(fd, state) == 0);
+  ASSERT_TRUE(lseek(fd, 0, SEEK_SET) == 0);
+  char* written = malloc(json.len + 1);
+  ssize_t read_len = read(fd, written, json.len + 1);
+  bool same = read_len == (ssize_t)json.len && memcmp(written, json.buf, json.len) == 0;
+  free(written);
+  ASSERT_TRUE(same);
+
+error:
+  if (fd >= 0) {
+    close(fd);
+    unlink(path);
+  }
+  _sb_free(&json);
+  eval_free(&state);
+  eval_free(&loaded);
+  return result;
+}
+
+#define THREADS_COUNT 4
+
+typedef struct {
+  size_t id;
+  const char* expected;
+  bool ok;
+} thread_job_t;
+
+// NOTE: odd jobs fail on purpose, even ones must not see their errors
+static void* run_thread_job(void* arg) {
+  thread_job_t* job = arg;
+  eval_state_t* state = NULL;
+  eval_init(&state);
+  native_load_standard(state);
+  string_buffer_t json;
+  _sb_init(&json);
+  job->ok = true;
+  for (size_t round = 0; round < 20; ++round) {
+    if (job->id % 2) {
+      eval_load_json(
+          "{\"cells\": {\"state\": \"^**\", \"words\": []}, \"apply_stack\": [-1, 0],"
+          " \"result_stack\": []}",
+          state);
+      eval_run(state, EVAL_STEPS_UNLIMITED, NULL);
+      eval_error_t error = {};
+      eval_get_error_info(state, &error);
+      job->ok &= error.code == ERROR_STACK_UNDERFLOW;
+      job->ok &= error.file != NULL && error.line > 0;
+      job->ok &= strstr(error.message, "ERROR_STACK_UNDERFLOW") != NULL;
+      continue;
+    }
+    eval_load_json(
+        "{\"cells\": {\"state\": \"^^^^^^****^^****^^^^****^^***"
+        "^^^^^^****^^****^^^^****^^***\", \"words\": []},"
+        " \"apply_stack\": [-1, 0, 29], \"result_stack\": []}",
+        state);
+    eval_run(state, 2000, NULL);
+    const char* message = NULL;
+    job->ok &= eval_get_error(state, &message) == 0 && message[0] == '\0';
+    _sb_clear(&json);
+    eval_dump_json(&json, state);
+    job->ok &= strcmp(_sb_str_view(&json), job->expected) == 0;
+  }
+  _sb_free(&json);
+  eval_free(&state);
+  return NULL;
+}
+
+bool test_threads(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_init(&state);
+  string_buffer_t expected;
+  _sb_init(&expected);
+
+  eval_load_json(
+      "{\"cells\": {\"state\": \"^^^^^^****^^****^^^^****^^***"
+      "^^^^^^****^^****^^^^****^^***\", \"words\": []},"
+      " \"apply_stack\": [-1, 0, 29], \"result_stack\": []}",
+      state);
+  eval_run(state, 2000, NULL);
+  eval_dump_json(&expected, state);
+
+  pthread_t threads[THREADS_COUNT];
+  thread_job_t jobs[THREADS_COUNT];
+  for (size_t i = 0; i < THREADS_COUNT; ++i) {
+    jobs[i] = (thread_job_t){.id = i, .expected = _sb_str_view(&expected)};
+    ASSERT_TRUE(pthread_create(&threads[i], NULL, run_thread_job, &jobs[i]) == 0);
+  }
+  for (size_t i = 0; i < THREADS_COUNT; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  for (size_t i = 0; i < THREADS_COUNT; ++i) {
+    ASSERT_TRUE(jobs[i].ok);
+  }
+
+error:
+  _sb_free(&expected);
+  eval_free(&state);
+  return result;
+}
+
+bool test_batch(test_data_t _) {
+  bool result = true;
+  eval_batch_item_t items[24];
+  const size_t items_count = sizeof(items) / sizeof(*items);
+  const char* images[] = {
+      // NOTE: runs out of its budget
+      "{\"cells\": {\"state\": \"^^^^^^****^^****^^^^****^^***"
+      "^^^^^^****^^****^^^^****^^***\", \"words\": []},"
+      " \"apply_stack\": [-1, 0, 29], \"result_stack\": []}",
+      // NOTE: fails with a stack underflow
+      "{\"cells\": {\"state\": \"^**\", \"words\": []}, \"apply_stack\": [-1, 0],"
+      " \"result_stack\": []}",
+      // NOTE: K K applied to a reference, finishes
+      "{\"cells\": {\"state\": \"^^***^^***#**\", \"words\": [{\"index\": 10, \"payload\": -5}]},"
+      " \"apply_stack\": [-1, 0, 10], \"result_stack\": []}",
+  };
+  eval_state_t* reference_state = NULL;
+  eval_init(&reference_state);
+  for (size_t i = 0; i < items_count; ++i) {
+    items[i] = (eval_batch_item_t){.max_steps = 1000 + 100 * i};
+    eval_init(&items[i].state);
+  }
+
+  size_t workers[] = {1, 4, 0};
+  for (size_t w = 0; w < sizeof(workers) / sizeof(*workers); ++w) {
+    for (size_t i = 0; i < items_count; ++i) {
+      eval_load_json(images[i % 3], items[i].state);
+    }
+    ASSERT_TRUE(eval_batch(items, items_count, workers[w]) == 0);
+    for (size_t i = 0; i < items_count; ++i) {
+      eval_load_json(images[i % 3], reference_state);
+      size_t steps = 0;
+      sint done = eval_run(reference_state, items[i].max_steps, &steps);
+      ASSERT_TRUE(items[i].done == done && items[i].steps == steps);
+      ASSERT_TRUE(items[i].error_code == reference_state->error_code);
+      ASSERT_TRUE(compare_states(items[i].state, reference_state));
+    }
+    ASSERT_TRUE(items[1].error_code == ERROR_STACK_UNDERFLOW);
+    ASSERT_TRUE(items[2].done && items[2].error_code == 0);
+  }
+
+error:
+  for (size_t i = 0; i < items_count; ++i) {
+    eval_free(&items[i].state);
+  }
+  eval_free(&reference_state);
+  return result;
+}
+
+static bool trees_equal(eval_state_t* a, size_t i, eval_state_t* b, size_t j) {
+  i = _eval_dereference(a, i);
+  j = _eval_dereference(b, j);
+  sint a_cell = eval_cells_get(a->cells, i);
+  if (a_cell != eval_cells_get(b->cells, j)) {
+    return false;
+  }
+  if (a_cell != SIGIL_TREE) {
+    return a_cell == SIGIL_NIL;
+  }
+  return trees_equal(a, _eval_get_left_node(a, i), b, _eval_get_left_node(b, j))
+         && trees_equal(a, _eval_get_right_node(a, i), b, _eval_get_right_node(b, j));
+}
+
+// NOTE: T_0 = K I and T_n = S T_(n-1) T_(n-1), so T_n z is I after 2^n forks of rule 2.
+// discarded applies ^(^K)T_n to z instead, that is (K z)(T_n z) = z without T_n z
+static void load_fork_tower(eval_state_t* state, size_t n, bool discarded) {
+  string_buffer_t json;
+  _sb_init(&json);
+  _sb_append_str(&json, "{\"cells\": {\"state\": \"^^**^^^^****^^***");
+  for (size_t k = 1; k <= n; ++k) {
+    _sb_append_str(&json, "^^#***#**");
+  }
+  _sb_append_str(&json, discarded ? "^**^^^^****#**\", \"words\": [" : "^**\", \"words\": [");
+  size_t previous = 0;
+  for (size_t k = 1; k <= n; ++k) {
+    size_t start = 17 + 9 * (k - 1);
+    _sb_printf(
+        &json,
+        "%s{\"index\": %zu, \"payload\": %ld}, {\"index\": %zu, \"payload\": %ld}",
+        k > 1 ? ", " : "",
+        start + 2,
+        (long)previous - (long)(start + 2),
+        start + 6,
+        (long)previous - (long)(start + 6));
+    previous = start;
+  }
+  size_t z = 17 + 9 * n;
+  if (discarded) {
+    _sb_printf(
+        &json,
+        "%s{\"index\": %zu, \"payload\": %ld}",
+        n > 0 ? ", " : "",
+        z + 11,
+        (long)previous - (long)(z + 11));
+    previous = z + 3;
+  }
+  _sb_printf(
+      &json, "]}, \"apply_stack\": [-1, %zu, %zu], \"result_stack\": []}", previous, z);
+  eval_load_json(_sb_str_view(&json), state);
+  _sb_free(&json);
+}
+
+bool test_parallel(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_state_t* reference_state = NULL;
+  eval_init(&state);
+  eval_init(&reference_state);
+  string_buffer_t out = {0};
+  _sb_init(&out);
+
+  load_fork_tower(reference_state, 10, false);
+  ASSERT_TRUE(reference_state->verified);
+  ASSERT_TRUE(eval_run(reference_state, EVAL_STEPS_UNLIMITED, NULL));
+  ASSERT_TRUE(stbds_arrlenu(reference_state->result_stack) == 1);
+
+  size_t workers[] = {2, 4};
+  for (size_t w = 0; w < sizeof(workers) / sizeof(*workers); ++w) {
+    load_fork_tower(state, 10, false);
+    eval_set_option(state, EVAL_OPTION_PARALLEL, workers[w]);
+    size_t steps = 0;
+    ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, &steps));
+    ASSERT_TRUE(state->error_code == 0 && steps > 0);
+    ASSERT_TRUE(stbds_arrlenu(state->result_stack) == 1);
+    ASSERT_TRUE(stbds_arrlenu(state->apply_stack) == 0);
+    size_t expected = reference_state->result_stack[0];
+    ASSERT_TRUE(trees_equal(state, state->result_stack[0], reference_state, expected));
+  }
+
+  // NOTE: S (S (K (K ^)) io.print) (K (K ^)) 104, the application holding io.print is
+  // reduced in place, so its output reaches the sink of the state
+  native_load_standard(state);
+  eval_set_output_buffer(state, &out);
+  eval_load_json(
+      "{\"cells\": {\"state\": \"^^^^^^**^^**^***##**^^**^^**^**^##*##*\", \"words\": ["
+      "{\"index\": 16, \"payload\": \"io.print\"}, {\"index\": 32, \"payload\": "
+      "\"type.integer\"}, {\"index\": 35, \"payload\": 104}]}, \"apply_stack\": [-1, 0, 31],"
+      " \"result_stack\": []}",
+      state);
+  ASSERT_TRUE(state->verified);
+  eval_set_option(state, EVAL_OPTION_PARALLEL, 2);
+  ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, NULL));
+  ASSERT_TRUE(state->error_code == 0);
+  ASSERT_TRUE(out.len == 1 && out.buf[0] == 'h');
+
+error:
+  eval_free(&state);
+  eval_free(&reference_state);
+  _sb_free(&out);
+  return result;
+}
+
+bool test_lazy(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_state_t* reference_state = NULL;
+  eval_state_t* resumed = NULL;
+  string_buffer_t json;
+  _sb_init(&json);
+  eval_init(&state);
+  eval_init(&reference_state);
+  eval_init(&resumed);
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_LAZY, 1) == 0);
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_MEMO, 64) == ERR_VAL);
+
+  // NOTE: thunks are forced down to the same normal form the strict machine reaches
+  load_fork_tower(reference_state, 8, false);
+  ASSERT_TRUE(eval_run(reference_state, EVAL_STEPS_UNLIMITED, NULL));
+  load_fork_tower(state, 8, false);
+  ASSERT_TRUE(state->verified);
+  ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, NULL));
+  ASSERT_TRUE(state->error_code == 0 && state->lazy_thunks > 0 && state->lazy_forced > 0);
+  ASSERT_TRUE(stbds_arrlenu(state->result_stack) == 1);
+  ASSERT_TRUE(stbds_arrlenu(state->lazy_updates) == 0 && !state->lazy_forcing);
+  size_t expected = reference_state->result_stack[0];
+  ASSERT_TRUE(trees_equal(state, state->result_stack[0], reference_state, expected));
+
+  // NOTE: collections in between keep suspended applications alive
+  load_fork_tower(state, 8, false);
+  for (size_t i = 0; i < 100000 && !eval_run(state, 64, NULL); ++i) {
+    ASSERT_TRUE(state->error_code == 0);
+    eval_gc(state);
+  }
+  ASSERT_TRUE(stbds_arrlenu(state->apply_stack) == 0);
+  ASSERT_TRUE(trees_equal(state, state->result_stack[0], reference_state, expected));
+
+  // NOTE: no dump while a thunk is forced, one taken in between resumes in a fresh state
+  load_fork_tower(state, 8, false);
+  bool refused = false;
+  bool dumped = false;
+  for (size_t i = 0; i < 100000 && !dumped && !eval_run(state, 16, NULL); ++i) {
+    _sb_clear(&json);
+    if (!_eval_stack_portable(state->apply_stack)) {
+      refused = true;
+      ASSERT_TRUE(eval_dump_json(&json, state) == ERR_VAL);
+      ASSERT_TRUE(eval_snapshot_save(state, "/dev/null") == ERR_VAL);
+    } else if (refused) {
+      dumped = true;
+      ASSERT_TRUE(eval_dump_json(&json, state) == 0);
+    }
+  }
+  ASSERT_TRUE(refused && dumped);
+  ASSERT_TRUE(eval_set_option(resumed, EVAL_OPTION_LAZY, 1) == 0);
+  ASSERT_TRUE(eval_load_json(_sb_str_view(&json), resumed) == 0);
+  ASSERT_TRUE(eval_run(resumed, EVAL_STEPS_UNLIMITED, NULL));
+  ASSERT_TRUE(stbds_arrlenu(resumed->result_stack) == 1);
+  ASSERT_TRUE(trees_equal(resumed, resumed->result_stack[0], reference_state, expected));
+
+  // NOTE: a discarded argument is never reduced
+  size_t strict_steps = 0;
+  size_t lazy_steps = 0;
+  load_fork_tower(reference_state, 8, true);
+  ASSERT_TRUE(eval_run(reference_state, EVAL_STEPS_UNLIMITED, &strict_steps));
+  load_fork_tower(state, 8, true);
+  size_t forced = state->lazy_forced;
+  ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, &lazy_steps));
+  ASSERT_TRUE(state->lazy_forced == forced);
+  ASSERT_TRUE(lazy_steps < 10 && strict_steps > 1000);
+  expected = reference_state->result_stack[0];
+  ASSERT_TRUE(trees_equal(state, state->result_stack[0], reference_state, expected));
+
+error:
+  eval_free(&state);
+  eval_free(&reference_state);
+  eval_free(&resumed);
+  _sb_free(&json);
+  return result;
+}
+
+static bool stacks_equal(eval_state_t* a, const size_t* lhs, eval_state_t* b, const size_t* rhs) {
+  if (stbds_arrlenu(lhs) != stbds_arrlenu(rhs)) {
+    return false;
+  }
+  for (size_t i = 0; i < stbds_arrlenu(lhs); ++i) {
+    if (lhs[i] == TOKEN_APPLY || rhs[i] == TOKEN_APPLY) {
+      if (lhs[i] != rhs[i]) {
+        return false;
+      }
+    } else if (!trees_equal(a, lhs[i], b, rhs[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool test_decoded(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_state_t* reference_state = NULL;
+  eval_init(&state);
+  eval_init(&reference_state);
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_ENGINE, EVAL_ENGINE_DECODED) == 0);
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_LAZY, 1) == ERR_VAL);
+
+  // NOTE: same steps and normal form as the cells engine, written back once done
+  size_t steps = 0;
+  size_t expected_steps = 0;
+  load_fork_tower(reference_state, 10, false);
+  ASSERT_TRUE(eval_run(reference_state, EVAL_STEPS_UNLIMITED, &expected_steps));
+  load_fork_tower(state, 10, false);
+  ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, &steps));
+  ASSERT_TRUE(state->decoded == NULL && steps == expected_steps);
+  ASSERT_TRUE(
+      stacks_equal(state, state->result_stack, reference_state, reference_state->result_stack));
+
+  // NOTE: switching engines in the middle of a run
+  load_fork_tower(state, 10, false);
+  ASSERT_TRUE(!eval_run(state, 100, NULL) && state->decoded != NULL);
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_ENGINE, EVAL_ENGINE_CELLS) == 0);
+  ASSERT_TRUE(state->decoded == NULL);
+  ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, &steps));
+  ASSERT_TRUE(steps + 100 == expected_steps);
+  ASSERT_TRUE(
+      stacks_equal(state, state->result_stack, reference_state, reference_state->result_stack));
+
+  // NOTE: interrupted runs keep their translation through collections of the node array
+  // until the cells are asked for
+  const char* json = "{\"cells\": {\"state\": \"^^^^^^****^^****^^^^****^^***"
+                     "^^^^^^****^^****^^^^****^^***\", \"words\": []},"
+                     " \"apply_stack\": [-1, 0, 29], \"result_stack\": []}";
+  eval_set_option(state, EVAL_OPTION_ENGINE, EVAL_ENGINE_DECODED);
+  eval_load_json(json, reference_state);
+  eval_load_json(json, state);
+  ASSERT_TRUE(!eval_run(reference_state, 200000, NULL));
+  for (size_t i = 0; i < 200; ++i) {
+    ASSERT_TRUE(!eval_run(state, 1000, NULL) && state->error_code == 0);
+  }
+  ASSERT_TRUE(state->decoded != NULL && state->decoded->gc_threshold > DECODED_GC_MIN);
+  eval_heap_stats_t stats = {};
+  eval_heap_stats(state, &stats);
+  ASSERT_TRUE(state->decoded == NULL);
+  ASSERT_TRUE(
+      stacks_equal(state, state->apply_stack, reference_state, reference_state->apply_stack));
+  ASSERT_TRUE(
+      stacks_equal(state, state->result_stack, reference_state, reference_state->result_stack));
+
+  // NOTE: natives get their argument as cells
+  native_load_standard(state);
+  eval_load_json(
+      "{\"cells\": {\"state\": \"##*^##*##*\", \"words\": [{\"index\": 0, \"payload\": "
+      "\"io.print\"}, {\"index\": 4, \"payload\": \"type.integer\"}, {\"index\": 7, "
+      "\"payload\": 10}]}, \"apply_stack\": [-1, 0, 3], \"result_stack\": []}",
+      state);
+  ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, NULL));
+  ASSERT_TRUE(stbds_arrlenu(state->result_stack) == 1 && state->result_stack[0] == 3);
+
+error:
+  eval_free(&state);
+  eval_free(&reference_state);
+  return result;
+}
+
+bool test_fuse(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_state_t* reference_state = NULL;
+  eval_init(&state);
+  eval_init(&reference_state);
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_FUSE, 3) == ERR_VAL);
+
+  // NOTE: I applied to a pair, the second and the first of a pair, not true
+  const char* programs[] = {
+      "{\"cells\": {\"state\": \"^^^^****^^***^^**^^***\", \"words\": []}"
+      ", \"apply_stack\": [-1, 0, 13], \"result_stack\": []}",
+      "{\"cells\": {\"state\": \"^^^**^**^^**^^^^****^^***^^**^^***\", \"words\": []}"
+      ", \"apply_stack\": [-1, 0, 25], \"result_stack\": []}",
+      "{\"cells\": {\"state\": \"^^^**^**^^***^^**^^***\", \"words\": []}"
+      ", \"apply_stack\": [-1, 0, 13], \"result_stack\": []}",
+      "{\"cells\": {\"state\": \"^^^^***^^**^**^**^^***\", \"words\": []}"
+      ", \"apply_stack\": [-1, 0, 17], \"result_stack\": []}",
+  };
+  size_t expected_steps = 0;
+  size_t steps = 0;
+  for (size_t i = 0; i < sizeof(programs) / sizeof(*programs); ++i) {
+    eval_load_json(programs[i], reference_state);
+    ASSERT_TRUE(eval_run(reference_state, EVAL_STEPS_UNLIMITED, &expected_steps));
+    size_t expected = reference_state->result_stack[0];
+
+    eval_set_option(state, EVAL_OPTION_FUSE, EVAL_FUSE_ON);
+    eval_load_json(programs[i], state);
+    ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, &steps));
+    ASSERT_TRUE(steps == 1 && expected_steps > 1);
+    ASSERT_TRUE(trees_equal(state, state->result_stack[0], reference_state, expected));
+#ifdef EVAL_STATS
+    eval_stats_t stats = {};
+    ASSERT_TRUE(eval_get_stats(state, &stats) == 0 && stats.rules[EVAL_RULE_FUSED] == i + 1);
+#endif
+
+    // NOTE: checking runs the plain rules as well, so it takes as many steps. Those of the
+    // second of a pair apply I, which is fused and checked too
+    eval_set_option(state, EVAL_OPTION_FUSE, EVAL_FUSE_CHECK);
+    eval_load_json(programs[i], state);
+    state->fuse_hits = 0;
+    ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, &steps));
+    ASSERT_TRUE(steps == expected_steps && state->fuse_hits >= 1);
+    ASSERT_TRUE(stbds_arrlenu(state->fuse_checks) == 0);
+    ASSERT_TRUE(trees_equal(state, state->result_stack[0], reference_state, expected));
+  }
+
+  // NOTE: a wrong tag is caught, the second of the pair is not its first
+  eval_load_json(programs[1], state);
+  ASSERT_TRUE(state->fuse_tags[0] == FUSE_FORK_SECOND);
+  state->fuse_tags[0] = FUSE_FORK_FIRST;
+  ASSERT_TRUE(!eval_run(state, EVAL_STEPS_UNLIMITED, NULL));
+  ASSERT_TRUE(eval_get_error(state, NULL) == ERROR_FUSE_MISMATCH);
+
+  // NOTE: turning it off drops the tags
+  eval_set_option(state, EVAL_OPTION_FUSE, EVAL_FUSE_OFF);
+  eval_load_json(programs[0], state);
+  ASSERT_TRUE(state->fuse_tags == NULL);
+  ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, &steps) && steps > 1);
+
+  // NOTE: the decoded engine doesn't fuse, the two can't be combined
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_ENGINE, EVAL_ENGINE_DECODED) == 0);
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_FUSE, EVAL_FUSE_ON) == ERR_VAL);
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_ENGINE, EVAL_ENGINE_CELLS) == 0);
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_FUSE, EVAL_FUSE_CHECK) == 0);
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_ENGINE, EVAL_ENGINE_DECODED) == ERR_VAL);
+
+error:
+  eval_free(&state);
+  eval_free(&reference_state);
+  return result;
+}
+
+// NOTE: runs the integer native name on ^ a b, or on a alone when unary
+static bool run_integer_native(eval_state_t* state, const char* name, sint a, sint b, bool unary) {
+  char json[512];
+  if (unary) {
+    snprintf(
+        json,
+        sizeof(json),
+        "{\"cells\": {\"state\": \"##*^##*##*\", \"words\": [{\"index\": 0, \"payload\": "
+        "\"%s\"}, {\"index\": 4, \"payload\": \"type.integer\"}, {\"index\": 7, "
+        "\"payload\": %zd}]}, \"apply_stack\": [-1, 0, 3], \"result_stack\": []}",
+        name,
+        a);
+  } else {
+    snprintf(
+        json,
+        sizeof(json),
+        "{\"cells\": {\"state\": \"##*^^##*##*^##*##*\", \"words\": [{\"index\": 0, "
+        "\"payload\": \"%s\"}, {\"index\": 5, \"payload\": \"type.integer\"}, "
+        "{\"index\": 8, \"payload\": %zd}, {\"index\": 12, \"payload\": \"type.integer\"}, "
+        "{\"index\": 15, \"payload\": %zd}]}, \"apply_stack\": [-1, 0, 3], "
+        "\"result_stack\": []}",
+        name,
+        a,
+        b);
+  }
+  eval_load_json(json, state);
+  return eval_run(state, EVAL_STEPS_UNLIMITED, NULL) && stbds_arrlenu(state->result_stack) == 1;
+}
+
+static bool is_integer(eval_state_t* state, size_t index, sint expected) {
+  sint tag = -1;
+  sint value = 0;
+  eval_cells_get_word(state->cells, _eval_get_left_node(state, index), &tag);
+  eval_cells_get_word(state->cells, _eval_get_right_node(state, index), &value);
+  return tag == NATIVE_TYPE_INTEGER && value == expected;
+}
+
+bool test_native_integer(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_init(&state);
+  native_load_standard(state);
+
+  struct {
+    const char* name;
+    sint a;
+    sint b;
+    sint expected;
+  } binary[] = {
+      {"int.add", 2, 3, 5},
+      {"int.add", INTPTR_MIN, -1, INTPTR_MAX},
+      {"int.mul", (sint)1 << 62, 2, INTPTR_MIN},
+      {"int.sub", 2, 5, -3},
+      {"int.mul", -4, 6, -24},
+      {"int.mul", INTPTR_MIN, -1, INTPTR_MIN},
+      {"int.and", 12, 10, 8},
+      {"int.or", 12, 10, 14},
+      {"int.xor", 12, 10, 6},
+      {"int.shl", 1, 65, 2},
+      {"int.shr", -8, 1, -4},
+      {"int.shr", 8, 2, 2},
+  };
+  for (size_t i = 0; i < sizeof(binary) / sizeof(*binary); ++i) {
+    ASSERT_TRUE(run_integer_native(state, binary[i].name, binary[i].a, binary[i].b, false));
+    ASSERT_TRUE(is_integer(state, state->result_stack[0], binary[i].expected));
+  }
+  ASSERT_TRUE(run_integer_native(state, "int.not", 0, 0, true));
+  ASSERT_TRUE(is_integer(state, state->result_stack[0], -1));
+
+  // NOTE: truncating division, the quotient that doesn't fit wraps
+  ASSERT_TRUE(run_integer_native(state, "int.divmod", -7, 2, false));
+  size_t pair = state->result_stack[0];
+  ASSERT_TRUE(is_integer(state, _eval_get_left_node(state, pair), -3));
+  ASSERT_TRUE(is_integer(state, _eval_get_right_node(state, pair), -1));
+  ASSERT_TRUE(run_integer_native(state, "int.divmod", INTPTR_MIN, -1, false));
+  pair = state->result_stack[0];
+  ASSERT_TRUE(is_integer(state, _eval_get_left_node(state, pair), INTPTR_MIN));
+  ASSERT_TRUE(is_integer(state, _eval_get_right_node(state, pair), 0));
+  ASSERT_TRUE(!run_integer_native(state, "int.divmod", 1, 0, false));
+  ASSERT_TRUE(eval_get_error(state, NULL) == ERROR_DIVIDE_BY_ZERO);
+
+  // NOTE: a triage tells the three answers apart
+  ASSERT_TRUE(run_integer_native(state, "int.compare", 1, 2, false));
+  ASSERT_TRUE(_eval_node_kind(state, state->result_stack[0]) == NODE_LEAF);
+  ASSERT_TRUE(run_integer_native(state, "int.compare", 2, 2, false));
+  ASSERT_TRUE(_eval_node_kind(state, state->result_stack[0]) == NODE_STEM);
+  ASSERT_TRUE(run_integer_native(state, "int.compare", 3, -2, false));
+  ASSERT_TRUE(_eval_node_kind(state, state->result_stack[0]) == NODE_FORK);
+
+  // NOTE: 5 goes to a numeral and back
+  ASSERT_TRUE(run_integer_native(state, "int.to_tree", 5, 0, true));
+  size_t node = state->result_stack[0];
+  for (size_t i = 0; i < 5; ++i) {
+    ASSERT_TRUE(_eval_node_kind(state, node) == NODE_STEM);
+    node = _eval_get_left_node(state, node);
+  }
+  ASSERT_TRUE(_eval_node_kind(state, node) == NODE_LEAF);
+  uint symbol = 0;
+  eval_get_native(state, "int.from_tree", &symbol);
+  eval_cells_set_word(state->cells, 0, (sint)symbol);
+  stbds_arrput(state->apply_stack, TOKEN_APPLY);
+  stbds_arrput(state->apply_stack, 0);
+  stbds_arrput(state->apply_stack, stbds_arrpop(state->result_stack));
+  ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, NULL));
+  ASSERT_TRUE(is_integer(state, state->result_stack[0], 5));
+  ASSERT_TRUE(!run_integer_native(state, "int.to_tree", -1, 0, true));
+  ASSERT_TRUE(eval_get_error(state, NULL) == ERROR_INVALID_CAST);
+
+  // NOTE: operands that aren't a pair of integers
+  ASSERT_TRUE(!run_integer_native(state, "int.add", 1, 0, true));
+  ASSERT_TRUE(eval_get_error(state, NULL) == ERROR_INVALID_CAST);
+
+error:
+  eval_free(&state);
+  return result;
+}
+
+// NOTE: applies the native name to arg with cell 0 as the native, the result stays on
+// the result stack so a collection keeps it
+static size_t apply_native(eval_state_t* state, const char* name, size_t arg) {
+  uint symbol = 0;
+  eval_get_native(state, name, &symbol);
+  eval_cells_set_word(state->cells, 0, (sint)symbol);
+  size_t results = stbds_arrlenu(state->result_stack);
+  stbds_arrput(state->apply_stack, TOKEN_APPLY);
+  stbds_arrput(state->apply_stack, 0);
+  stbds_arrput(state->apply_stack, arg);
+  if (!eval_run(state, EVAL_STEPS_UNLIMITED, NULL)
+      || stbds_arrlenu(state->result_stack) != results + 1) {
+    return SIZE_MAX;
+  }
+  return stbds_arrlast(state->result_stack);
+}
+
+static bool is_bytes(eval_state_t* state, size_t value, const char* expected, size_t expected_len) {
+  const char* data = NULL;
+  size_t len = 0;
+  return _bytes_get(state, value, &data, &len) && len == expected_len
+         && memcmp(data, expected, len) == 0;
+}
+
+typedef struct {
+  string_buffer_t out;
+  size_t writes;
+} output_sink_t;
+
+static sint count_writes(void* ctx, const char* data, size_t len) {
+  output_sink_t* sink = ctx;
+  _sb_append_data(&sink->out, data, len);
+  sink->writes++;
+  return 0;
+}
+
+bool test_native_bytes(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_state_t* loaded = NULL;
+  eval_init(&state);
+  native_load_standard(state);
+  output_sink_t sink = {0};
+  _sb_init(&sink.out);
+  eval_set_output(state, count_writes, &sink);
+
+  // NOTE: a native at 0, a leaf at 3 and the list [104, 105] at 6
+  eval_load_json(
+      "{\"cells\": {\"state\": \"##*^**^##*^^##*##*^^##*##**\", \"words\": [{\"index\": 0, "
+      "\"payload\": \"io.print\"}, {\"index\": 7, \"payload\": \"type.list\"}, {\"index\": 12, "
+      "\"payload\": \"type.integer\"}, {\"index\": 15, \"payload\": 104}, {\"index\": 20, "
+      "\"payload\": \"type.integer\"}, {\"index\": 23, \"payload\": 105}]}, \"apply_stack\": [], "
+      "\"result_stack\": []}",
+      state);
+
+  // NOTE: prints of one run leave in one write
+  for (size_t i = 0; i < 100; ++i) {
+    stbds_arrput(state->apply_stack, TOKEN_APPLY);
+    stbds_arrput(state->apply_stack, 0);
+    stbds_arrput(state->apply_stack, 6);
+  }
+  ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, NULL));
+  ASSERT_TRUE(sink.writes == 1 && sink.out.len == 200 && memcmp(sink.out.buf, "hihi", 4) == 0);
+  stbds_arrsetlen(state->result_stack, 0);
+
+  size_t hi = apply_native(state, "bytes.from_list", 6);
+  ASSERT_TRUE(is_bytes(state, hi, "hi", 2));
+  size_t list = apply_native(state, "bytes.to_list", hi);
+  ASSERT_TRUE(is_bytes(state, apply_native(state, "bytes.from_list", list), "hi", 2));
+
+  // NOTE: doubled to a megabyte through ^ b b, then printed in one write
+  size_t big = hi;
+  for (size_t i = 0; i < 19; ++i) {
+    stbds_arrput(state->apply_stack, TOKEN_APPLY);
+    stbds_arrput(state->apply_stack, TOKEN_APPLY);
+    stbds_arrput(state->apply_stack, 3);
+    stbds_arrput(state->apply_stack, big);
+    stbds_arrput(state->apply_stack, big);
+    ASSERT_TRUE(eval_run(state, EVAL_STEPS_UNLIMITED, NULL));
+    big = apply_native(state, "bytes.concat", stbds_arrlast(state->result_stack));
+    ASSERT_TRUE(big != SIZE_MAX);
+  }
+  ASSERT_TRUE(is_integer(state, apply_native(state, "bytes.length", big), 1 << 20));
+  sink.writes = 0;
+  _sb_clear(&sink.out);
+  ASSERT_TRUE(apply_native(state, "io.print", big) == big);
+  ASSERT_TRUE(sink.writes == 1 && sink.out.len == 1 << 20);
+  ASSERT_TRUE(memcmp(sink.out.buf + (1 << 20) - 2, "hi", 2) == 0);
+
+  // NOTE: a reloaded byte string keeps its id only, printing it raises
+  string_buffer_t json = {0};
+  _sb_init(&json);
+  eval_init(&loaded);
+  native_load_standard(loaded);
+  eval_dump_json(&json, state);
+  eval_load_json(_sb_str_view(&json), loaded);
+  _sb_free(&json);
+  ASSERT_TRUE(apply_native(loaded, "io.print", hi) == SIZE_MAX);
+  ASSERT_TRUE(eval_get_error(loaded, NULL) == ERROR_INVALID_CAST);
+
+  // NOTE: unreachable byte strings are freed by a collection
+  ASSERT_TRUE(apply_native(state, "bytes.length", 6) == SIZE_MAX);
+  ASSERT_TRUE(eval_get_error(state, NULL) == ERROR_INVALID_CAST);
+  stbds_arrsetlen(state->apply_stack, 0);
+  stbds_arrsetlen(state->result_stack, 0);
+  eval_gc(state);
+  ASSERT_TRUE(stbds_arrlenu(state->bytes_free) == stbds_arrlenu(state->bytes));
+
+error:
+  eval_free(&state);
+  eval_free(&loaded);
+  _sb_free(&sink.out);
+  return result;
+}
+
+bool test_snapshot(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_state_t* loaded = NULL;
+  eval_state_t* memo = NULL;
+  eval_state_t* resumed = NULL;
+  eval_state_t* reference = NULL;
+  eval_init(&state);
+  eval_init(&loaded);
+  eval_init(&memo);
+  eval_init(&resumed);
+  eval_init(&reference);
+  native_load_standard(state);
+  native_load_standard(loaded);
+  char path[] = "/tmp/eval-snapshot-XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_TRUE(fd >= 0);
+  close(fd);
+
+  // NOTE: a non terminating image, saved after a collection left holes in the heap
+  const char* json = "{\"cells\": {\"state\": \"^^^^^^****^^****^^^^****^^***"
+                     "^^^^^^****^^****^^^^****^^***\", \"words\": []},"
+                     " \"apply_stack\": [-1, 0, 29], \"result_stack\": []}";
+  eval_load_json(json, state);
+  eval_run(state, 3000, NULL);
+  eval_gc(state);
+  eval_run(state, 100, NULL);
+  ASSERT_TRUE(state->error_code == 0);
+  ASSERT_TRUE(eval_snapshot_save(state, path) == 0);
+  ASSERT_TRUE(eval_snapshot_load(loaded, path) == 0);
+  ASSERT_TRUE(loaded->verified);
+  ASSERT_TRUE(loaded->cells->mapping != NULL);
+  ASSERT_TRUE(compare_states(loaded, state));
+  eval_heap_stats_t expected = {}, actual = {};
+  eval_heap_stats(state, &expected);
+  eval_heap_stats(loaded, &actual);
+  ASSERT_TRUE(actual.top == expected.top && actual.used == expected.used);
+  ASSERT_TRUE(heap_stats_consistent(loaded));
+
+  // NOTE: enough steps to grow the cells out of the mapping
+  for (size_t i = 0; i < 20000; ++i) {
+    eval_step(state);
+    eval_step(loaded);
+    ASSERT_TRUE(state->error_code == 0 && loaded->error_code == 0);
+  }
+  ASSERT_TRUE(loaded->cells->mapping == NULL);
+  ASSERT_TRUE(compare_states(loaded, state));
+
+  // NOTE: native words are saved by name and resolved by the loading state
+  eval_load_json(
+      "{\"cells\": {\"state\": \"##*^##*##*\", \"words\": [{\"index\": 0, \"payload\": "
+      "\"io.print\"}, {\"index\": 4, \"payload\": \"type.integer\"}, {\"index\": 7, "
+      "\"payload\": 42}]}, \"apply_stack\": [-1, 0, 3], \"result_stack\": []}",
+      state);
+  ASSERT_TRUE(state->error_code == 0);
+  ASSERT_TRUE(eval_snapshot_save(state, path) == 0);
+  uint symbol = 0;
+  eval_get_native(state, "type.integer", &symbol);
+  eval_add_native(loaded, "io.print", symbol);
+  ASSERT_TRUE(eval_snapshot_load(loaded, path) == 0);
+  sint word = 0;
+  ASSERT_TRUE(eval_cells_get_word(loaded->cells, 0, &word) == 0);
+  ASSERT_TRUE((uint)word == symbol);
+  ASSERT_TRUE(eval_cells_get_word(loaded->cells, 7, &word) == 0 && word == 42);
+
+  // NOTE: memo frames are not saved, a resumed run must not complete them
+  ASSERT_TRUE(eval_set_option(memo, EVAL_OPTION_MEMO, 64) == 0);
+  ASSERT_TRUE(eval_set_option(resumed, EVAL_OPTION_MEMO, 64) == 0);
+  load_fork_tower(memo, 8, false);
+  load_fork_tower(reference, 8, false);
+  ASSERT_TRUE(eval_run(reference, EVAL_STEPS_UNLIMITED, NULL));
+  eval_run(memo, 2, NULL);
+  ASSERT_TRUE(memo->error_code == 0 && stbds_arrlenu(memo->memo_frames) > 0);
+  ASSERT_TRUE(eval_snapshot_save(memo, path) == 0);
+  ASSERT_TRUE(eval_snapshot_load(resumed, path) == 0);
+  for (size_t i = 0; i < stbds_arrlenu(resumed->apply_stack); ++i) {
+    ASSERT_TRUE(resumed->apply_stack[i] != TOKEN_MEMO);
+  }
+  ASSERT_TRUE(eval_run(resumed, EVAL_STEPS_UNLIMITED, NULL));
+  ASSERT_TRUE(stbds_arrlenu(resumed->result_stack) == 1);
+  ASSERT_TRUE(trees_equal(
+      resumed, resumed->result_stack[0], reference, reference->result_stack[0]));
+
+  // NOTE: a truncated file is rejected
+  ASSERT_TRUE(truncate(path, 16) == 0);
+  ASSERT_TRUE(eval_snapshot_load(loaded, path) == ERR_VAL);
+
+error:
+  unlink(path);
+  eval_free(&state);
+  eval_free(&loaded);
+  eval_free(&memo);
+  eval_free(&resumed);
+  eval_free(&reference);
+  return result;
+}
+
+bool test_trace(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_state_t* replay = NULL;
+  eval_init(&state);
+  eval_init(&replay);
+  char snapshot[] = "/tmp/eval-snapshot-XXXXXX";
+  char trace[] = "/tmp/eval-trace-XXXXXX";
+  int fd = mkstemp(snapshot);
+  ASSERT_TRUE(fd >= 0);
+  close(fd);
+  fd = mkstemp(trace);
+  ASSERT_TRUE(fd >= 0);
+  close(fd);
+  eval_trace_record_t traced[64] = {0};
+  eval_trace_record_t replayed[64] = {0};
+  size_t traced_count = 0;
+  size_t replayed_count = 0;
+
+  const char* json = "{\"cells\": {\"state\": \"^^^^^^****^^****^^^^****^^***"
+                     "^^^^^^****^^****^^^^****^^***\", \"words\": []},"
+                     " \"apply_stack\": [-1, 0, 29], \"result_stack\": []}";
+  eval_load_json(json, state);
+  eval_run(state, 3000, NULL);
+  ASSERT_TRUE(eval_trace_start(state, 64, snapshot) == 0);
+  ASSERT_TRUE(eval_set_option(state, EVAL_OPTION_ENGINE, EVAL_ENGINE_DECODED) == ERR_VAL);
+  eval_run(state, 1000, NULL);
+  ASSERT_TRUE(state->error_code == 0);
+  ASSERT_TRUE(eval_trace_read(state, traced, 64, &traced_count) == 0 && traced_count == 64);
+  ASSERT_TRUE(traced[63].step == 999);
+  for (size_t i = 1; i < traced_count; ++i) {
+    ASSERT_TRUE(traced[i].step > traced[i - 1].step && traced[i].rule < EVAL_TRACE_FUSED);
+  }
+
+  // NOTE: the file holds what the ring kept, oldest first
+  ASSERT_TRUE(eval_trace_save(state, trace) == 0);
+  FILE* f = fopen(trace, "rb");
+  ASSERT_TRUE(f);
+  trace_header_t header = {0};
+  size_t read = fread(&header, sizeof(header), 1, f);
+  read += fread(replayed, sizeof(*replayed), 64, f);
+  fclose(f);
+  ASSERT_TRUE(read == 65 && memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0);
+  ASSERT_TRUE(header.steps == 1000 && header.count == 64 && header.dropped > 0);
+  ASSERT_TRUE(memcmp(replayed, traced, sizeof(traced)) == 0);
+
+  // NOTE: reducing the snapshot again takes the very same steps
+  ASSERT_TRUE(eval_snapshot_load(replay, snapshot) == 0);
+  ASSERT_TRUE(eval_trace_start(replay, 64, NULL) == 0);
+  eval_run(replay, 1000, NULL);
+  ASSERT_TRUE(eval_trace_read(replay, replayed, 64, &replayed_count) == 0);
+  ASSERT_TRUE(replayed_count == 64 && memcmp(replayed, traced, sizeof(traced)) == 0);
+  ASSERT_TRUE(compare_states(replay, state));
+  ASSERT_TRUE(eval_trace_stop(state) == 0 && state->trace == NULL);
+
+error:
+  eval_free(&state);
+  eval_free(&replay);
+  unlink(snapshot);
+  unlink(trace);
+  return result;
+}
+
+bool test_node_index(test_data_t _) {
+  bool result = true;
+  eval_state_t* state = NULL;
+  eval_init(&state);
+
+  const char* json = "{\"cells\": {\"state\": \"^^^^^^****^^****^^^^****^^***"
+                     "^^^^^^****^^****^^^^****^^***\", \"words\": []},"
+                     " \"apply_stack\": [-1, 0, 29], \"result_stack\": []}";
+  eval_load_json(json, state);
+  ASSERT_TRUE(state->node_index_valid);
+  ASSERT_TRUE(_eval_node_kind(state, 0) == NODE_FORK);
+  ASSERT_TRUE(_eval_node_span(state, 0) == 29);
+  ASSERT_TRUE(_eval_node_kind(state, 1) == NODE_STEM);
+  ASSERT_TRUE(_eval_node_kind(state, 2) == NODE_FORK);
+  ASSERT_TRUE(_eval_node_kind(state, 5) == NODE_LEAF);
+  ASSERT_TRUE(_eval_node_kind(state, 6) == NODE_NIL);
+
+  // NOTE: allocations keep the index up to date, compare with scanning the cells
+  eval_run(state, 1000, NULL);
+  ASSERT_TRUE(state->error_code == 0);
+  for (size_t i = 0; i < state->heap_top; ++i) {
+    if (_eval_node_kind(state, i) == NODE_NONE || !_bitmap_get_bit(state->free_bitmap, i)) {
+      continue;
+    }
+    size_t left = _eval_get_left_node(state, i);
+    size_t right = _eval_get_right_node(state, i);
+    bool terminal = _eval_is_terminal(state, i);
+    state->node_index_valid = false;
+    ASSERT_TRUE(left == _eval_get_left_node(state, i));
+    ASSERT_TRUE(right == _eval_get_right_node(state, i));
+    ASSERT_TRUE(terminal == _eval_is_terminal(state, i));
+    state->node_index_valid = true;
+  }
+
+  // NOTE: an incomplete image disables the index
+  eval_load_json(
+      "{\"cells\": {\"state\": \"^^*\", \"words\": []}, \"apply_stack\": [],"
+      " \"result_stack\": []}",
+      state);
+  ASSERT_TRUE(!state->node_index_valid);
+
+error:
+  eval_free(&state);
+  return result;
+}
+
+bool test_subtree_end(test_data_t _) {
+  bool result = true;
+  allocator_t* cells = NULL;
+  eval_cells_init(&cells, 4);
+
+  uint seed = 42;
+  size_t top = 0;
+  while (top < 4096) {
+    top = _fixture_random_tree(cells, top, &seed, 12, true);
+  }
+
+  // NOTE: both scanners have to agree everywhere, unset cells past top included
+  for (size_t i = 0; i < top; ++i) {
+    size_t fast = 0;
+    size_t scalar = 0;
+    sint fast_err = eval_cells_subtree_end(cells, i, &fast);
+    sint scalar_err = eval_cells_subtree_end_scalar(cells, i, &scalar);
+    ASSERT_TRUE(fast_err == scalar_err);
+    ASSERT_TRUE(fast_err == ERR_VAL || fast == scalar);
+  }
+
+  size_t end = 0;
+  ASSERT_TRUE(eval_cells_subtree_end(cells, top, &end) == ERR_VAL);
+  eval_cells_set(cells, top, SIGIL_TREE);
+  eval_cells_set(cells, top + 1, SIGIL_NIL);
+  ASSERT_TRUE(eval_cells_subtree_end(cells, top, &end) == ERR_VAL);
+  eval_cells_set(cells, top + 2, SIGIL_NIL);
+  ASSERT_TRUE(eval_cells_subtree_end(cells, top, &end) == 0 && end == top + 3);
+
+error:
+  eval_cells_free(&cells);
+  return result;
+}
+
 bool test_eval(test_data_t data) {
   sint err = 0;
   assert(data.tag == test_data_json);
@@ -305,12 +1831,11 @@ bool test_eval(test_data_t data) {
 
   _json_parser_init(json, parser);
   _JSON_PARSER_EAT(ARRAY, 1);
-  size_t cases_count = parser->entries_count;
 
   string_buffer_t debug_buffer;
   _sb_init(&debug_buffer);
 
-  for (size_t case_num = 0; case_num < cases_count; case_num++) {
+  for (size_t case_num = 0; _json_parser_next_entry(parser); case_num++) {
     _JSON_PARSER_EAT(OBJECT, 1);
 
     _JSON_PARSER_EAT_KEY("name", 1);
@@ -331,17 +1856,16 @@ bool test_eval(test_data_t data) {
     sint fully_evaluated = 0;
 
     if (output_final) {
-      while (true) {
-        fully_evaluated = eval_step(state);
-        if (state->error_code) {
-          logg("%s", state->error);
-          err = state->error_code;
-          goto dump_states;
-        }
-
-        if (fully_evaluated) {
-          break;
-        }
+      fully_evaluated = eval_run(state, EVAL_STEPS_UNLIMITED, NULL);
+      if (state->error_code) {
+        logg("%s", state->error);
+        err = state->error_code;
+        goto dump_states;
+      }
+      if (!fully_evaluated) {
+        err = 1;
+        logg_s("not fully evaluated");
+        goto dump_states;
       }
 
       _JSON_PARSER_EAT_KEY("output", 1);
@@ -353,14 +1877,15 @@ bool test_eval(test_data_t data) {
         logg_s("states are not equal");
         goto dump_states;
       }
+      _JSON_PARSER_EAT(END, 1);
+      _JSON_PARSER_EAT(END, 1);
 
-      goto error;
+      continue;
     }
 
     _JSON_PARSER_EAT_KEY("output", 1);
     _JSON_PARSER_EAT(ARRAY, 1);
-    size_t output_count = parser->entries_count;
-    for (size_t step_count = 0; step_count < output_count; ++step_count) {
+    while (_json_parser_next_entry(parser)) {
       err = _eval_load_json(parser, reference_state);
       CHECK_ERROR({ logg_s("failed eval_load_json"); })
 
@@ -382,11 +1907,16 @@ bool test_eval(test_data_t data) {
       logg_s("not fully evaluated");
       goto dump_states;
     }
+    _JSON_PARSER_EAT(END, 1);
 
     // _eval_debug_dump(state, &debug_buffer);
     // printf("%s", _sb_str_view(&debug_buffer));
     // _sb_clear(&debug_buffer);
   }
+  if (parser->was_err) {
+    err = 1;
+    logg_s("malformed testsuite");
+  }
 
   goto error;
 
@@ -437,6 +1967,77 @@ int main() {
       STR(test_memory_many_cells),
       (test_data_t){.name = STR(test_memory_many_cells)});
 
+  add_case(
+      &cases,
+      test_eval_run_budget,
+      STR(test_eval_run_budget),
+      (test_data_t){.name = STR(test_eval_run_budget)});
+
+  add_case(
+      &cases,
+      test_gc_reachability,
+      STR(test_gc_reachability),
+      (test_data_t){.name = STR(test_gc_reachability)});
+  add_case(
+      &cases,
+      test_gc_bounded_heap,
+      STR(test_gc_bounded_heap),
+      (test_data_t){.name = STR(test_gc_bounded_heap)});
+
+  add_case(
+      &cases,
+      test_heap_allocator,
+      STR(test_heap_allocator),
+      (test_data_t){.name = STR(test_heap_allocator)});
+
+  add_case(
+      &cases,
+      test_node_index,
+      STR(test_node_index),
+      (test_data_t){.name = STR(test_node_index)});
+  add_case(
+      &cases, test_intern, STR(test_intern), (test_data_t){.name = STR(test_intern)});
+  add_case(&cases, test_memo, STR(test_memo), (test_data_t){.name = STR(test_memo)});
+  add_case(&cases, test_stats, STR(test_stats), (test_data_t){.name = STR(test_stats)});
+  add_case(&cases, test_verify, STR(test_verify), (test_data_t){.name = STR(test_verify)});
+  add_case(
+      &cases,
+      test_dump_collected,
+      STR(test_dump_collected),
+      (test_data_t){.name = STR(test_dump_collected)});
+  add_case(
+      &cases,
+      test_load_json_stream,
+      STR(test_load_json_stream),
+      (test_data_t){.name = STR(test_load_json_stream)});
+  add_case(
+      &cases, test_dump_json, STR(test_dump_json), (test_data_t){.name = STR(test_dump_json)});
+  add_case(&cases, test_threads, STR(test_threads), (test_data_t){.name = STR(test_threads)});
+  add_case(&cases, test_batch, STR(test_batch), (test_data_t){.name = STR(test_batch)});
+  add_case(&cases, test_parallel, STR(test_parallel), (test_data_t){.name = STR(test_parallel)});
+  add_case(&cases, test_lazy, STR(test_lazy), (test_data_t){.name = STR(test_lazy)});
+  add_case(
+      &cases, test_decoded, STR(test_decoded), (test_data_t){.name = STR(test_decoded)});
+  add_case(&cases, test_fuse, STR(test_fuse), (test_data_t){.name = STR(test_fuse)});
+  add_case(
+      &cases,
+      test_native_integer,
+      STR(test_native_integer),
+      (test_data_t){.name = STR(test_native_integer)});
+  add_case(
+      &cases,
+      test_native_bytes,
+      STR(test_native_bytes),
+      (test_data_t){.name = STR(test_native_bytes)});
+  add_case(
+      &cases, test_snapshot, STR(test_snapshot), (test_data_t){.name = STR(test_snapshot)});
+  add_case(&cases, test_trace, STR(test_trace), (test_data_t){.name = STR(test_trace)});
+  add_case(
+      &cases,
+      test_subtree_end,
+      STR(test_subtree_end),
+      (test_data_t){.name = STR(test_subtree_end)});
+
   add_file_case("eval-smoke");
   add_file_case("eval-native");
 
@@ -0,0 +1,141 @@
+#define _POSIX_C_SOURCE 200809L
+#include "api.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vendor/stb_ds.h"
+
+#include "eval.h"
+#include "memo.h"
+#include "memory.h"
+#include "trace.h"
+
+// NOTE: while no trace runs, recording costs a branch per reduce call. The rule sites of
+// `reduce` fill the pending record and the run loop commits it into the ring, overwriting
+// the oldest record once the ring is full. The heap is collected before the snapshot is
+// saved. A replay collects its loaded heap too, so both start from the same free lists
+// and the same collection schedule
+
+static bool pushes_node(u8 rule) {
+  return rule == EVAL_RULE_0A || rule == EVAL_RULE_0B || rule == EVAL_RULE_1
+         || rule == EVAL_RULE_3A || rule == EVAL_RULE_NATIVE || rule == EVAL_TRACE_FUSED;
+}
+
+void _trace_begin(eval_state_t* state, u8 rule, size_t F, size_t z) {
+  trace_t* t = state->trace;
+  t->pending = (eval_trace_record_t){
+      .step = t->steps, .f = F, .z = z, .result = EVAL_TRACE_NONE, .rule = rule};
+  t->has_pending = true;
+  t->allocated = state->gc_allocated;
+}
+
+// NOTE: collections only run before a step, so the allocation counter grows within one
+void _trace_end(eval_state_t* state) {
+  trace_t* t = state->trace;
+  if (t->has_pending) {
+    eval_trace_record_t* r = &t->pending;
+    if (pushes_node(r->rule) && stbds_arrlenu(state->apply_stack) > 0) {
+      r->result = stbds_arrlast(state->apply_stack);
+    }
+    r->cells = (uint32_t)(state->gc_allocated - t->allocated);
+    t->records[t->written % t->capacity] = *r;
+    t->written++;
+    t->has_pending = false;
+  }
+  t->steps++;
+}
+
+void _trace_free(eval_state_t* state) {
+  if (!state->trace) {
+    return;
+  }
+  free(state->trace->records);
+  free(state->trace);
+  state->trace = NULL;
+}
+
+sint eval_trace_start(eval_state_t* state, size_t capacity, const char* snapshot_path) {
+  if (!state || capacity == 0 || state->engine == EVAL_ENGINE_DECODED) {
+    return ERR_VAL;
+  }
+  _trace_free(state);
+  eval_gc(state);
+  if (snapshot_path && eval_snapshot_save(state, snapshot_path) == ERR_VAL) {
+    return ERR_VAL;
+  }
+  trace_t* t = calloc(1, sizeof(*t));
+  if (!t) {
+    return ERR_VAL;
+  }
+  t->records = malloc(capacity * sizeof(*t->records));
+  if (!t->records) {
+    free(t);
+    return ERR_VAL;
+  }
+  t->capacity = capacity;
+  state->trace = t;
+  return 0;
+}
+
+sint eval_trace_stop(eval_state_t* state) {
+  if (!state) {
+    return ERR_VAL;
+  }
+  _trace_free(state);
+  return 0;
+}
+
+sint eval_trace_read(
+    eval_state_t* state, eval_trace_record_t* records, size_t capacity, size_t* count) {
+  if (!state || !state->trace || !count) {
+    return ERR_VAL;
+  }
+  trace_t* t = state->trace;
+  size_t kept = t->written < t->capacity ? t->written : t->capacity;
+  size_t n = kept < capacity ? kept : capacity;
+  for (size_t i = 0; i < n; ++i) {
+    records[i] = t->records[(t->written - n + i) % t->capacity];
+  }
+  *count = n;
+  return 0;
+}
+
+sint eval_trace_save(eval_state_t* state, const char* path) {
+  if (!state || !state->trace || !path) {
+    return ERR_VAL;
+  }
+  trace_t* t = state->trace;
+  size_t kept = t->written < t->capacity ? t->written : t->capacity;
+  trace_header_t header = {
+      .version = TRACE_VERSION,
+      .record_size = sizeof(eval_trace_record_t),
+      .steps = t->steps,
+      .dropped = t->written - kept,
+      .count = kept,
+      .intern = state->cells->interning,
+      .memo = (int64_t)(state->memo_sets * MEMO_WAYS),
+      .lazy = state->lazy,
+      .fuse = state->fuse,
+  };
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+
+  FILE* f = fopen(path, "wb");
+  if (!f) {
+    return ERR_VAL;
+  }
+  sint err = fwrite(&header, sizeof(header), 1, f) == 1 ? 0 : ERR_VAL;
+  // NOTE: the ring is written in two parts, from the oldest record to its end and the rest
+  size_t first = t->written > t->capacity ? t->written % t->capacity : 0;
+  if (!err && fwrite(t->records + first, sizeof(*t->records), kept - first, f) != kept - first) {
+    err = ERR_VAL;
+  }
+  if (!err && fwrite(t->records, sizeof(*t->records), first, f) != first) {
+    err = ERR_VAL;
+  }
+  if (fclose(f) != 0) {
+    err = ERR_VAL;
+  }
+  return err;
+}
@@ -0,0 +1,42 @@
+#ifndef __EVAL_TRACE__
+#define __EVAL_TRACE__
+
+#include "api.h"
+#include <stdbool.h>
+
+// NOTE: binary step trace, see `eval_trace_start`. A trace file is this header followed by
+// count records, oldest first. Steps are counted from the snapshot saved at the start,
+// options are the ones of the traced state, so a replay can reduce the same way
+
+#define TRACE_MAGIC   "VETOTRAC"
+#define TRACE_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t steps;   // reduce calls traced
+  uint64_t dropped; // records the ring overwrote before the save
+  uint64_t count;   // records that follow
+  int64_t intern;   // EVAL_OPTION_INTERN
+  int64_t memo;     // EVAL_OPTION_MEMO
+  int64_t lazy;     // EVAL_OPTION_LAZY
+  int64_t fuse;     // EVAL_OPTION_FUSE
+} trace_header_t;
+
+typedef struct trace_t {
+  eval_trace_record_t* records;
+  size_t capacity;
+  uint64_t written;
+  uint64_t steps;
+  // NOTE: the record of the step being reduced, committed by `_trace_end`
+  eval_trace_record_t pending;
+  bool has_pending;
+  size_t allocated;
+} trace_t;
+
+void _trace_begin(eval_state_t* state, u8 rule, size_t F, size_t z);
+void _trace_end(eval_state_t* state);
+void _trace_free(eval_state_t* state);
+
+#endif
@@ -0,0 +1,169 @@
+#define _POSIX_C_SOURCE 200809L
+#include "api.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+// NOTE: inspects and replays step traces saved by `eval_trace_save`
+//   trace_eval <trace>                    prints the header, steps per rule and the records
+//   trace_eval <trace> <snapshot> <step>  reduces the snapshot saved by `eval_trace_start` up
+//                                         to the step, checking each traced step on the way,
+//                                         and prints the state there as JSON
+// Natives are resolved against the standard set, output of io.print is dropped
+
+static const char* RULE_NAMES[EVAL_RULES] = {
+    "0a", "0b", "1", "2", "3a", "3b", "3c", "native", "fused"};
+
+static const char* rule_name(uint32_t rule) {
+  return rule < EVAL_RULES ? RULE_NAMES[rule] : "?";
+}
+
+static bool load_trace(const char* path, trace_header_t* header, eval_trace_record_t** records) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "can't open %s\n", path);
+    return false;
+  }
+  bool ok = fread(header, sizeof(*header), 1, f) == 1
+            && memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) == 0
+            && header->version == TRACE_VERSION
+            && header->record_size == sizeof(eval_trace_record_t);
+  *records = ok ? malloc(header->count * sizeof(**records) + 1) : NULL;
+  ok = ok && *records && fread(*records, sizeof(**records), header->count, f) == header->count;
+  fclose(f);
+  if (!ok) {
+    fprintf(stderr, "%s is not a trace\n", path);
+  }
+  return ok;
+}
+
+static void print_record(FILE* out, const eval_trace_record_t* r) {
+  fprintf(
+      out,
+      "%llu %s f=%llu z=%llu",
+      (unsigned long long)r->step,
+      rule_name(r->rule),
+      (unsigned long long)r->f,
+      (unsigned long long)r->z);
+  if (r->result != EVAL_TRACE_NONE) {
+    fprintf(out, " result=%llu", (unsigned long long)r->result);
+  }
+  fprintf(out, " cells=%u\n", r->cells);
+}
+
+static void inspect(const trace_header_t* header, const eval_trace_record_t* records) {
+  printf(
+      "steps %llu, records %llu, dropped %llu, intern %lld, memo %lld, lazy %lld, fuse %lld\n",
+      (unsigned long long)header->steps,
+      (unsigned long long)header->count,
+      (unsigned long long)header->dropped,
+      (long long)header->intern,
+      (long long)header->memo,
+      (long long)header->lazy,
+      (long long)header->fuse);
+  size_t rules[EVAL_RULES] = {0};
+  unsigned long long cells = 0;
+  for (size_t i = 0; i < header->count; ++i) {
+    rules[records[i].rule < EVAL_RULES ? records[i].rule : EVAL_RULE_FUSED]++;
+    cells += records[i].cells;
+  }
+  for (size_t i = 0; i < EVAL_RULES; ++i) {
+    printf("%s%s %zu", i ? ", " : "", RULE_NAMES[i], rules[i]);
+  }
+  printf(", cells %llu\n", cells);
+  for (size_t i = 0; i < header->count; ++i) {
+    print_record(stdout, &records[i]);
+  }
+}
+
+static sint discard(void* ctx, const char* data, size_t len) {
+  (void)ctx;
+  (void)data;
+  (void)len;
+  return 0;
+}
+
+static int replay(
+    const trace_header_t* header,
+    const eval_trace_record_t* records,
+    const char* snapshot,
+    size_t target) {
+  int rc = 1;
+  eval_state_t* state = NULL;
+  if (eval_init(&state) == ERR_VAL) {
+    return rc;
+  }
+  native_load_standard(state);
+  eval_set_output(state, discard, NULL);
+  if ((header->intern && eval_set_option(state, EVAL_OPTION_INTERN, 1) == ERR_VAL)
+      || (header->memo && eval_set_option(state, EVAL_OPTION_MEMO, header->memo) == ERR_VAL)
+      || (header->lazy && eval_set_option(state, EVAL_OPTION_LAZY, 1) == ERR_VAL)
+      || eval_set_option(state, EVAL_OPTION_FUSE, header->fuse) == ERR_VAL) {
+    fprintf(stderr, "can't set the options of the trace\n");
+    goto error;
+  }
+  // NOTE: a one record trace of the replay, started like the traced run was
+  if (eval_snapshot_load(state, snapshot) == ERR_VAL
+      || eval_trace_start(state, 1, NULL) == ERR_VAL) {
+    fprintf(stderr, "can't load %s\n", snapshot);
+    goto error;
+  }
+
+  size_t next = 0;
+  for (size_t step = 0; step < target; ++step) {
+    sint done = eval_step(state);
+    const char* message = NULL;
+    if (eval_get_error(state, &message)) {
+      fprintf(stderr, "step %zu failed: %s\n", step, message);
+      goto error;
+    }
+    eval_trace_record_t replayed = {0};
+    size_t count = 0;
+    eval_trace_read(state, &replayed, 1, &count);
+    while (next < header->count && records[next].step < step) {
+      next++;
+    }
+    if (next < header->count && records[next].step == step) {
+      if (count == 0 || memcmp(&replayed, &records[next], sizeof(replayed)) != 0) {
+        fprintf(stderr, "step %zu diverges, traced and replayed:\n", step);
+        print_record(stderr, &records[next]);
+        print_record(stderr, &replayed);
+        goto error;
+      }
+      next++;
+    }
+    if (done) {
+      break;
+    }
+  }
+  rc = eval_dump_json_fd(1, state) == ERR_VAL;
+  printf("\n");
+
+error:
+  eval_free(&state);
+  return rc;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2 && argc != 4) {
+    fprintf(stderr, "usage: %s <trace> [<snapshot> <step>]\n", argv[0]);
+    return 2;
+  }
+  trace_header_t header;
+  eval_trace_record_t* records = NULL;
+  if (!load_trace(argv[1], &header, &records)) {
+    free(records);
+    return 1;
+  }
+  int rc = 0;
+  if (argc == 2) {
+    inspect(&header, records);
+  } else {
+    rc = replay(&header, records, argv[2], strtoull(argv[3], NULL, 10));
+  }
+  free(records);
+  return rc;
+}
@@ -2,12 +2,15 @@
 #include <stdarg.h>
 #include <stdio.h>
 
+// NOTE: every new stb_ds table advances a hash seed, it is _Thread_local so that states on
+// different threads can create tables concurrently
+#if !defined(__STDC_VERSION__) || __STDC_VERSION__ < 201112L
+#error "the library is built as C11, see build.ninja"
+#endif
+
 #define STB_DS_IMPLEMENTATION
 #include "vendor/stb_ds.h"
 
-// NOTE: this is an implementation
-#include "vendor/jsmn.h"
-
 #include "util.h"
 
 // Initialize an empty buffer with a small initial capacity